@@ -1,54 +1,1904 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdarg.h>
 
+#include "d2s_tables.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * The storage of a list, its elements follow this header. Slices and column views point into the elements of a list
+ * and share its buffer, which is freed once the last of them is destroyed. The elements of a list read from a file
+ * are the mapping of that file instead, which is unmapped along with the buffer.
+ */
+struct ArrayBuffer {
+    _Alignas(16) atomic_uint refCount;
+    void* mapping;
+    size_t mappedBytes;
+};
+
+/*
+ * A list or a view of one. A view of a Columns list keeps the capacity of its list, which is where each column
+ * starts, and how many elements it skips in each column as its offset. Other views point arr at their first element.
+ */
  struct ArrayRef {
     void* arr;
     unsigned int size;
     unsigned int capacity;
     unsigned int itemSize;
+    unsigned int offset;
+    struct ArrayBuffer* buffer;
+};
+
+/*
+ * Output. Everything printed goes through a buffer per thread, written to stdout when it fills, when the thread ends a
+ * range of a parallel job, and at exit, so printing a value doesn't cost a call into stdio. LETLANG_OUTPUT=binary
+ * makes printds write its values as raw doubles, the format mapFloats reads, instead of text.
+ */
+
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+// The longest a value gets written as, such as -2.2250738585072014e-308 and a separator.
+#define MAX_VALUE_LENGTH 32
+
+struct OutputBuffer {
+    size_t used;
+    struct OutputBuffer* next;
+    char data[OUTPUT_BUFFER_SIZE];
+};
+
+static _Thread_local struct OutputBuffer* threadOutput = NULL;
+static struct OutputBuffer* allOutputs = NULL;
+static pthread_mutex_t outputLock = PTHREAD_MUTEX_INITIALIZER;
+static int binaryOutput = -1;
+
+static void writeAll(const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, length);
+
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (written <= 0) {
+            return;
+        }
+
+        data += written;
+        length -= written;
+    }
+}
+
+static void writeOutput(struct OutputBuffer* buffer) {
+    writeAll(buffer->data, buffer->used);
+    buffer->used = 0;
+}
+
+static void flushAllOutput() {
+    pthread_mutex_lock(&outputLock);
+
+    for (struct OutputBuffer* buffer = allOutputs; buffer != NULL; buffer = buffer->next) {
+        writeOutput(buffer);
+    }
+
+    pthread_mutex_unlock(&outputLock);
+}
+
+/*
+ * Writes out what this thread has printed so far, so that it comes before anything another thread prints after it.
+ */
+static void flushThreadOutput() {
+    if (threadOutput != NULL && threadOutput->used > 0) {
+        writeOutput(threadOutput);
+    }
+}
+
+/*
+ * Reports an error the program can't continue from and exits. What was printed before it is written out first, so
+ * the message comes after it as it did in the program.
+ */
+__attribute__((noreturn)) static void fatal(const char* format, ...) {
+    flushAllOutput();
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+
+    exit(1);
+}
+
+static struct OutputBuffer* outputBuffer() {
+    if (threadOutput != NULL) {
+        return threadOutput;
+    }
+
+    struct OutputBuffer* buffer = malloc(sizeof(struct OutputBuffer));
+    buffer->used = 0;
+    buffer->next = NULL;
+
+    pthread_mutex_lock(&outputLock);
+
+    if (binaryOutput < 0) {
+        const char* mode = getenv("LETLANG_OUTPUT");
+        binaryOutput = mode != NULL && strcmp(mode, "binary") == 0;
+        atexit(flushAllOutput);
+    }
+
+    struct OutputBuffer** last = &allOutputs;
+
+    while (*last != NULL) {
+        last = &(*last)->next;
+    }
+
+    *last = buffer;
+    pthread_mutex_unlock(&outputLock);
+
+    threadOutput = buffer;
+    return buffer;
+}
+
+/*
+ * Where the next length bytes of output go, at most OUTPUT_BUFFER_SIZE. They are kept by passing their end to
+ * commitOutput.
+ */
+static char* reserveOutput(size_t length) {
+    struct OutputBuffer* buffer = outputBuffer();
+
+    if (buffer->used + length > OUTPUT_BUFFER_SIZE) {
+        writeOutput(buffer);
+    }
+
+    return buffer->data + buffer->used;
+}
+
+static void commitOutput(char* end) {
+    threadOutput->used = end - threadOutput->data;
+}
+
+static char* formatLong(char* out, long long value) {
+    unsigned long long magnitude = value < 0 ? 0ull - (unsigned long long) value : (unsigned long long) value;
+    char digits[20];
+    int count = 0;
+
+    if (value < 0) {
+        *out++ = '-';
+    }
+
+    do {
+        digits[count++] = (char) ('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+
+    while (count > 0) {
+        *out++ = digits[--count];
+    }
+
+    return out;
+}
+
+/*
+ * Shortest round trip formatting of doubles, after Ryu by Ulf Adams: the fewest decimal digits that still read back
+ * as the same double, found with a few 128 bit multiplications by the tables in d2s_tables.h rather than by printing
+ * digits until they are enough.
+ */
+
+#define DOUBLE_MANTISSA_BITS 52
+#define DOUBLE_BIAS 1023
+
+// The decimal digits and power of ten of a double.
+struct DecimalDouble {
+    unsigned long long digits;
+    int exponent;
 };
 
+// Bits in 5^e, for e > 0.
+static inline int pow5bits(int e) {
+    return (int) (((unsigned int) e * 1217359) >> 19) + 1;
+}
+
+// floor(log10(2^e)) and floor(log10(5^e)), for e >= 0.
+static inline unsigned int log10Pow2(int e) {
+    return ((unsigned int) e * 78913) >> 18;
+}
+
+static inline unsigned int log10Pow5(int e) {
+    return ((unsigned int) e * 732923) >> 20;
+}
+
+static inline int multipleOfPowerOf5(unsigned long long value, unsigned int p) {
+    unsigned int count = 0;
+
+    while (value % 5 == 0) {
+        value /= 5;
+        count++;
+    }
+
+    return count >= p;
+}
+
+static inline int multipleOfPowerOf2(unsigned long long value, unsigned int p) {
+    return (value & ((1ull << p) - 1)) == 0;
+}
+
+static inline unsigned long long mulShift64(unsigned long long m, const unsigned long long* mul, int j) {
+    unsigned __int128 low = (unsigned __int128) m * mul[0];
+    unsigned __int128 high = (unsigned __int128) m * mul[1];
+
+    return (unsigned long long) (((low >> 64) + high) >> (j - 64));
+}
+
+static struct DecimalDouble shortestDecimal(unsigned long long ieeeMantissa, unsigned int ieeeExponent) {
+    int e2;
+    unsigned long long m2;
+
+    if (ieeeExponent == 0) {
+        e2 = 1 - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS - 2;
+        m2 = ieeeMantissa;
+    } else {
+        e2 = (int) ieeeExponent - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS - 2;
+        m2 = (1ull << DOUBLE_MANTISSA_BITS) | ieeeMantissa;
+    }
+
+    // The value is mv * 2^e2, and anything strictly between vm and vp, or on them when m2 is even, reads back as it.
+    int acceptBounds = (m2 & 1) == 0;
+    unsigned long long mv = 4 * m2;
+    unsigned int mmShift = ieeeMantissa != 0 || ieeeExponent <= 1;
+
+    unsigned long long vr, vp, vm;
+    int e10;
+    int vmIsTrailingZeros = 0;
+    int vrIsTrailingZeros = 0;
+
+    if (e2 >= 0) {
+        unsigned int q = log10Pow2(e2) - (e2 > 3);
+        int k = DOUBLE_POW5_INV_BITCOUNT + pow5bits((int) q) - 1;
+        int i = -e2 + (int) q + k;
+
+        e10 = (int) q;
+        vr = mulShift64(4 * m2, DOUBLE_POW5_INV_SPLIT[q], i);
+        vp = mulShift64(4 * m2 + 2, DOUBLE_POW5_INV_SPLIT[q], i);
+        vm = mulShift64(4 * m2 - 1 - mmShift, DOUBLE_POW5_INV_SPLIT[q], i);
+
+        if (q <= 21) {
+            // Only one of mv, mv + 2 and mv - 1 - mmShift can be a multiple of 5.
+            if (mv % 5 == 0) {
+                vrIsTrailingZeros = multipleOfPowerOf5(mv, q);
+            } else if (acceptBounds) {
+                vmIsTrailingZeros = multipleOfPowerOf5(mv - 1 - mmShift, q);
+            } else {
+                vp -= multipleOfPowerOf5(mv + 2, q);
+            }
+        }
+    } else {
+        unsigned int q = log10Pow5(-e2) - (-e2 > 1);
+        int i = -e2 - (int) q;
+        int k = pow5bits(i) - DOUBLE_POW5_BITCOUNT;
+        int j = (int) q - k;
+
+        e10 = (int) q + e2;
+        vr = mulShift64(4 * m2, DOUBLE_POW5_SPLIT[i], j);
+        vp = mulShift64(4 * m2 + 2, DOUBLE_POW5_SPLIT[i], j);
+        vm = mulShift64(4 * m2 - 1 - mmShift, DOUBLE_POW5_SPLIT[i], j);
+
+        if (q <= 1) {
+            // mv has at least q trailing zero bits, so vr is exact.
+            vrIsTrailingZeros = 1;
+
+            if (acceptBounds) {
+                vmIsTrailingZeros = mmShift == 1;
+            } else {
+                vp--;
+            }
+        } else if (q < 63) {
+            vrIsTrailingZeros = multipleOfPowerOf2(mv, q);
+        }
+    }
+
+    // Drop digits while vp and vm still differ, rounding vr by the last one dropped.
+    int removed = 0;
+    unsigned int lastRemovedDigit = 0;
+    unsigned long long output;
+
+    if (vmIsTrailingZeros || vrIsTrailingZeros) {
+        while (vp / 10 > vm / 10) {
+            vmIsTrailingZeros &= vm % 10 == 0;
+            vrIsTrailingZeros &= lastRemovedDigit == 0;
+            lastRemovedDigit = (unsigned int) (vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+
+        if (vmIsTrailingZeros) {
+            while (vm % 10 == 0) {
+                vrIsTrailingZeros &= lastRemovedDigit == 0;
+                lastRemovedDigit = (unsigned int) (vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed++;
+            }
+        }
+
+        // Exactly halfway rounds to even.
+        if (vrIsTrailingZeros && lastRemovedDigit == 5 && vr % 2 == 0) {
+            lastRemovedDigit = 4;
+        }
+
+        output = vr + ((vr == vm && (!acceptBounds || !vmIsTrailingZeros)) || lastRemovedDigit >= 5);
+    } else {
+        int roundUp = 0;
+
+        while (vp / 10 > vm / 10) {
+            roundUp = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+
+        output = vr + (vr == vm || roundUp);
+    }
+
+    struct DecimalDouble result = { output, e10 + removed };
+    return result;
+}
+
+/*
+ * Writes value with the fewest digits that read back as it, in plain notation from 1e-6 up to 1e21 and as d.ddde+x
+ * outside that.
+ */
+static char* formatDouble(char* out, double value) {
+    unsigned long long bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    unsigned long long ieeeMantissa = bits & ((1ull << DOUBLE_MANTISSA_BITS) - 1);
+    unsigned int ieeeExponent = (unsigned int) (bits >> DOUBLE_MANTISSA_BITS) & 0x7FF;
+
+    if (ieeeExponent == 0x7FF && ieeeMantissa != 0) {
+        memcpy(out, "NaN", 3);
+        return out + 3;
+    }
+
+    if (bits >> 63) {
+        *out++ = '-';
+    }
+
+    if (ieeeExponent == 0x7FF) {
+        memcpy(out, "Infinity", 8);
+        return out + 8;
+    }
+
+    if (ieeeExponent == 0 && ieeeMantissa == 0) {
+        *out++ = '0';
+        return out;
+    }
+
+    struct DecimalDouble decimal;
+    int e2 = (int) ieeeExponent - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS;
+
+    // Integers below 2^53 are their own shortest digits.
+    if (e2 <= 0 && e2 >= -DOUBLE_MANTISSA_BITS && (ieeeMantissa & ((1ull << -e2) - 1)) == 0) {
+        decimal.digits = ((1ull << DOUBLE_MANTISSA_BITS) | ieeeMantissa) >> -e2;
+        decimal.exponent = 0;
+
+        while (decimal.digits % 10 == 0) {
+            decimal.digits /= 10;
+            decimal.exponent++;
+        }
+    } else {
+        decimal = shortestDecimal(ieeeMantissa, ieeeExponent);
+    }
+
+    char digits[20];
+    int length = 0;
+
+    for (unsigned long long rest = decimal.digits; rest != 0; rest /= 10) {
+        digits[19 - length++] = (char) ('0' + rest % 10);
+    }
+
+    const char* first = digits + 20 - length;
+    // The value is 0.digits * 10^point.
+    int point = length + decimal.exponent;
+
+    if (point > 0 && point <= 21) {
+        if (point >= length) {
+            memcpy(out, first, length);
+            memset(out + length, '0', point - length);
+            return out + point;
+        }
+
+        memcpy(out, first, point);
+        out[point] = '.';
+        memcpy(out + point + 1, first + point, length - point);
+        return out + length + 1;
+    }
+
+    if (point <= 0 && point > -6) {
+        *out++ = '0';
+        *out++ = '.';
+        memset(out, '0', -point);
+        memcpy(out - point, first, length);
+        return out - point + length;
+    }
+
+    *out++ = first[0];
+
+    if (length > 1) {
+        *out++ = '.';
+        memcpy(out, first + 1, length - 1);
+        out += length - 1;
+    }
+
+    *out++ = 'e';
+    *out++ = point - 1 < 0 ? '-' : '+';
+    return formatLong(out, point - 1 < 0 ? 1 - point : point - 1);
+}
+
 void printd(double v) {
-    printf("%f\n", v);
+    char* out = reserveOutput(MAX_VALUE_LENGTH);
+    out = formatDouble(out, v);
+    *out++ = '\n';
+    commitOutput(out);
+}
+
+void printi(long long v) {
+    char* out = reserveOutput(MAX_VALUE_LENGTH);
+    out = formatLong(out, v);
+    *out++ = '\n';
+    commitOutput(out);
 }
 
 void printds(struct ArrayRef* source) {
-    struct ArrayRef ref = *source;
+    struct OutputBuffer* buffer = outputBuffer();
+
+    // A list in binary mode is its values back to back, written straight from the list after what came before.
+    if (binaryOutput) {
+        writeOutput(buffer);
+        writeAll(source->arr, (size_t) source->size * sizeof(double));
+        return;
+    }
+
+    for (unsigned int i = 0; i < source->size; i++) {
+        char* out = reserveOutput(MAX_VALUE_LENGTH);
+        out = formatDouble(out, *((double*) (source->arr + (size_t) i * source->itemSize)));
+
+        if (i + 1 < source->size) {
+            *out++ = ',';
+            *out++ = ' ';
+        }
+
+        commitOutput(out);
+    }
+
+    char* out = reserveOutput(1);
+    *out++ = '\n';
+    commitOutput(out);
+}
+
+void printis(struct ArrayRef* source) {
+    long long* values = source->arr;
+
+    for (unsigned int i = 0; i < source->size; i++) {
+        char* out = reserveOutput(MAX_VALUE_LENGTH);
+        out = formatLong(out, values[i]);
+
+        if (i + 1 < source->size) {
+            *out++ = ',';
+            *out++ = ' ';
+        }
+
+        commitOutput(out);
+    }
+
+    char* out = reserveOutput(1);
+    *out++ = '\n';
+    commitOutput(out);
+}
+
+void printbs(struct ArrayRef* source) {
+    unsigned char* values = source->arr;
+
+    for (unsigned int i = 0; i < source->size; i++) {
+        char* out = reserveOutput(MAX_VALUE_LENGTH);
+        const char* text = values[i] ? "true" : "false";
+        size_t length = strlen(text);
+
+        memcpy(out, text, length);
+        out += length;
+
+        if (i + 1 < source->size) {
+            *out++ = ',';
+            *out++ = ' ';
+        }
 
-    for (void* i = ref.arr; i < ref.arr + (ref.size - 1) * ref.itemSize; i += ref.itemSize) {
-        printf("%f, ", *((double*) i));
+        commitOutput(out);
     }
 
-    printf("%f\n", *((double*) (ref.arr + (ref.size - 1) * ref.itemSize)));
+    char* out = reserveOutput(1);
+    *out++ = '\n';
+    commitOutput(out);
+}
+
+void indexOutOfBounds(long long index, long long size, int line, int col) {
+    fatal("Index %lld out of bounds for list of size %lld at line %d, col %d\n", index, size, line, col);
+}
+
+void divideByZero(int line, int col) {
+    fatal("Division by zero at line %d, col %d\n", line, col);
+}
+
+void sliceOutOfBounds(long long start, long long end, long long size, int line, int col) {
+    fatal("Slice %lld to %lld out of bounds for list of size %lld at line %d, col %d\n", start, end, size, line, col);
 }
 
 void createArray(struct ArrayRef* ref, unsigned int size, unsigned int capacity, unsigned int itemSize) {
     struct ArrayRef result;
-    result.arr = malloc(capacity * itemSize);
+    result.buffer = malloc(sizeof(struct ArrayBuffer) + (size_t) capacity * itemSize);
+
+    if (result.buffer == NULL) {
+        fatal("Out of memory creating a list of %u elements\n", capacity);
+    }
+
+    atomic_init(&result.buffer->refCount, 1);
+    result.buffer->mapping = NULL;
+    result.arr = result.buffer + 1;
     result.size = size;
-    result.capacity = capacity,
+    result.capacity = capacity;
     result.itemSize = itemSize;
+    result.offset = 0;
     *ref = result;
 }
 
+/*
+ * Called by the compiler for each view it makes of a list, views may be made and destroyed on any thread.
+ */
+void retainArray(struct ArrayRef* ref) {
+    if (ref->buffer != NULL) {
+        atomic_fetch_add_explicit(&ref->buffer->refCount, 1, memory_order_relaxed);
+    }
+}
+
+/*
+ * Lists and views are destroyed at the end of the scope that made them, whether or not it ran, so one that was never
+ * created has no buffer.
+ */
 void destroyArray(struct ArrayRef* ref) {
-    free(ref->arr);
+    if (ref->buffer != NULL && atomic_fetch_sub_explicit(&ref->buffer->refCount, 1, memory_order_acq_rel) == 1) {
+        if (ref->buffer->mapping != NULL) {
+            munmap(ref->buffer->mapping, ref->buffer->mappedBytes);
+        }
+
+        free(ref->buffer);
+    }
+}
+
+/*
+ * Growable lists. A list may only grow or shrink in place while it is the sole owner of a buffer it allocated itself,
+ * otherwise its elements are first copied into a buffer of its own so views and mapped files never see the change.
+ * Growth is geometric, which keeps a run of pushes amortised O(1). Columns lists use their capacity as the column
+ * stride and are never resized.
+ */
+static int ownsArray(struct ArrayRef* ref) {
+    return ref->buffer->mapping == NULL && ref->arr == ref->buffer + 1
+        && atomic_load_explicit(&ref->buffer->refCount, memory_order_acquire) == 1;
+}
+
+static void resizeArray(struct ArrayRef* ref, unsigned int capacity) {
+    size_t bytes = sizeof(struct ArrayBuffer) + (size_t) capacity * ref->itemSize;
+    int owned = ownsArray(ref);
+    struct ArrayBuffer* buffer = owned ? realloc(ref->buffer, bytes) : malloc(bytes);
+
+    if (buffer == NULL) {
+        fatal("Out of memory resizing a list to %u elements\n", capacity);
+    }
+
+    if (!owned) {
+        atomic_init(&buffer->refCount, 1);
+        buffer->mapping = NULL;
+        memcpy(buffer + 1, ref->arr, (size_t) ref->size * ref->itemSize);
+        destroyArray(ref);
+    }
+
+    ref->buffer = buffer;
+    ref->arr = buffer + 1;
+    ref->capacity = capacity;
+}
+
+void reserveArray(struct ArrayRef* ref, unsigned int capacity) {
+    if (capacity > ref->capacity || !ownsArray(ref)) {
+        resizeArray(ref, capacity > ref->size ? capacity : ref->size);
+    }
+}
+
+void shrinkArray(struct ArrayRef* ref) {
+    if (ref->size < ref->capacity && ownsArray(ref)) {
+        resizeArray(ref, ref->size);
+    }
+}
+
+static void* arraySlot(struct ArrayRef* ref, unsigned int index) {
+    if (index >= ref->capacity) {
+        unsigned int grown = ref->capacity + (ref->capacity >> 1) + 8;
+        resizeArray(ref, index >= grown ? index + 1 : grown);
+    } else if (!ownsArray(ref)) {
+        resizeArray(ref, ref->capacity);
+    }
+
+    if (index >= ref->size) {
+        ref->size = index + 1;
+    }
+
+    return ref->arr + ((size_t) ref->itemSize * index);
 }
 
+/*
+ * Lists are stored unboxed, the compiler picks the insert for the element type: Floats and Ints take 8 bytes and
+ * Booleans one byte each.
+ */
 void mutableInsertArrayDouble(struct ArrayRef* source, unsigned int index, double value) {
-    struct ArrayRef ref = *source;
+    double* dest = arraySlot(source, index);
+    *dest = value;
+}
+
+void mutableInsertArrayLong(struct ArrayRef* source, unsigned int index, long long value) {
+    long long* dest = arraySlot(source, index);
+    *dest = value;
+}
+
+void mutableInsertArrayByte(struct ArrayRef* source, unsigned int index, unsigned char value) {
+    unsigned char* dest = arraySlot(source, index);
+    *dest = value;
+}
+
+void pushArrayDouble(struct ArrayRef* source, double value) {
+    mutableInsertArrayDouble(source, source->size, value);
+}
+
+void pushArrayLong(struct ArrayRef* source, long long value) {
+    mutableInsertArrayLong(source, source->size, value);
+}
+
+void pushArrayByte(struct ArrayRef* source, unsigned char value) {
+    mutableInsertArrayByte(source, source->size, value);
+}
+
+/*
+ * Persistent vector: a 32-way trie with a tail buffer. Every update returns a new vector that shares all untouched
+ * nodes with its source, so append/set/get are O(log32 n) and never copy the whole list. Vectors captured by parMap
+ * and parFor bodies are shared between pool workers, so the counts are atomic like those of ArrayBuffer.
+ */
+
+#define VECTOR_BITS 5
+#define VECTOR_WIDTH (1 << VECTOR_BITS)
+#define VECTOR_MASK (VECTOR_WIDTH - 1)
+
+struct VectorNode {
+    atomic_uint refCount;
+    union {
+        struct VectorNode* children[VECTOR_WIDTH];
+        double values[VECTOR_WIDTH];
+    };
+};
+
+struct PersistentVector {
+    atomic_uint refCount;
+    unsigned int size;
+    unsigned int shift;
+    struct VectorNode* root;
+    struct VectorNode* tail;
+};
+
+static struct VectorNode* vectorNodeCreate() {
+    struct VectorNode* node = calloc(1, sizeof(struct VectorNode));
+    atomic_init(&node->refCount, 1);
+    return node;
+}
+
+static void vectorNodeRetain(struct VectorNode* node) {
+    atomic_fetch_add_explicit(&node->refCount, 1, memory_order_relaxed);
+}
+
+static struct VectorNode* vectorNodeCopy(struct VectorNode* source, unsigned int level) {
+    struct VectorNode* node = malloc(sizeof(struct VectorNode));
+    memcpy(node->children, source->children, sizeof(node->children));
+    atomic_init(&node->refCount, 1);
+
+    if (level > 0) {
+        for (int i = 0; i < VECTOR_WIDTH; i++) {
+            if (node->children[i] != NULL) {
+                vectorNodeRetain(node->children[i]);
+            }
+        }
+    }
+
+    return node;
+}
 
-    if (index >= ref.size) {
-        if (index >= ref.capacity) {
-            unsigned int newCapacity = ((int) ref.capacity * 1.5) + 1;
+static void vectorNodeRelease(struct VectorNode* node, unsigned int level) {
+    if (node == NULL || atomic_fetch_sub_explicit(&node->refCount, 1, memory_order_acq_rel) > 1) {
+        return;
+    }
 
-            ref.arr = realloc(ref.arr, newCapacity * ref.itemSize);
-            ref.capacity = newCapacity;
+    if (level > 0) {
+        for (int i = 0; i < VECTOR_WIDTH; i++) {
+            vectorNodeRelease(node->children[i], level - VECTOR_BITS);
         }
+    }
+
+    free(node);
+}
+
+static unsigned int vectorTailOffset(struct PersistentVector* vector) {
+    return vector->size < VECTOR_WIDTH ? 0 : ((vector->size - 1) >> VECTOR_BITS) << VECTOR_BITS;
+}
+
+static struct PersistentVector* vectorCreate(unsigned int size, unsigned int shift, struct VectorNode* root, struct VectorNode* tail) {
+    struct PersistentVector* result = malloc(sizeof(struct PersistentVector));
+    atomic_init(&result->refCount, 1);
+    result->size = size;
+    result->shift = shift;
+    result->root = root;
+    result->tail = tail;
+    return result;
+}
 
-        ref.size++;
+static struct VectorNode* vectorNewPath(unsigned int level, struct VectorNode* node) {
+    if (level == 0) {
+        return node;
     }
 
-    double* dest = ref.arr + (ref.itemSize * index);
-    *dest = value;
+    struct VectorNode* result = vectorNodeCreate();
+    result->children[0] = vectorNewPath(level - VECTOR_BITS, node);
+    return result;
+}
+
+static struct VectorNode* vectorPushTail(unsigned int size, unsigned int level, struct VectorNode* parent, struct VectorNode* tail) {
+    struct VectorNode* result = parent == NULL ? vectorNodeCreate() : vectorNodeCopy(parent, level);
+    unsigned int index = ((size - 1) >> level) & VECTOR_MASK;
+
+    if (level == VECTOR_BITS) {
+        result->children[index] = tail;
+    } else {
+        struct VectorNode* child = result->children[index];
+
+        if (child == NULL) {
+            result->children[index] = vectorNewPath(level - VECTOR_BITS, tail);
+        } else {
+            result->children[index] = vectorPushTail(size, level - VECTOR_BITS, child, tail);
+            vectorNodeRelease(child, level - VECTOR_BITS);
+        }
+    }
+
+    return result;
+}
+
+static struct VectorNode* vectorDoSet(unsigned int level, struct VectorNode* node, unsigned int index, double value) {
+    struct VectorNode* result = vectorNodeCopy(node, level);
+
+    if (level == 0) {
+        result->values[index & VECTOR_MASK] = value;
+    } else {
+        unsigned int slot = (index >> level) & VECTOR_MASK;
+        struct VectorNode* child = result->children[slot];
+        result->children[slot] = vectorDoSet(level - VECTOR_BITS, child, index, value);
+        vectorNodeRelease(child, level - VECTOR_BITS);
+    }
+
+    return result;
+}
+
+static void vectorOutOfBounds(struct PersistentVector* vector, long long index) {
+    fatal("Vector index %lld out of bounds for size %u\n", index, vector->size);
+}
+
+void vectorRetain(struct PersistentVector* vector) {
+    atomic_fetch_add_explicit(&vector->refCount, 1, memory_order_relaxed);
+}
+
+void vectorRelease(struct PersistentVector* vector) {
+    if (atomic_fetch_sub_explicit(&vector->refCount, 1, memory_order_acq_rel) > 1) {
+        return;
+    }
+
+    vectorNodeRelease(vector->root, vector->shift);
+    vectorNodeRelease(vector->tail, 0);
+    free(vector);
+}
+
+struct PersistentVector* vectorAppend(struct PersistentVector* source, double value) {
+    unsigned int tailSize = source->size - vectorTailOffset(source);
+
+    if (tailSize < VECTOR_WIDTH) {
+        struct VectorNode* tail = source->tail == NULL ? vectorNodeCreate() : vectorNodeCopy(source->tail, 0);
+        tail->values[tailSize] = value;
+
+        if (source->root != NULL) {
+            vectorNodeRetain(source->root);
+        }
+
+        return vectorCreate(source->size + 1, source->shift, source->root, tail);
+    }
+
+    // The tail is full, push it down into the trie and start a fresh one.
+    struct VectorNode* root;
+    unsigned int shift = source->shift;
+    vectorNodeRetain(source->tail);
+
+    if ((source->size >> VECTOR_BITS) > (1u << source->shift)) {
+        root = vectorNodeCreate();
+        root->children[0] = source->root;
+        vectorNodeRetain(source->root);
+        root->children[1] = vectorNewPath(source->shift, source->tail);
+        shift += VECTOR_BITS;
+    } else {
+        root = vectorPushTail(source->size, source->shift, source->root, source->tail);
+    }
+
+    struct VectorNode* tail = vectorNodeCreate();
+    tail->values[0] = value;
+
+    return vectorCreate(source->size + 1, shift, root, tail);
+}
+
+double vectorGet(struct PersistentVector* source, long long index) {
+    if (index < 0 || index >= source->size) {
+        vectorOutOfBounds(source, index);
+    }
+
+    if (index >= vectorTailOffset(source)) {
+        return source->tail->values[index & VECTOR_MASK];
+    }
+
+    struct VectorNode* node = source->root;
+
+    for (unsigned int level = source->shift; level > 0; level -= VECTOR_BITS) {
+        node = node->children[(index >> level) & VECTOR_MASK];
+    }
+
+    return node->values[index & VECTOR_MASK];
+}
+
+struct PersistentVector* vectorSet(struct PersistentVector* source, long long index, double value) {
+    if (index < 0 || index >= source->size) {
+        vectorOutOfBounds(source, index);
+    }
+
+    if (index >= vectorTailOffset(source)) {
+        struct VectorNode* tail = vectorNodeCopy(source->tail, 0);
+        tail->values[index & VECTOR_MASK] = value;
+
+        if (source->root != NULL) {
+            vectorNodeRetain(source->root);
+        }
+
+        return vectorCreate(source->size, source->shift, source->root, tail);
+    }
+
+    struct VectorNode* root = vectorDoSet(source->shift, source->root, index, value);
+    vectorNodeRetain(source->tail);
+
+    return vectorCreate(source->size, source->shift, root, source->tail);
+}
+
+long long vectorSize(struct PersistentVector* source) {
+    return source->size;
+}
+
+struct PersistentVector* vectorFromArray(struct ArrayRef* source) {
+    struct PersistentVector* result = vectorCreate(0, VECTOR_BITS, NULL, NULL);
+
+    for (unsigned int i = 0; i < source->size; i++) {
+        struct PersistentVector* next = vectorAppend(result, *((double*) (source->arr + (size_t) i * source->itemSize)));
+        vectorRelease(result);
+        result = next;
+    }
+
+    return result;
+}
+
+void vectorToArray(struct ArrayRef* dest, struct PersistentVector* source) {
+    createArray(dest, source->size, source->size, sizeof(double));
+
+    double* values = dest->arr;
+    unsigned int tailOffset = vectorTailOffset(source);
+
+    for (unsigned int i = 0; i < tailOffset; i += VECTOR_WIDTH) {
+        struct VectorNode* node = source->root;
+
+        for (unsigned int level = source->shift; level > 0; level -= VECTOR_BITS) {
+            node = node->children[(i >> level) & VECTOR_MASK];
+        }
+
+        for (unsigned int j = 0; j < VECTOR_WIDTH; j++) {
+            values[i + j] = node->values[j];
+        }
+    }
+
+    for (unsigned int i = tailOffset; i < source->size; i++) {
+        values[i] = source->tail->values[i & VECTOR_MASK];
+    }
+}
+
+/*
+ * Memo tables: one per memoized function, created on first use. Keys are the arguments as 64 bit words. Open addressing
+ * with linear probing, but a key is only ever looked for within MEMO_PROBES slots of its home slot. That keeps the
+ * table at a fixed size: when all of those slots are taken one of them is overwritten, round robin.
+ */
+
+#define MEMO_CAPACITY 4096
+#define MEMO_PROBES 8
+
+struct MemoTable {
+    unsigned int keySize;
+    unsigned int evictions;
+    // Each slot is a used flag, the key words and then the result.
+    long long* slots;
+};
+
+// Memo functions may be called from parallel builtins, the tables are shared once the pool has threads.
+static pthread_mutex_t memoLock = PTHREAD_MUTEX_INITIALIZER;
+static int memoLocking = 0;
+
+static unsigned long long memoHash(unsigned int keySize, const long long* key) {
+    unsigned long long hash = 0x9E3779B97F4A7C15ULL;
+
+    for (unsigned int i = 0; i < keySize; i++) {
+        hash ^= (unsigned long long) key[i];
+        hash *= 0xBF58476D1CE4E5B9ULL;
+        hash ^= hash >> 31;
+    }
+
+    return hash;
+}
+
+static long long* memoSlot(struct MemoTable* table, unsigned int index) {
+    return table->slots + (unsigned long) (index & (MEMO_CAPACITY - 1)) * (table->keySize + 2);
+}
+
+static int memoKeyEquals(unsigned int keySize, const long long* slot, const long long* key) {
+    for (unsigned int i = 0; i < keySize; i++) {
+        if (slot[i + 1] != key[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static struct MemoTable* memoTableFor(struct MemoTable** table, unsigned int keySize) {
+    if (*table == NULL) {
+        struct MemoTable* created = malloc(sizeof(struct MemoTable));
+        created->keySize = keySize;
+        created->evictions = 0;
+        created->slots = calloc((unsigned long) MEMO_CAPACITY * (keySize + 2), sizeof(long long));
+        *table = created;
+    }
+
+    return *table;
+}
+
+static int memoFind(struct MemoTable** tableRef, unsigned int keySize, const long long* key, long long* result) {
+    struct MemoTable* table = memoTableFor(tableRef, keySize);
+    unsigned int home = (unsigned int) memoHash(keySize, key);
+
+    for (unsigned int i = 0; i < MEMO_PROBES; i++) {
+        long long* slot = memoSlot(table, home + i);
+
+        if (!slot[0]) {
+            return 0;
+        }
+
+        if (memoKeyEquals(keySize, slot, key)) {
+            *result = slot[keySize + 1];
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int memoLookup(struct MemoTable** tableRef, unsigned int keySize, const long long* key, long long* result) {
+    if (!memoLocking) {
+        return memoFind(tableRef, keySize, key, result);
+    }
+
+    pthread_mutex_lock(&memoLock);
+    int found = memoFind(tableRef, keySize, key, result);
+    pthread_mutex_unlock(&memoLock);
+    return found;
+}
+
+static void memoInsert(struct MemoTable** tableRef, unsigned int keySize, const long long* key, long long result) {
+    struct MemoTable* table = memoTableFor(tableRef, keySize);
+    unsigned int home = (unsigned int) memoHash(keySize, key);
+    long long* slot = NULL;
+
+    for (unsigned int i = 0; i < MEMO_PROBES; i++) {
+        long long* next = memoSlot(table, home + i);
+
+        if (!next[0] || memoKeyEquals(keySize, next, key)) {
+            slot = next;
+            break;
+        }
+    }
+
+    if (slot == NULL) {
+        slot = memoSlot(table, home + table->evictions++ % MEMO_PROBES);
+    }
+
+    slot[0] = 1;
+
+    for (unsigned int i = 0; i < keySize; i++) {
+        slot[i + 1] = key[i];
+    }
+
+    slot[keySize + 1] = result;
+}
+
+void memoStore(struct MemoTable** tableRef, unsigned int keySize, const long long* key, long long result) {
+    if (!memoLocking) {
+        memoInsert(tableRef, keySize, key, result);
+        return;
+    }
+
+    pthread_mutex_lock(&memoLock);
+    memoInsert(tableRef, keySize, key, result);
+    pthread_mutex_unlock(&memoLock);
+}
+
+/*
+ * Kernels over Float lists. Each has a scalar version and, on x86-64, AVX2 and AVX-512 versions compiled for those
+ * targets; the widest one the CPU supports is picked on first use. Vector versions keep one partial result per lane
+ * and combine them at the end, so sums may differ from a sequential loop in the last bits. min and max skip NaN in
+ * every version: the vector min and max instructions return their second operand when either is NaN, so the running
+ * lanes always go second. scripts/benchKernels.c checks the versions against each other and times them.
+ */
+
+struct ListKernels {
+    double (*sum)(const double* values, unsigned int size);
+    double (*dot)(const double* left, const double* right, unsigned int size);
+    double (*min)(const double* values, unsigned int size);
+    double (*max)(const double* values, unsigned int size);
+    void (*scale)(double* dest, const double* source, unsigned int size, double factor);
+    void (*offset)(double* dest, const double* source, unsigned int size, double amount);
+    void (*add)(double* dest, const double* left, const double* right, unsigned int size);
+    void (*mul)(double* dest, const double* left, const double* right, unsigned int size);
+    void (*prefixSum)(double* dest, const double* source, unsigned int size, double carry);
+};
+
+static double scalarSum(const double* values, unsigned int size) {
+    double result = 0;
+
+    for (unsigned int i = 0; i < size; i++) {
+        result += values[i];
+    }
+
+    return result;
+}
+
+static double scalarDot(const double* left, const double* right, unsigned int size) {
+    double result = 0;
+
+    for (unsigned int i = 0; i < size; i++) {
+        result += left[i] * right[i];
+    }
+
+    return result;
+}
+
+static double scalarMin(const double* values, unsigned int size) {
+    double result = INFINITY;
+
+    for (unsigned int i = 0; i < size; i++) {
+        result = values[i] < result ? values[i] : result;
+    }
+
+    return result;
+}
+
+static double scalarMax(const double* values, unsigned int size) {
+    double result = -INFINITY;
+
+    for (unsigned int i = 0; i < size; i++) {
+        result = values[i] > result ? values[i] : result;
+    }
+
+    return result;
+}
+
+static void scalarScale(double* dest, const double* source, unsigned int size, double factor) {
+    for (unsigned int i = 0; i < size; i++) {
+        dest[i] = source[i] * factor;
+    }
+}
+
+static void scalarOffset(double* dest, const double* source, unsigned int size, double amount) {
+    for (unsigned int i = 0; i < size; i++) {
+        dest[i] = source[i] + amount;
+    }
+}
+
+static void scalarAdd(double* dest, const double* left, const double* right, unsigned int size) {
+    for (unsigned int i = 0; i < size; i++) {
+        dest[i] = left[i] + right[i];
+    }
+}
+
+static void scalarMul(double* dest, const double* left, const double* right, unsigned int size) {
+    for (unsigned int i = 0; i < size; i++) {
+        dest[i] = left[i] * right[i];
+    }
+}
+
+static void scalarPrefixSum(double* dest, const double* source, unsigned int size, double carry) {
+    for (unsigned int i = 0; i < size; i++) {
+        carry += source[i];
+        dest[i] = carry;
+    }
+}
+
+static const struct ListKernels scalarKernels = {
+    scalarSum, scalarDot, scalarMin, scalarMax, scalarScale, scalarOffset, scalarAdd, scalarMul, scalarPrefixSum
+};
+
+#if defined(__x86_64__)
+
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 static double avx2Reduce(__m256d lanes) {
+    __m128d pair = _mm_add_pd(_mm256_castpd256_pd128(lanes), _mm256_extractf128_pd(lanes, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(pair, _mm_unpackhi_pd(pair, pair)));
+}
+
+AVX2 static double avx2Sum(const double* values, unsigned int size) {
+    __m256d first = _mm256_setzero_pd();
+    __m256d second = _mm256_setzero_pd();
+    unsigned int i = 0;
+
+    // Two accumulators hide the latency of the adds.
+    for (; i + 8 <= size; i += 8) {
+        first = _mm256_add_pd(first, _mm256_loadu_pd(values + i));
+        second = _mm256_add_pd(second, _mm256_loadu_pd(values + i + 4));
+    }
+
+    return avx2Reduce(_mm256_add_pd(first, second)) + scalarSum(values + i, size - i);
+}
+
+AVX2 static double avx2Dot(const double* left, const double* right, unsigned int size) {
+    __m256d first = _mm256_setzero_pd();
+    __m256d second = _mm256_setzero_pd();
+    unsigned int i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        first = _mm256_fmadd_pd(_mm256_loadu_pd(left + i), _mm256_loadu_pd(right + i), first);
+        second = _mm256_fmadd_pd(_mm256_loadu_pd(left + i + 4), _mm256_loadu_pd(right + i + 4), second);
+    }
+
+    return avx2Reduce(_mm256_add_pd(first, second)) + scalarDot(left + i, right + i, size - i);
+}
+
+AVX2 static double avx2Min(const double* values, unsigned int size) {
+    __m256d lanes = _mm256_set1_pd(INFINITY);
+    unsigned int i = 0;
+
+    for (; i + 4 <= size; i += 4) {
+        lanes = _mm256_min_pd(_mm256_loadu_pd(values + i), lanes);
+    }
+
+    double parts[4];
+    _mm256_storeu_pd(parts, lanes);
+
+    double rest = scalarMin(values + i, size - i);
+    double result = scalarMin(parts, 4);
+    return rest < result ? rest : result;
+}
+
+AVX2 static double avx2Max(const double* values, unsigned int size) {
+    __m256d lanes = _mm256_set1_pd(-INFINITY);
+    unsigned int i = 0;
+
+    for (; i + 4 <= size; i += 4) {
+        lanes = _mm256_max_pd(_mm256_loadu_pd(values + i), lanes);
+    }
+
+    double parts[4];
+    _mm256_storeu_pd(parts, lanes);
+
+    double rest = scalarMax(values + i, size - i);
+    double result = scalarMax(parts, 4);
+    return rest > result ? rest : result;
+}
+
+AVX2 static void avx2Scale(double* dest, const double* source, unsigned int size, double factor) {
+    __m256d factors = _mm256_set1_pd(factor);
+    unsigned int i = 0;
+
+    for (; i + 4 <= size; i += 4) {
+        _mm256_storeu_pd(dest + i, _mm256_mul_pd(_mm256_loadu_pd(source + i), factors));
+    }
+
+    scalarScale(dest + i, source + i, size - i, factor);
+}
+
+AVX2 static void avx2Offset(double* dest, const double* source, unsigned int size, double amount) {
+    __m256d amounts = _mm256_set1_pd(amount);
+    unsigned int i = 0;
+
+    for (; i + 4 <= size; i += 4) {
+        _mm256_storeu_pd(dest + i, _mm256_add_pd(_mm256_loadu_pd(source + i), amounts));
+    }
+
+    scalarOffset(dest + i, source + i, size - i, amount);
+}
+
+AVX2 static void avx2Add(double* dest, const double* left, const double* right, unsigned int size) {
+    unsigned int i = 0;
+
+    for (; i + 4 <= size; i += 4) {
+        _mm256_storeu_pd(dest + i, _mm256_add_pd(_mm256_loadu_pd(left + i), _mm256_loadu_pd(right + i)));
+    }
+
+    scalarAdd(dest + i, left + i, right + i, size - i);
+}
+
+AVX2 static void avx2Mul(double* dest, const double* left, const double* right, unsigned int size) {
+    unsigned int i = 0;
+
+    for (; i + 4 <= size; i += 4) {
+        _mm256_storeu_pd(dest + i, _mm256_mul_pd(_mm256_loadu_pd(left + i), _mm256_loadu_pd(right + i)));
+    }
+
+    scalarMul(dest + i, left + i, right + i, size - i);
+}
+
+/*
+ * Scan within a register by adding copies of itself shifted up one lane and then two, then add the running total of
+ * everything before it.
+ */
+AVX2 static void avx2PrefixSum(double* dest, const double* source, unsigned int size, double carry) {
+    __m256d zero = _mm256_setzero_pd();
+    __m256d carries = _mm256_set1_pd(carry);
+    unsigned int i = 0;
+
+    for (; i + 4 <= size; i += 4) {
+        __m256d lanes = _mm256_loadu_pd(source + i);
+        lanes = _mm256_add_pd(lanes, _mm256_blend_pd(_mm256_permute4x64_pd(lanes, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x1));
+        lanes = _mm256_add_pd(lanes, _mm256_blend_pd(_mm256_permute4x64_pd(lanes, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x3));
+        lanes = _mm256_add_pd(lanes, carries);
+
+        _mm256_storeu_pd(dest + i, lanes);
+        carries = _mm256_permute4x64_pd(lanes, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+
+    scalarPrefixSum(dest + i, source + i, size - i, _mm256_cvtsd_f64(carries));
+}
+
+static const struct ListKernels avx2Kernels = {
+    avx2Sum, avx2Dot, avx2Min, avx2Max, avx2Scale, avx2Offset, avx2Add, avx2Mul, avx2PrefixSum
+};
+
+#define AVX512 __attribute__((target("avx512f")))
+
+AVX512 static double avx512Sum(const double* values, unsigned int size) {
+    __m512d first = _mm512_setzero_pd();
+    __m512d second = _mm512_setzero_pd();
+    unsigned int i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        first = _mm512_add_pd(first, _mm512_loadu_pd(values + i));
+        second = _mm512_add_pd(second, _mm512_loadu_pd(values + i + 8));
+    }
+
+    return _mm512_reduce_add_pd(_mm512_add_pd(first, second)) + scalarSum(values + i, size - i);
+}
+
+AVX512 static double avx512Dot(const double* left, const double* right, unsigned int size) {
+    __m512d first = _mm512_setzero_pd();
+    __m512d second = _mm512_setzero_pd();
+    unsigned int i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        first = _mm512_fmadd_pd(_mm512_loadu_pd(left + i), _mm512_loadu_pd(right + i), first);
+        second = _mm512_fmadd_pd(_mm512_loadu_pd(left + i + 8), _mm512_loadu_pd(right + i + 8), second);
+    }
+
+    return _mm512_reduce_add_pd(_mm512_add_pd(first, second)) + scalarDot(left + i, right + i, size - i);
+}
+
+AVX512 static double avx512Min(const double* values, unsigned int size) {
+    __m512d lanes = _mm512_set1_pd(INFINITY);
+    unsigned int i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        lanes = _mm512_min_pd(_mm512_loadu_pd(values + i), lanes);
+    }
+
+    double rest = scalarMin(values + i, size - i);
+    double result = _mm512_reduce_min_pd(lanes);
+    return rest < result ? rest : result;
+}
+
+AVX512 static double avx512Max(const double* values, unsigned int size) {
+    __m512d lanes = _mm512_set1_pd(-INFINITY);
+    unsigned int i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        lanes = _mm512_max_pd(_mm512_loadu_pd(values + i), lanes);
+    }
+
+    double rest = scalarMax(values + i, size - i);
+    double result = _mm512_reduce_max_pd(lanes);
+    return rest > result ? rest : result;
+}
+
+AVX512 static void avx512Scale(double* dest, const double* source, unsigned int size, double factor) {
+    __m512d factors = _mm512_set1_pd(factor);
+    unsigned int i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        _mm512_storeu_pd(dest + i, _mm512_mul_pd(_mm512_loadu_pd(source + i), factors));
+    }
+
+    scalarScale(dest + i, source + i, size - i, factor);
+}
+
+AVX512 static void avx512Offset(double* dest, const double* source, unsigned int size, double amount) {
+    __m512d amounts = _mm512_set1_pd(amount);
+    unsigned int i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        _mm512_storeu_pd(dest + i, _mm512_add_pd(_mm512_loadu_pd(source + i), amounts));
+    }
+
+    scalarOffset(dest + i, source + i, size - i, amount);
+}
+
+AVX512 static void avx512Add(double* dest, const double* left, const double* right, unsigned int size) {
+    unsigned int i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        _mm512_storeu_pd(dest + i, _mm512_add_pd(_mm512_loadu_pd(left + i), _mm512_loadu_pd(right + i)));
+    }
+
+    scalarAdd(dest + i, left + i, right + i, size - i);
+}
+
+AVX512 static void avx512Mul(double* dest, const double* left, const double* right, unsigned int size) {
+    unsigned int i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        _mm512_storeu_pd(dest + i, _mm512_mul_pd(_mm512_loadu_pd(left + i), _mm512_loadu_pd(right + i)));
+    }
+
+    scalarMul(dest + i, left + i, right + i, size - i);
+}
+
+AVX512 static void avx512PrefixSum(double* dest, const double* source, unsigned int size, double carry) {
+    __m512i shiftOne = _mm512_set_epi64(6, 5, 4, 3, 2, 1, 0, 0);
+    __m512i shiftTwo = _mm512_set_epi64(5, 4, 3, 2, 1, 0, 0, 0);
+    __m512i shiftFour = _mm512_set_epi64(3, 2, 1, 0, 0, 0, 0, 0);
+    __m512i last = _mm512_set1_epi64(7);
+    __m512d carries = _mm512_set1_pd(carry);
+    unsigned int i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        __m512d lanes = _mm512_loadu_pd(source + i);
+        lanes = _mm512_add_pd(lanes, _mm512_maskz_permutexvar_pd(0xFE, shiftOne, lanes));
+        lanes = _mm512_add_pd(lanes, _mm512_maskz_permutexvar_pd(0xFC, shiftTwo, lanes));
+        lanes = _mm512_add_pd(lanes, _mm512_maskz_permutexvar_pd(0xF0, shiftFour, lanes));
+        lanes = _mm512_add_pd(lanes, carries);
+
+        _mm512_storeu_pd(dest + i, lanes);
+        carries = _mm512_permutexvar_pd(last, lanes);
+    }
+
+    scalarPrefixSum(dest + i, source + i, size - i, _mm512_cvtsd_f64(carries));
+}
+
+static const struct ListKernels avx512Kernels = {
+    avx512Sum, avx512Dot, avx512Min, avx512Max, avx512Scale, avx512Offset, avx512Add, avx512Mul, avx512PrefixSum
+};
+
+#endif
+
+static const struct ListKernels* listKernels() {
+    static const struct ListKernels* selected = NULL;
+
+    if (selected == NULL) {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx512f")) {
+            selected = &avx512Kernels;
+        } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            selected = &avx2Kernels;
+        } else {
+            selected = &scalarKernels;
+        }
+#else
+        selected = &scalarKernels;
+#endif
+    }
+
+    return selected;
+}
+
+static unsigned int shorterSize(struct ArrayRef* left, struct ArrayRef* right) {
+    return left->size < right->size ? left->size : right->size;
+}
+
+double listSum(struct ArrayRef* source) {
+    return listKernels()->sum(source->arr, source->size);
+}
+
+double listDot(struct ArrayRef* left, struct ArrayRef* right) {
+    return listKernels()->dot(left->arr, right->arr, shorterSize(left, right));
+}
+
+double listMin(struct ArrayRef* source) {
+    return listKernels()->min(source->arr, source->size);
+}
+
+double listMax(struct ArrayRef* source) {
+    return listKernels()->max(source->arr, source->size);
+}
+
+void listScale(struct ArrayRef* dest, struct ArrayRef* source, double factor) {
+    createArray(dest, source->size, source->size, sizeof(double));
+    listKernels()->scale(dest->arr, source->arr, source->size, factor);
+}
+
+void listOffset(struct ArrayRef* dest, struct ArrayRef* source, double amount) {
+    createArray(dest, source->size, source->size, sizeof(double));
+    listKernels()->offset(dest->arr, source->arr, source->size, amount);
+}
+
+void listAdd(struct ArrayRef* dest, struct ArrayRef* left, struct ArrayRef* right) {
+    unsigned int size = shorterSize(left, right);
+
+    createArray(dest, size, size, sizeof(double));
+    listKernels()->add(dest->arr, left->arr, right->arr, size);
+}
+
+void listMul(struct ArrayRef* dest, struct ArrayRef* left, struct ArrayRef* right) {
+    unsigned int size = shorterSize(left, right);
+
+    createArray(dest, size, size, sizeof(double));
+    listKernels()->mul(dest->arr, left->arr, right->arr, size);
+}
+
+void listPrefixSum(struct ArrayRef* dest, struct ArrayRef* source) {
+    createArray(dest, source->size, source->size, sizeof(double));
+    listKernels()->prefixSum(dest->arr, source->arr, source->size, 0);
+}
+
+/*
+ * Input. The language has no strings, so files are named by their position in the program's arguments, which glibc
+ * passes to constructors as well as to main.
+ */
+
+static int programArgc = 0;
+static char** programArgv = NULL;
+
+__attribute__((constructor)) static void saveProgramArgs(int argc, char** argv) {
+    programArgc = argc;
+    programArgv = argv;
+}
+
+/*
+ * Maps the whole file named by program argument arg read only, or exits. An empty file has no mapping.
+ */
+static void* mapInput(long long arg, size_t* length) {
+    if (arg < 1 || arg >= programArgc) {
+        fatal("Program argument %lld is missing, %d given\n", arg, programArgc - 1);
+    }
+
+    const char* path = programArgv[arg];
+    int file = open(path, O_RDONLY);
+    struct stat info;
+
+    if (file < 0 || fstat(file, &info) != 0) {
+        fatal("Cannot read %s\n", path);
+    }
+
+    *length = info.st_size;
+    void* mapping = NULL;
+
+    if (*length > 0) {
+        mapping = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, file, 0);
+
+        if (mapping == MAP_FAILED) {
+            fatal("Cannot map %s\n", path);
+        }
+
+        madvise(mapping, *length, MADV_SEQUENTIAL);
+    }
+
+    close(file);
+    return mapping;
+}
+
+static void checkInputSize(size_t count, long long arg) {
+    if (count > 0xFFFFFFFFu) {
+        fatal("Program argument %lld names a file of more values than a list holds\n", arg);
+    }
+}
+
+/*
+ * The file named by program argument arg as a list of little-endian doubles, trailing bytes ignored. On a
+ * little-endian machine the list is the mapping itself, nothing is copied and pages are read as the list is.
+ */
+void mapFloats(struct ArrayRef* dest, long long arg) {
+    size_t length;
+    void* mapping = mapInput(arg, &length);
+    size_t count = length / sizeof(double);
+
+    checkInputSize(count, arg);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (mapping != NULL) {
+        struct ArrayBuffer* buffer = malloc(sizeof(struct ArrayBuffer));
+        atomic_init(&buffer->refCount, 1);
+        buffer->mapping = mapping;
+        buffer->mappedBytes = length;
+
+        dest->arr = mapping;
+        dest->size = count;
+        dest->capacity = count;
+        dest->itemSize = sizeof(double);
+        dest->offset = 0;
+        dest->buffer = buffer;
+        return;
+    }
+#endif
+
+    createArray(dest, count, count, sizeof(double));
+
+    for (size_t i = 0; i < count; i++) {
+        unsigned long long bits;
+        memcpy(&bits, mapping + i * sizeof(double), sizeof(bits));
+        bits = __builtin_bswap64(bits);
+        memcpy(dest->arr + i * sizeof(double), &bits, sizeof(bits));
+    }
+
+    if (mapping != NULL) {
+        munmap(mapping, length);
+    }
+}
+
+/*
+ * One column, counted from 0, of the comma separated file named by program argument arg. Rows where that field isn't
+ * a number, such as a header, or that have too few fields are skipped. The file is mapped and scanned with memchr,
+ * which the C library vectorises, so only the fields that are kept get parsed.
+ */
+void readCsvColumn(struct ArrayRef* dest, long long arg, long long column) {
+    if (column < 0) {
+        fatal("CSV column %lld is negative\n", column);
+    }
+
+    size_t length;
+    char* text = mapInput(arg, &length);
+    char* end = text + length;
+    size_t rows = 0;
+
+    for (char* line = text; line < end; rows++) {
+        char* next = memchr(line, '\n', end - line);
+        line = next == NULL ? end : next + 1;
+    }
+
+    checkInputSize(rows, arg);
+    createArray(dest, 0, rows, sizeof(double));
+    double* values = dest->arr;
+
+    for (char* line = text; line < end;) {
+        char* lineEnd = memchr(line, '\n', end - line);
+        lineEnd = lineEnd == NULL ? end : lineEnd;
+
+        char* field = line;
+
+        for (long long i = 0; i < column && field != NULL; i++) {
+            char* comma = memchr(field, ',', lineEnd - field);
+            field = comma == NULL ? NULL : comma + 1;
+        }
+
+        line = lineEnd + 1;
+
+        if (field == NULL) {
+            continue;
+        }
+
+        // strtod needs a terminated string, and the mapping has none at its end.
+        char* fieldEnd = memchr(field, ',', lineEnd - field);
+        size_t fieldLength = (fieldEnd == NULL ? lineEnd : fieldEnd) - field;
+        char number[64];
+
+        if (fieldLength == 0 || fieldLength >= sizeof(number)) {
+            continue;
+        }
+
+        memcpy(number, field, fieldLength);
+        number[fieldLength] = 0;
+
+        char* parsed;
+        double value = strtod(number, &parsed);
+
+        if (parsed == number) {
+            continue;
+        }
+
+        while (*parsed == ' ' || *parsed == '\r' || *parsed == '\t') {
+            parsed++;
+        }
+
+        if (*parsed == 0) {
+            values[dest->size++] = value;
+        }
+    }
+
+    if (text != NULL) {
+        munmap(text, length);
+    }
+}
+
+/*
+ * Work-stealing pool behind the parallel builtins. Each worker, and the thread that starts the pool, owns a deque of
+ * index ranges. A thread takes from the bottom of its own deque, pushing back the upper half of a range until what it
+ * holds is down to the grain, and steals from the top of the others when it runs dry. A thread waiting for its own job
+ * runs whatever it can find meanwhile, so parallel calls nest. LETLANG_WORKERS sets the number of threads, by default
+ * one per online processor.
+ */
+
+typedef void (*RangeBody)(void* context, long long from, long long to);
+
+struct PoolJob {
+    RangeBody body;
+    void* context;
+    long long grain;
+    atomic_llong remaining;
+};
+
+struct PoolRange {
+    struct PoolJob* job;
+    long long from;
+    long long to;
+};
+
+struct PoolDeque {
+    pthread_mutex_t lock;
+    struct PoolRange* ranges;
+    unsigned int top;
+    unsigned int bottom;
+    unsigned int capacity;
+};
+
+static struct {
+    unsigned int workers;
+    struct PoolDeque* deques;
+    atomic_int pending;
+    atomic_int sleeping;
+    pthread_mutex_t sleepLock;
+    pthread_cond_t wake;
+} pool;
+
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+static _Thread_local int poolIndex = -1;
+
+static void poolPush(int index, struct PoolRange range) {
+    struct PoolDeque* deque = &pool.deques[index];
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom == deque->capacity) {
+        if (deque->top > 0) {
+            memmove(deque->ranges, deque->ranges + deque->top, (deque->bottom - deque->top) * sizeof(struct PoolRange));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        } else {
+            deque->capacity = deque->capacity * 2 + 16;
+            deque->ranges = realloc(deque->ranges, deque->capacity * sizeof(struct PoolRange));
+        }
+    }
+
+    deque->ranges[deque->bottom++] = range;
+    pthread_mutex_unlock(&deque->lock);
+
+    atomic_fetch_add(&pool.pending, 1);
+
+    if (atomic_load(&pool.sleeping) > 0) {
+        pthread_mutex_lock(&pool.sleepLock);
+        pthread_cond_signal(&pool.wake);
+        pthread_mutex_unlock(&pool.sleepLock);
+    }
+}
+
+static int poolTakeFrom(int index, int own, struct PoolRange* range) {
+    struct PoolDeque* deque = &pool.deques[index];
+    int found = 0;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom > deque->top) {
+        *range = own ? deque->ranges[--deque->bottom] : deque->ranges[deque->top++];
+        found = 1;
+
+        if (deque->bottom == deque->top) {
+            deque->top = deque->bottom = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int poolTake(int index, struct PoolRange* range) {
+    if (atomic_load(&pool.pending) == 0) {
+        return 0;
+    }
+
+    int found = poolTakeFrom(index, 1, range);
+
+    for (unsigned int i = 1; !found && i < pool.workers; i++) {
+        found = poolTakeFrom((index + i) % pool.workers, 0, range);
+    }
+
+    if (found) {
+        atomic_fetch_sub(&pool.pending, 1);
+    }
+
+    return found;
+}
+
+static void poolRun(int index, struct PoolRange range) {
+    struct PoolJob* job = range.job;
+
+    while (range.to - range.from > job->grain) {
+        long long middle = range.from + (range.to - range.from) / 2;
+        struct PoolRange upper = { job, middle, range.to };
+
+        poolPush(index, upper);
+        range.to = middle;
+    }
+
+    job->body(job->context, range.from, range.to);
+    flushThreadOutput();
+
+    // The job belongs to the thread waiting for it, it may be gone right after this.
+    atomic_fetch_sub(&job->remaining, range.to - range.from);
+}
+
+static void* poolWorker(void* argument) {
+    poolIndex = (int) (long) argument;
+    struct PoolRange range;
+
+    for (;;) {
+        if (poolTake(poolIndex, &range)) {
+            poolRun(poolIndex, range);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool.sleepLock);
+        atomic_fetch_add(&pool.sleeping, 1);
+
+        while (atomic_load(&pool.pending) == 0) {
+            pthread_cond_wait(&pool.wake, &pool.sleepLock);
+        }
+
+        atomic_fetch_sub(&pool.sleeping, 1);
+        pthread_mutex_unlock(&pool.sleepLock);
+    }
+
+    return NULL;
+}
+
+static void poolStart() {
+    const char* configured = getenv("LETLANG_WORKERS");
+    long workers = configured != NULL ? atol(configured) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    pool.workers = workers < 1 ? 1 : (unsigned int) workers;
+    pool.deques = calloc(pool.workers, sizeof(struct PoolDeque));
+    atomic_init(&pool.pending, 0);
+    atomic_init(&pool.sleeping, 0);
+    pthread_mutex_init(&pool.sleepLock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+
+    for (unsigned int i = 0; i < pool.workers; i++) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    }
+
+    // The starting thread takes the first deque and helps while it waits.
+    poolIndex = 0;
+    memoLocking = pool.workers > 1;
+
+    for (unsigned int i = 1; i < pool.workers; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, poolWorker, (void*) (long) i);
+        pthread_detach(thread);
+    }
+}
+
+/*
+ * Waits for every range of job to finish, running queued ranges of any job in the meantime.
+ */
+static void poolJoin(struct PoolJob* job) {
+    struct PoolRange range;
+
+    while (atomic_load(&job->remaining) > 0) {
+        if (poolTake(poolIndex, &range)) {
+            poolRun(poolIndex, range);
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+/*
+ * Calls body on disjoint ranges covering [start, end), split no finer than grain, and returns once all are done.
+ */
+void parallelFor(long long start, long long end, long long grain, RangeBody body, void* context) {
+    if (end <= start) {
+        return;
+    }
+
+    pthread_once(&poolOnce, poolStart);
+
+    if (pool.workers == 1 || poolIndex < 0) {
+        body(context, start, end);
+        return;
+    }
+
+    struct PoolJob job;
+    job.body = body;
+    job.context = context;
+    job.grain = grain < 1 ? 1 : grain;
+    atomic_init(&job.remaining, end - start);
+
+    // Whatever this thread printed before comes before anything the ranges print.
+    flushThreadOutput();
+
+    struct PoolRange whole = { &job, start, end };
+    poolRun(poolIndex, whole);
+    poolJoin(&job);
+}
+
+/*
+ * Starts body(context, 0, 1) as a task another worker may pick up, for a let that runs alongside the code after it.
+ * Without a pool to hand it to it runs straight away. Either way joinTask has to be called with the result.
+ */
+struct PoolJob* spawnTask(RangeBody body, void* context) {
+    pthread_once(&poolOnce, poolStart);
+
+    struct PoolJob* job = malloc(sizeof(struct PoolJob));
+    job->body = body;
+    job->context = context;
+    job->grain = 1;
+
+    if (pool.workers == 1 || poolIndex < 0) {
+        body(context, 0, 1);
+        atomic_init(&job->remaining, 0);
+        return job;
+    }
+
+    atomic_init(&job->remaining, 1);
+
+    struct PoolRange whole = { job, 0, 1 };
+    poolPush(poolIndex, whole);
+    return job;
+}
+
+void joinTask(struct PoolJob* job) {
+    poolJoin(job);
+    free(job);
 }
@@ -2,8 +2,24 @@
 #include "src/Parser.h"
 #include "src/Typechecker.h"
 #include "src/Compiler.h"
+#include "src/Optimizer.h"
+
+int main(int argc, char **argv) {
+    CompilerOptions options;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "--whole-program") {
+            options.wholeProgram = true;
+        } else if (arg == "--unchecked") {
+            options.checkBounds = false;
+        } else {
+            std::cout << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+    }
 
-int main() {
     println("Starting parse");
 
     try {
@@ -19,11 +35,15 @@ int main() {
 
         typeCheck(*ast);
 
+        println("Done typecheck, doing optimize");
+
+        optimize(*ast);
+
         printModule(*ast, "/home/dillon/projects/cppLetLang/build/typedAst.js");
 
-        println("Done typecheck, doing compile");
+        println("Done optimize, doing compile");
 
-        compile("/home/dillon/projects/cppLetLang/build/basic.ll", ast.get());
+        compile("/home/dillon/projects/cppLetLang/build/basic.ll", ast.get(), options);
 
         println("Done compile");
 
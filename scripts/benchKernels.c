@@ -0,0 +1,193 @@
+/*
+ * Checks the AVX2 and AVX-512 list kernels against the scalar ones, then measures the throughput of each table that
+ * the CPU supports. It includes core.c to reach the kernel tables, which are static. From the repo root:
+ *
+ *   gcc -O2 -o build/benchKernels scripts/benchKernels.c -lpthread -lm && ./build/benchKernels
+ */
+
+#include "../lib/core.c"
+
+#include <time.h>
+
+#define CHECK_SIZES 70
+#define BENCH_SIZE 65536
+
+struct KernelTable {
+    const char* name;
+    const struct ListKernels* kernels;
+};
+
+static unsigned int tableCount = 0;
+static struct KernelTable tables[3];
+static int failures = 0;
+static volatile double sink;
+
+static void findTables() {
+    tables[tableCount++] = (struct KernelTable) { "scalar", &scalarKernels };
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        tables[tableCount++] = (struct KernelTable) { "avx2", &avx2Kernels };
+    }
+
+    if (__builtin_cpu_supports("avx512f")) {
+        tables[tableCount++] = (struct KernelTable) { "avx512", &avx512Kernels };
+    }
+#endif
+}
+
+static void fill(double* values, unsigned int size, unsigned int seed) {
+    for (unsigned int i = 0; i < size; i++) {
+        values[i] = (double) ((i * 37 + seed * 11) % 101) - 50.0;
+    }
+}
+
+/*
+ * Sums are combined in a different order per table, so they only have to agree closely. Everything else is exact,
+ * and a NaN result only matches NaN.
+ */
+static int same(double expected, double actual, int exact) {
+    if (isnan(expected) || isnan(actual)) {
+        return isnan(expected) && isnan(actual);
+    }
+
+    return exact ? expected == actual : fabs(expected - actual) <= 1e-9 * (1 + fabs(expected));
+}
+
+static void expect(const char* table, const char* kernel, unsigned int size, double expected, double actual, int exact) {
+    if (!same(expected, actual, exact)) {
+        fprintf(stderr, "%s %s, size %u: expected %.17g but got %.17g\n", table, kernel, size, expected, actual);
+        failures++;
+    }
+}
+
+static void expectList(const char* table, const char* kernel, unsigned int size, const double* expected, const double* actual, int exact) {
+    for (unsigned int i = 0; i < size; i++) {
+        if (!same(expected[i], actual[i], exact)) {
+            fprintf(stderr, "%s %s, size %u: element %u expected %.17g but got %.17g\n", table, kernel, size, i, expected[i], actual[i]);
+            failures++;
+            return;
+        }
+    }
+}
+
+static void checkTable(struct KernelTable* table) {
+    const struct ListKernels* scalar = &scalarKernels;
+    const struct ListKernels* tested = table->kernels;
+    double left[CHECK_SIZES] = {0}, right[CHECK_SIZES] = {0}, expected[CHECK_SIZES], actual[CHECK_SIZES];
+
+    for (unsigned int size = 0; size < CHECK_SIZES; size++) {
+        fill(left, size, 1);
+        fill(right, size, 2);
+
+        expect(table->name, "sum", size, scalar->sum(left, size), tested->sum(left, size), 0);
+        expect(table->name, "dot", size, scalar->dot(left, right, size), tested->dot(left, right, size), 0);
+        expect(table->name, "min", size, scalar->min(left, size), tested->min(left, size), 1);
+        expect(table->name, "max", size, scalar->max(left, size), tested->max(left, size), 1);
+
+        scalar->scale(expected, left, size, 1.5);
+        tested->scale(actual, left, size, 1.5);
+        expectList(table->name, "scale", size, expected, actual, 1);
+
+        scalar->offset(expected, left, size, 0.25);
+        tested->offset(actual, left, size, 0.25);
+        expectList(table->name, "offset", size, expected, actual, 1);
+
+        scalar->add(expected, left, right, size);
+        tested->add(actual, left, right, size);
+        expectList(table->name, "add", size, expected, actual, 1);
+
+        scalar->mul(expected, left, right, size);
+        tested->mul(actual, left, right, size);
+        expectList(table->name, "mul", size, expected, actual, 1);
+
+        scalar->prefixSum(expected, left, size, 3.0);
+        tested->prefixSum(actual, left, size, 3.0);
+        expectList(table->name, "prefixSum", size, expected, actual, 0);
+
+        // min and max skip NaN wherever it is, including in every lane and in the scalar remainder.
+        for (unsigned int at = 0; at < size; at++) {
+            fill(left, size, 1);
+            left[at] = NAN;
+
+            expect(table->name, "min with NaN", size, scalar->min(left, size), tested->min(left, size), 1);
+            expect(table->name, "max with NaN", size, scalar->max(left, size), tested->max(left, size), 1);
+        }
+
+        for (unsigned int i = 0; i < size; i++) {
+            left[i] = NAN;
+        }
+
+        expect(table->name, "min of NaN", size, scalar->min(left, size), tested->min(left, size), 1);
+        expect(table->name, "max of NaN", size, scalar->max(left, size), tested->max(left, size), 1);
+    }
+}
+
+static double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Runs one kernel over BENCH_SIZE elements until a quarter of a second has passed and returns billions of elements
+ * per second. Reductions are written to sink so they aren't optimised away.
+ */
+static double measure(const struct ListKernels* kernels, int kernel, double* dest, const double* left, const double* right) {
+    unsigned long long runs = 0;
+    double start = seconds();
+    double elapsed;
+
+    do {
+        for (int i = 0; i < 16; i++) {
+            switch (kernel) {
+                case 0: sink = kernels->sum(left, BENCH_SIZE); break;
+                case 1: sink = kernels->dot(left, right, BENCH_SIZE); break;
+                case 2: sink = kernels->min(left, BENCH_SIZE); break;
+                case 3: sink = kernels->max(left, BENCH_SIZE); break;
+                case 4: kernels->add(dest, left, right, BENCH_SIZE); break;
+                default: kernels->prefixSum(dest, left, BENCH_SIZE, 0); break;
+            }
+        }
+
+        runs += 16;
+        elapsed = seconds() - start;
+    } while (elapsed < 0.25);
+
+    return runs * (double) BENCH_SIZE / elapsed / 1e9;
+}
+
+int main() {
+    findTables();
+
+    for (unsigned int i = 1; i < tableCount; i++) {
+        int before = failures;
+        checkTable(&tables[i]);
+        printf("check %s against scalar: %s\n", tables[i].name, failures == before ? "ok" : "FAILED");
+    }
+
+    double* left = malloc(BENCH_SIZE * sizeof(double));
+    double* right = malloc(BENCH_SIZE * sizeof(double));
+    double* dest = malloc(BENCH_SIZE * sizeof(double));
+    fill(left, BENCH_SIZE, 1);
+    fill(right, BENCH_SIZE, 2);
+
+    printf("\nGelem/s on %d-element lists\n", BENCH_SIZE);
+    printf("%-8s %8s %8s %8s %8s %8s %10s\n", "", "sum", "dot", "min", "max", "add", "prefixSum");
+
+    for (unsigned int i = 0; i < tableCount; i++) {
+        printf("%-8s", tables[i].name);
+
+        for (int kernel = 0; kernel < 6; kernel++) {
+            printf(kernel == 5 ? " %10.2f" : " %8.2f", measure(tables[i].kernels, kernel, dest, left, right));
+        }
+
+        printf("\n");
+    }
+
+    free(left);
+    free(right);
+    free(dest);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,66 @@
+/*
+ * Times pushArrayDouble into an empty list for growing counts. Amortised O(1) append shows as a flat cost per push,
+ * next to pushes into a list reserved to its final size up front. It includes core.c like the other benchmarks. From
+ * the repo root:
+ *
+ *   gcc -O2 -o build/benchPush scripts/benchPush.c -lpthread -lm && ./build/benchPush
+ */
+
+#include "../lib/core.c"
+
+#include <time.h>
+
+static double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Pushes count doubles and returns nanoseconds per push. Each element is read back afterwards, which also checks that
+ * growth kept everything.
+ */
+static double pushes(unsigned int count, int reserved) {
+    struct ArrayRef list;
+    createArray(&list, 0, 0, sizeof(double));
+
+    double start = seconds();
+
+    if (reserved) {
+        reserveArray(&list, count);
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        pushArrayDouble(&list, i);
+    }
+
+    double elapsed = seconds() - start;
+
+    for (unsigned int i = 0; i < count; i++) {
+        if (((double*) list.arr)[i] != i || list.size != count) {
+            fprintf(stderr, "Element %u was lost\n", i);
+            exit(1);
+        }
+    }
+
+    shrinkArray(&list);
+
+    if (list.capacity != count) {
+        fprintf(stderr, "Capacity %u after shrinking %u elements\n", list.capacity, count);
+        exit(1);
+    }
+
+    destroyArray(&list);
+    return elapsed * 1e9 / count;
+}
+
+int main() {
+    printf("ns per push\n");
+    printf("%-10s %10s %10s\n", "n", "grown", "reserved");
+
+    for (unsigned int count = 1000000; count <= 100000000; count *= 10) {
+        printf("%-10u %10.2f %10.2f\n", count, pushes(count, 0), pushes(count, 1));
+    }
+
+    return 0;
+}
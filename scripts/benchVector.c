@@ -0,0 +1,181 @@
+/*
+ * Compares the persistent vector with a flat ArrayRef on append-heavy work. A list is immutable, so appending to it or
+ * setting one element copies the whole list, where the vector copies only the path to the change. Reads are timed too,
+ * since they are what the vector gives up. It includes core.c to build vectors without the compiler. From the repo
+ * root:
+ *
+ *   gcc -O2 -o build/benchVector scripts/benchVector.c -lpthread -lm && ./build/benchVector
+ */
+
+#include "../lib/core.c"
+
+#include <time.h>
+
+static volatile double sink;
+
+static double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static struct PersistentVector* filledVector(unsigned int size) {
+    struct PersistentVector* vector = vectorCreate(0, VECTOR_BITS, NULL, NULL);
+
+    for (unsigned int i = 0; i < size; i++) {
+        struct PersistentVector* next = vectorAppend(vector, i);
+        vectorRelease(vector);
+        vector = next;
+    }
+
+    return vector;
+}
+
+static void filledList(struct ArrayRef* list, unsigned int size) {
+    createArray(list, size, size, sizeof(double));
+
+    for (unsigned int i = 0; i < size; i++) {
+        ((double*) list->arr)[i] = i;
+    }
+}
+
+/*
+ * Builds a list of size elements one append at a time, each copying the list so far as an immutable append must.
+ */
+static void appendList(unsigned int size) {
+    struct ArrayRef list;
+    createArray(&list, 0, 0, sizeof(double));
+
+    for (unsigned int i = 0; i < size; i++) {
+        struct ArrayRef next;
+        createArray(&next, i + 1, i + 1, sizeof(double));
+        memcpy(next.arr, list.arr, (size_t) i * sizeof(double));
+        ((double*) next.arr)[i] = i;
+
+        destroyArray(&list);
+        list = next;
+    }
+
+    sink = ((double*) list.arr)[size - 1];
+    destroyArray(&list);
+}
+
+static void appendVector(unsigned int size) {
+    struct PersistentVector* vector = filledVector(size);
+    sink = vectorGet(vector, size - 1);
+    vectorRelease(vector);
+}
+
+/*
+ * Changes size elements spread over a list of size elements, keeping only the newest version.
+ */
+static void setList(unsigned int size) {
+    struct ArrayRef list;
+    filledList(&list, size);
+
+    for (unsigned int i = 0; i < size; i++) {
+        struct ArrayRef next;
+        createArray(&next, size, size, sizeof(double));
+        memcpy(next.arr, list.arr, (size_t) size * sizeof(double));
+        ((double*) next.arr)[(i * 7919u) % size] = -1;
+
+        destroyArray(&list);
+        list = next;
+    }
+
+    sink = ((double*) list.arr)[0];
+    destroyArray(&list);
+}
+
+static void setVector(unsigned int size) {
+    struct PersistentVector* vector = filledVector(size);
+
+    for (unsigned int i = 0; i < size; i++) {
+        struct PersistentVector* next = vectorSet(vector, (i * 7919u) % size, -1);
+        vectorRelease(vector);
+        vector = next;
+    }
+
+    sink = vectorGet(vector, 0);
+    vectorRelease(vector);
+}
+
+/*
+ * Reads every element of a list or vector of size elements, leaving out the time taken to build it.
+ */
+static double readList(unsigned int size, unsigned int rounds) {
+    struct ArrayRef list;
+    filledList(&list, size);
+
+    double start = seconds();
+    double total = 0;
+
+    for (unsigned int round = 0; round < rounds; round++) {
+        for (unsigned int i = 0; i < size; i++) {
+            total += ((volatile double*) list.arr)[i];
+        }
+    }
+
+    double elapsed = seconds() - start;
+    sink = total;
+    destroyArray(&list);
+    return elapsed;
+}
+
+static double readVector(unsigned int size, unsigned int rounds) {
+    struct PersistentVector* vector = filledVector(size);
+
+    double start = seconds();
+    double total = 0;
+
+    for (unsigned int round = 0; round < rounds; round++) {
+        for (unsigned int i = 0; i < size; i++) {
+            total += vectorGet(vector, i);
+        }
+    }
+
+    double elapsed = seconds() - start;
+    sink = total;
+    vectorRelease(vector);
+    return elapsed;
+}
+
+/*
+ * Repeats a run of size operations until a quarter of a second has passed and returns nanoseconds per operation.
+ */
+static double measure(void (*run)(unsigned int size), unsigned int size) {
+    unsigned long long runs = 0;
+    double start = seconds();
+    double elapsed;
+
+    do {
+        run(size);
+        runs++;
+        elapsed = seconds() - start;
+    } while (elapsed < 0.25);
+
+    return elapsed * 1e9 / ((double) runs * size);
+}
+
+static double measureReads(double (*run)(unsigned int size, unsigned int rounds), unsigned int size) {
+    unsigned int rounds = 100000000u / size;
+    return run(size, rounds) * 1e9 / ((double) rounds * size);
+}
+
+int main() {
+    const unsigned int sizes[] = {1000, 10000, 100000};
+
+    printf("ns per operation on n elements\n");
+    printf("%-8s %12s %12s %12s %12s %12s %12s\n", "n", "append list", "append vec", "set list", "set vec", "get list", "get vec");
+
+    for (int i = 0; i < 3; i++) {
+        unsigned int size = sizes[i];
+
+        printf("%-8u %12.1f %12.1f %12.1f %12.1f %12.2f %12.2f\n", size,
+               measure(appendList, size), measure(appendVector, size),
+               measure(setList, size), measure(setVector, size),
+               measureReads(readList, size), measureReads(readVector, size));
+    }
+
+    return 0;
+}
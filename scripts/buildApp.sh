@@ -1,5 +1,7 @@
 #!/bin/sh
 
-llc -filetype=obj -o build/basic.o build/basic.ll
+opt -O2 -S -o build/basic.opt.ll build/basic.ll
 
-clang++ -o build/out build/core.o build/basic.o
\ No newline at end of file
+llc -relocation-model=pic -filetype=obj -o build/basic.o build/basic.opt.ll
+
+clang++ -o build/out build/core.o build/basic.o -lpthread
@@ -1,3 +1,3 @@
 #!/bin/sh
 
-clang -c -Wall -o build/core.o lib/core.c
\ No newline at end of file
+clang -c -O2 -Wall -o build/core.o lib/core.c
\ No newline at end of file
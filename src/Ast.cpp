@@ -67,13 +67,108 @@ Variable::Variable(Location location, string id, unique_ptr<TypeToken> type) :
 
 }
 
+FieldAccess::FieldAccess(Location location, unique_ptr<TypeToken> type, unique_ptr<Expression> object, string field) :
+    Expression(ExpressionKind::fieldAccess, move(location), move(type)), object(move(object)), field(move(field)) {}
+
+IndexAccess::IndexAccess(Location location, unique_ptr<TypeToken> type, unique_ptr<Expression> list, unique_ptr<Expression> index) :
+    Expression(ExpressionKind::indexAccess, move(location), move(type)), list(move(list)), index(move(index)) {}
+
 ListLiteral::ListLiteral(Location location, unique_ptr<TypeToken> type, vector<unique_ptr<Expression>> values) :
     Expression(ExpressionKind::listLiteral, move(location), move(type)), values(move(values)) {}
 
-NumberLiteral::NumberLiteral(Location location, double value) : Expression(ExpressionKind::numberLiteral, move(location), make_unique<BaseTypeToken>(BasicTypeTokenKind::Float)), value(value) {}
+NumberLiteral::NumberLiteral(Location location, double value, bool integral) : Expression(ExpressionKind::numberLiteral, move(location), make_unique<BaseTypeToken>(BasicTypeTokenKind::Float)), value(value), integral(integral),
+    fitsInt(integral && value >= -9223372036854775808.0 && value < 9223372036854775808.0), intValue(fitsInt ? (int64_t) value : 0) {}
+
+NumberLiteral::NumberLiteral(Location location, int64_t intValue) : Expression(ExpressionKind::numberLiteral, move(location), make_unique<BaseTypeToken>(BasicTypeTokenKind::Int)), value((double) intValue), integral(true),
+    fitsInt(true), intValue(intValue) {}
 
 BooleanLiteral::BooleanLiteral(Location location, bool value) : Expression(ExpressionKind::booleanLiteral, move(location), make_unique<BaseTypeToken>(BasicTypeTokenKind::Boolean)), value(value) {}
 
 NullLiteral::NullLiteral(Location location) : Expression(ExpressionKind::nullLiteral, move(location), make_unique<BaseTypeToken>(BasicTypeTokenKind::Unit)) {}
 
-Module::Module(vector<unique_ptr<Function>> functions) : functions(move(functions)) {}
+Record::Record(Location loc, string id, vector<string> fields, vector<unique_ptr<TypeToken>> fieldTypes) :
+    loc(move(loc)), id(move(id)), fields(move(fields)), fieldTypes(move(fieldTypes)) {}
+
+Module::Module(vector<unique_ptr<Record>> records, vector<unique_ptr<Function>> functions) : records(move(records)), functions(move(functions)) {}
+
+unique_ptr<Expression> cloneExpression(Expression &expression) {
+    switch (expression.kind) {
+        case ExpressionKind::assignment: {
+            auto &ex = (Assignment &) expression;
+            return make_unique<Assignment>(ex.loc(), ex.type().clone(), ex.id, cloneExpression(*ex.body));
+        }
+        case ExpressionKind::function: {
+            auto &ex = (Function &) expression;
+            return make_unique<Function>(ex.loc(), ex.id, ex.params, ex.type().clone(), cloneExpression(*ex.body));
+        }
+        case ExpressionKind::call: {
+            auto &ex = (Call &) expression;
+            vector<unique_ptr<Expression>> args;
+
+            for (auto &arg : ex.args) {
+                args.push_back(cloneExpression(*arg));
+            }
+
+            return make_unique<Call>(ex.loc(), ex.type().clone(), cloneExpression(*ex.source), move(args));
+        }
+        case ExpressionKind::ifEx: {
+            auto &ex = (If &) expression;
+            return make_unique<If>(ex.loc(), ex.type().clone(), cloneExpression(*ex.condition), cloneExpression(*ex.thenEx), cloneExpression(*ex.elseEx));
+        }
+        case ExpressionKind::binaryOp: {
+            auto &ex = (BinaryOp &) expression;
+            return make_unique<BinaryOp>(ex.loc(), ex.type().clone(), ex.op, cloneExpression(*ex.left), cloneExpression(*ex.right));
+        }
+        case ExpressionKind::block: {
+            auto &ex = (Block &) expression;
+            vector<unique_ptr<Expression>> body;
+
+            for (auto &next : ex.body) {
+                body.push_back(cloneExpression(*next));
+            }
+
+            return make_unique<Block>(ex.loc(), ex.type().clone(), move(body));
+        }
+        case ExpressionKind::variable: {
+            auto &ex = (Variable &) expression;
+            return make_unique<Variable>(ex.loc(), ex.id, ex.type().clone());
+        }
+        case ExpressionKind::fieldAccess: {
+            auto &ex = (FieldAccess &) expression;
+            return make_unique<FieldAccess>(ex.loc(), ex.type().clone(), cloneExpression(*ex.object), ex.field);
+        }
+        case ExpressionKind::indexAccess: {
+            auto &ex = (IndexAccess &) expression;
+            auto result = make_unique<IndexAccess>(ex.loc(), ex.type().clone(), cloneExpression(*ex.list), cloneExpression(*ex.index));
+            result->checked = ex.checked;
+            return result;
+        }
+        case ExpressionKind::listLiteral: {
+            auto &ex = (ListLiteral &) expression;
+            vector<unique_ptr<Expression>> values;
+
+            for (auto &next : ex.values) {
+                values.push_back(cloneExpression(*next));
+            }
+
+            return make_unique<ListLiteral>(ex.loc(), ex.type().clone(), move(values));
+        }
+        case ExpressionKind::numberLiteral: {
+            auto &ex = (NumberLiteral &) expression;
+            auto result = make_unique<NumberLiteral>(ex.loc(), ex.value, ex.integral);
+            result->fitsInt = ex.fitsInt;
+            result->intValue = ex.intValue;
+            result->_type = ex.type().clone();
+            return result;
+        }
+        case ExpressionKind::booleanLiteral: {
+            auto &ex = (BooleanLiteral &) expression;
+            return make_unique<BooleanLiteral>(ex.loc(), ex.value);
+        }
+        case ExpressionKind::nullLiteral: {
+            return make_unique<NullLiteral>(expression.loc());
+        }
+        default:
+            throw runtime_error("Unknown Expression type in clone");
+    }
+}
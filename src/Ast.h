@@ -18,6 +18,8 @@ enum ExpressionKind {
     binaryOp,
     block,
     variable,
+    fieldAccess,
+    indexAccess,
     listLiteral,
     numberLiteral,
     booleanLiteral,
@@ -45,6 +47,11 @@ public:
 
     std::string id;
     std::unique_ptr<Expression> body;
+    // Set by markParallelLets on a let that runs as a task on the runtime's pool. It reads the local names in
+    // captures, and its block waits for it before the statement at joinBefore.
+    bool spawn = false;
+    std::vector<std::string> captures;
+    size_t joinBefore = 0;
 
     Assignment(Location location, std::unique_ptr<TypeToken> type, std::string id, std::unique_ptr<Expression> body);
 
@@ -56,6 +63,14 @@ public:
     std::string id;
     std::vector<std::string> params;
     std::unique_ptr<Expression> body;
+    // Set by markTailCalls when the function calls itself from a tail position.
+    bool tailRecursive = false;
+    // Results are cached by argument in a runtime table, see memoLookup in core.c.
+    bool memo = false;
+    // Set by convertClosures on nested functions used as values: the outer names they read through an environment.
+    std::vector<std::string> captures;
+    // Type parameters of a generic function. The typechecker replaces it with one copy per distinct instantiation.
+    std::vector<std::string> typeParams;
 
     Function(Location location, std::string id, std::vector<std::string> params, std::unique_ptr<TypeToken> type, std::unique_ptr<Expression> body);
 
@@ -66,6 +81,8 @@ public:
 
     std::unique_ptr<Expression> source;
     std::vector<std::unique_ptr<Expression>> args;
+    // Set by markTailCalls when the result of this call is returned straight from the enclosing function.
+    bool tail = false;
 
     Call(Location location, std::unique_ptr<TypeToken> type, std::unique_ptr<Expression> source, std::vector<std::unique_ptr<Expression>> args);
 
@@ -111,6 +128,33 @@ public:
 
 };
 
+/**
+ * object.field on a record. On a list of records it is the list of that field.
+ */
+class FieldAccess : public Expression {
+public:
+
+    std::unique_ptr<Expression> object;
+    std::string field;
+
+    FieldAccess(Location location, std::unique_ptr<TypeToken> type, std::unique_ptr<Expression> object, std::string field);
+
+};
+
+/**
+ * list[index]. Checked against the size of the list at runtime unless markSafeIndexes proved it is in range.
+ */
+class IndexAccess : public Expression {
+public:
+
+    std::unique_ptr<Expression> list;
+    std::unique_ptr<Expression> index;
+    bool checked = true;
+
+    IndexAccess(Location location, std::unique_ptr<TypeToken> type, std::unique_ptr<Expression> list, std::unique_ptr<Expression> index);
+
+};
+
 class ListLiteral : public Expression {
 public:
 
@@ -124,8 +168,15 @@ class NumberLiteral : public Expression {
 public:
 
     double value;
+    // Written without a decimal point, so it may be narrowed to an Int where one is expected.
+    bool integral;
+    // The exact value as an Int, since a double only holds every Int up to 2^53. Only set when fitsInt.
+    bool fitsInt;
+    int64_t intValue;
 
-    NumberLiteral(Location location, double value);
+    NumberLiteral(Location location, double value, bool integral);
+    // An Int literal.
+    NumberLiteral(Location location, int64_t intValue);
 
 };
 
@@ -144,13 +195,32 @@ public:
 
 };
 
+/**
+ * A record type, declared as record Point(x: Float, y: Float). Records are values: they are copied when passed or
+ * stored, and constructed by calling the record by name.
+ */
+class Record {
+public:
+
+    Location loc;
+    std::string id;
+    std::vector<std::string> fields;
+    std::vector<std::unique_ptr<TypeToken>> fieldTypes;
+
+    Record(Location loc, std::string id, std::vector<std::string> fields, std::vector<std::unique_ptr<TypeToken>> fieldTypes);
+
+};
+
 class Module {
 public:
 
+    std::vector<std::unique_ptr<Record>> records;
     std::vector<std::unique_ptr<Function>> functions;
 
-    explicit Module(std::vector<std::unique_ptr<Function>> functions);
+    Module(std::vector<std::unique_ptr<Record>> records, std::vector<std::unique_ptr<Function>> functions);
 
 };
 
+std::unique_ptr<Expression> cloneExpression(Expression &expression);
+
 #endif //TYPEDLETLANG_AST_H
@@ -0,0 +1,715 @@
+#include "BoundsChecks.h"
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <set>
+
+using namespace std;
+
+// No lower bound, or no upper bound, is known.
+const long long noBound = LLONG_MIN;
+const long long noUpper = LLONG_MAX;
+
+// The most elements a list can have, its size is an unsigned int.
+const long long maxListSize = UINT_MAX;
+
+/**
+ * The values an Int expression can have. Int arithmetic wraps, so an operation only has a range when neither end of it
+ * can overflow.
+ */
+struct Range {
+    long long lower = noBound;
+    long long upper = noUpper;
+};
+
+/**
+ * An Int expression, by the key keyOf gives it, that is known to be less than the size of a list.
+ */
+struct Below {
+    string key;
+    string list;
+    // The names the expression reads, the fact is dropped once any of them is shadowed.
+    set<string> names;
+};
+
+/**
+ * What is known at some point of a function: bounds of Int names, expressions below the size of a list, and the
+ * functions that names call.
+ */
+struct Facts {
+    map<string, long long> lower;
+    map<string, long long> upper;
+    vector<Below> below;
+    // Lists bound to a list literal, and names bound to size(list).
+    map<string, size_t> literalSizes;
+    map<string, string> sizeOf;
+    map<string, Function *> functions;
+    bool sizeShadowed = false;
+
+    /**
+     * A new binding of name hides everything known about the old one.
+     */
+    void bind(const string &name) {
+        lower.erase(name);
+        upper.erase(name);
+        literalSizes.erase(name);
+        functions.erase(name);
+
+        below.erase(remove_if(below.begin(), below.end(), [&](Below &fact) {
+            return fact.list == name || fact.names.count(name) == 1;
+        }), below.end());
+
+        for (auto i = sizeOf.begin(); i != sizeOf.end();) {
+            i = i->first == name || i->second == name ? sizeOf.erase(i) : next(i);
+        }
+
+        if (name == "size") {
+            sizeShadowed = true;
+        }
+    }
+};
+
+/**
+ * Finds list indexes that can't be out of range and clears their checked flag. An index is safe when it is known to
+ * be at least 0 and below size(list), which is learned from the conditions of enclosing ifs, from lets, and from
+ * arithmetic on those. Lower bounds of parameters come from every call of a function: starting from the assumption
+ * that nothing calls it, each pass over the module lowers them to what the calls pass in until nothing changes. A
+ * function used as a value may be called from anywhere, so nothing is assumed about its parameters.
+ */
+class BoundsChecker {
+
+    Module &module;
+    map<Function *, vector<Range>> paramBounds;
+    set<Function *> escaped;
+    bool changed = false;
+    bool marking = false;
+
+public:
+    explicit BoundsChecker(Module &module) : module(module) {
+
+    }
+
+    void run() {
+        for (auto &func : module.functions) {
+            if (func->id == "main") {
+                escape(func.get());
+            }
+        }
+
+        do {
+            changed = false;
+            checkModule();
+        } while (changed);
+
+        marking = true;
+        checkModule();
+    }
+
+private:
+    void checkModule() {
+        Facts facts;
+
+        for (auto &record : module.records) {
+            facts.bind(record->id);
+        }
+
+        for (auto &func : module.functions) {
+            facts.bind(func->id);
+            facts.functions[func->id] = func.get();
+        }
+
+        for (auto &func : module.functions) {
+            checkFunction(*func, facts);
+        }
+    }
+
+    void checkFunction(Function &func, Facts &outer) {
+        if (paramBounds.count(&func) == 0) {
+            return;
+        }
+
+        Facts facts = outer;
+
+        for (unsigned int i = 0; i < func.params.size(); i++) {
+            facts.bind(func.params[i]);
+
+            auto &bounds = paramBounds[&func][i];
+
+            if (bounds.lower != noBound) {
+                facts.lower[func.params[i]] = bounds.lower;
+            }
+
+            if (bounds.upper != noUpper) {
+                facts.upper[func.params[i]] = bounds.upper;
+            }
+        }
+
+        check(*func.body, facts);
+    }
+
+    void check(Expression &expression, Facts &facts) {
+        switch (expression.kind) {
+            case ExpressionKind::assignment: {
+                auto &ex = (Assignment &) expression;
+
+                check(*ex.body, facts);
+                let(ex, facts);
+                break;
+            }
+            case ExpressionKind::function: {
+                auto &ex = (Function &) expression;
+
+                facts.bind(ex.id);
+                facts.functions[ex.id] = &ex;
+                checkFunction(ex, facts);
+                break;
+            }
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                auto callee = calledFunction(ex, facts);
+
+                if (callee == nullptr) {
+                    check(*ex.source, facts);
+                }
+
+                for (auto &arg : ex.args) {
+                    check(*arg, facts);
+                }
+
+                if (callee != nullptr) {
+                    called(*callee, ex, facts);
+                }
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                check(*ex.condition, facts);
+
+                Facts thenFacts = facts;
+                learn(*ex.condition, true, thenFacts);
+                check(*ex.thenEx, thenFacts);
+
+                Facts elseFacts = facts;
+                learn(*ex.condition, false, elseFacts);
+                check(*ex.elseEx, elseFacts);
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                check(*ex.left, facts);
+
+                // The right side of && only runs when the left is true, and of || when it is false.
+                if (ex.op == "&&" || ex.op == "||") {
+                    Facts rightFacts = facts;
+                    learn(*ex.left, ex.op == "&&", rightFacts);
+                    check(*ex.right, rightFacts);
+                } else {
+                    check(*ex.right, facts);
+                }
+                break;
+            }
+            case ExpressionKind::block: {
+                Facts inner = facts;
+
+                for (auto &statement : ((Block &) expression).body) {
+                    check(*statement, inner);
+                }
+                break;
+            }
+            case ExpressionKind::variable: {
+                auto function = facts.functions.find(((Variable &) expression).id);
+
+                if (function != facts.functions.end()) {
+                    escape(function->second);
+                }
+                break;
+            }
+            case ExpressionKind::fieldAccess:
+                check(*((FieldAccess &) expression).object, facts);
+                break;
+            case ExpressionKind::indexAccess: {
+                auto &ex = (IndexAccess &) expression;
+                check(*ex.list, facts);
+                check(*ex.index, facts);
+
+                if (marking && ex.list->kind == ExpressionKind::variable && inRange(*ex.index, ((Variable &) *ex.list).id, facts)) {
+                    ex.checked = false;
+                }
+                break;
+            }
+            case ExpressionKind::listLiteral:
+                for (auto &value : ((ListLiteral &) expression).values) {
+                    check(*value, facts);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    /**
+     * Binds a let, keeping what is known about its value under its name.
+     */
+    void let(Assignment &ex, Facts &facts) {
+        auto bounds = range(*ex.body, facts);
+        string sizedList;
+        bool isSize = sizeOf(*ex.body, facts, sizedList);
+
+        // Any list the value is known to index safely, checked before the name hides anything the value reads.
+        set<string> candidates;
+        vector<string> lists;
+
+        for (auto &fact : facts.below) {
+            candidates.insert(fact.list);
+        }
+
+        for (auto &literal : facts.literalSizes) {
+            candidates.insert(literal.first);
+        }
+
+        for (auto &alias : facts.sizeOf) {
+            candidates.insert(alias.second);
+        }
+
+        for (auto &list : candidates) {
+            if (isInt(*ex.body) && isBelow(*ex.body, list, facts)) {
+                lists.push_back(list);
+            }
+        }
+
+        facts.bind(ex.id);
+
+        if (bounds.lower != noBound) {
+            facts.lower[ex.id] = bounds.lower;
+        }
+
+        if (bounds.upper != noUpper) {
+            facts.upper[ex.id] = bounds.upper;
+        }
+
+        if (ex.body->kind == ExpressionKind::listLiteral) {
+            facts.literalSizes[ex.id] = ((ListLiteral &) *ex.body).values.size();
+        }
+
+        if (isSize && sizedList != ex.id) {
+            facts.sizeOf[ex.id] = sizedList;
+        }
+
+        for (auto &list : lists) {
+            if (list != ex.id) {
+                facts.below.push_back(Below{ex.id, list, {ex.id}});
+            }
+        }
+    }
+
+    Function* calledFunction(Call &ex, Facts &facts) {
+        if (ex.source->kind != ExpressionKind::variable) {
+            return nullptr;
+        }
+
+        auto function = facts.functions.find(((Variable &) *ex.source).id);
+
+        return function == facts.functions.end() ? nullptr : function->second;
+    }
+
+    /**
+     * Widens what is assumed about the parameters of callee to cover the arguments of this call. A bound that keeps
+     * moving would take a pass per step, so after the first call a lower bound only drops to 0 or to noBound, and an
+     * upper bound only rises to the largest list size or to noUpper.
+     */
+    void called(Function &callee, Call &ex, Facts &facts) {
+        vector<Range> bounds;
+
+        for (auto &arg : ex.args) {
+            bounds.push_back(range(*arg, facts));
+        }
+
+        if (paramBounds.count(&callee) == 0) {
+            paramBounds[&callee] = bounds;
+            changed = true;
+            return;
+        }
+
+        auto &current = paramBounds[&callee];
+
+        for (unsigned int i = 0; i < current.size() && i < bounds.size(); i++) {
+            if (bounds[i].lower < current[i].lower) {
+                current[i].lower = bounds[i].lower >= 0 && current[i].lower > 0 ? 0 : noBound;
+                changed = true;
+            }
+
+            if (bounds[i].upper > current[i].upper) {
+                current[i].upper = bounds[i].upper <= maxListSize && current[i].upper < maxListSize ? maxListSize : noUpper;
+                changed = true;
+            }
+        }
+    }
+
+    void escape(Function *func) {
+        if (escaped.count(func) == 1) {
+            return;
+        }
+
+        escaped.insert(func);
+        paramBounds[func] = vector<Range>(func->params.size());
+        changed = true;
+    }
+
+    /**
+     * Adds what must hold when condition evaluates to truth.
+     */
+    void learn(Expression &condition, bool truth, Facts &facts) {
+        if (condition.kind != ExpressionKind::binaryOp) {
+            return;
+        }
+
+        auto &ex = (BinaryOp &) condition;
+
+        if ((ex.op == "&&" && truth) || (ex.op == "||" && !truth)) {
+            learn(*ex.left, truth, facts);
+            learn(*ex.right, truth, facts);
+            return;
+        }
+
+        // Turn every comparison into left < right or left <= right.
+        Expression *left = ex.left.get();
+        Expression *right = ex.right.get();
+        bool strict;
+
+        if (ex.op == "<" || ex.op == ">=") {
+            strict = (ex.op == "<") == truth;
+        } else if (ex.op == ">" || ex.op == "<=") {
+            strict = (ex.op == ">") == truth;
+        } else {
+            return;
+        }
+
+        if ((ex.op == "<" || ex.op == "<=") != truth) {
+            swap(left, right);
+        }
+
+        if (!isInt(*left) || !isInt(*right)) {
+            return;
+        }
+
+        // A literal below a name bounds the name, and a name below a literal or a size is bounded by it.
+        if (left->kind == ExpressionKind::numberLiteral && right->kind == ExpressionKind::variable) {
+            auto value = ((NumberLiteral *) left)->intValue;
+            auto &id = ((Variable *) right)->id;
+
+            if (!strict || value < noUpper) {
+                auto bound = strict ? value + 1 : value;
+
+                if (facts.lower.count(id) == 0 || facts.lower[id] < bound) {
+                    facts.lower[id] = bound;
+                }
+            }
+        }
+
+        string list;
+
+        if (left->kind == ExpressionKind::variable) {
+            auto above = range(*right, facts).upper;
+            auto &id = ((Variable *) left)->id;
+
+            if (above != noUpper && above > noBound) {
+                auto bound = strict ? above - 1 : above;
+
+                if (facts.upper.count(id) == 0 || facts.upper[id] > bound) {
+                    facts.upper[id] = bound;
+                }
+            }
+        }
+
+        auto key = keyOf(*left);
+
+        if (key.empty()) {
+            return;
+        }
+
+        // left < size(list), or left <= size(list) - k for some k of at least 1.
+        bool below = strict && sizeOf(*right, facts, list);
+
+        // left <= size(list) puts left - 1 below it, as in counting down from the size.
+        if (!strict && sizeOf(*right, facts, list)) {
+            set<string> names;
+            collectNames(*left, names);
+            facts.below.push_back(Below{"(- " + key + " #1)", list, names});
+        }
+
+        if (!strict && right->kind == ExpressionKind::binaryOp) {
+            auto &difference = (BinaryOp &) *right;
+
+            below = difference.op == "-" && difference.right->kind == ExpressionKind::numberLiteral
+                    && ((NumberLiteral &) *difference.right).intValue >= 1 && sizeOf(*difference.left, facts, list);
+        }
+
+        if (below) {
+            set<string> names;
+            collectNames(*left, names);
+            facts.below.push_back(Below{key, list, names});
+        }
+    }
+
+    bool inRange(Expression &index, const string &list, Facts &facts) {
+        auto bound = lowerBound(index, facts);
+
+        return bound != noBound && bound >= 0 && isBelow(index, list, facts);
+    }
+
+    bool isBelow(Expression &expression, const string &list, Facts &facts) {
+        auto key = keyOf(expression);
+
+        for (auto &fact : facts.below) {
+            if (fact.list == list && fact.key == key && !key.empty()) {
+                return true;
+            }
+        }
+
+        switch (expression.kind) {
+            case ExpressionKind::numberLiteral: {
+                auto literal = facts.literalSizes.find(list);
+
+                return literal != facts.literalSizes.end() && ((NumberLiteral &) expression).intValue < (long long) literal->second;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                string divisor;
+
+                if (ex.op == "-" && ex.right->kind == ExpressionKind::numberLiteral && ((NumberLiteral &) *ex.right).intValue >= 0) {
+                    return isBelow(*ex.left, list, facts)
+                           || (((NumberLiteral &) *ex.right).intValue >= 1 && sizeOf(*ex.left, facts, divisor) && divisor == list);
+                }
+
+                // A remainder takes the sign of the left side, an empty list divides by zero before it's indexed.
+                if (ex.op == "%" && sizeOf(*ex.right, facts, divisor) && divisor == list) {
+                    auto bound = lowerBound(*ex.left, facts);
+                    return bound != noBound && bound >= 0;
+                }
+
+                return false;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+
+                Facts thenFacts = facts;
+                learn(*ex.condition, true, thenFacts);
+
+                Facts elseFacts = facts;
+                learn(*ex.condition, false, elseFacts);
+
+                return isBelow(*ex.thenEx, list, thenFacts) && isBelow(*ex.elseEx, list, elseFacts);
+            }
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * The smallest value an Int expression can have, or noBound.
+     */
+    long long lowerBound(Expression &expression, Facts &facts) {
+        return range(expression, facts).lower;
+    }
+
+    Range range(Expression &expression, Facts &facts) {
+        Range result;
+
+        if (!isInt(expression)) {
+            return result;
+        }
+
+        switch (expression.kind) {
+            case ExpressionKind::numberLiteral:
+                result.lower = ((NumberLiteral &) expression).intValue;
+                result.upper = result.lower;
+                return result;
+            case ExpressionKind::variable: {
+                auto &id = ((Variable &) expression).id;
+                auto lower = facts.lower.find(id);
+                auto upper = facts.upper.find(id);
+
+                result.lower = lower == facts.lower.end() ? noBound : lower->second;
+                result.upper = upper == facts.upper.end() ? noUpper : upper->second;
+
+                for (auto &fact : facts.below) {
+                    if (fact.key == id) {
+                        result.upper = min(result.upper, maxListSize - 1);
+                    }
+                }
+
+                return result;
+            }
+            case ExpressionKind::call: {
+                string list;
+
+                if (!sizeOf(expression, facts, list)) {
+                    return result;
+                }
+
+                auto literal = facts.literalSizes.find(list);
+
+                if (literal == facts.literalSizes.end()) {
+                    result.lower = 0;
+                    result.upper = maxListSize;
+                } else {
+                    result.lower = (long long) literal->second;
+                    result.upper = result.lower;
+                }
+
+                return result;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                auto left = range(*ex.left, facts);
+                auto right = range(*ex.right, facts);
+
+                if (left.lower == noBound || right.lower == noBound) {
+                    return result;
+                }
+
+                // Dividing non-negative Ints can't overflow, whatever the upper bounds are.
+                if ((ex.op == "/" || ex.op == "%") && left.lower >= 0 && right.lower >= 0) {
+                    result.lower = 0;
+                    result.upper = left.upper;
+                    return result;
+                }
+
+                if (left.upper == noUpper || right.upper == noUpper) {
+                    return result;
+                }
+
+                Range bounds;
+                bool overflows;
+
+                if (ex.op == "+") {
+                    overflows = __builtin_add_overflow(left.lower, right.lower, &bounds.lower)
+                                || __builtin_add_overflow(left.upper, right.upper, &bounds.upper);
+                } else if (ex.op == "-") {
+                    overflows = __builtin_sub_overflow(left.lower, right.upper, &bounds.lower)
+                                || __builtin_sub_overflow(left.upper, right.lower, &bounds.upper);
+                } else if (ex.op == "*" && left.lower >= 0 && right.lower >= 0) {
+                    overflows = __builtin_mul_overflow(left.lower, right.lower, &bounds.lower)
+                                || __builtin_mul_overflow(left.upper, right.upper, &bounds.upper);
+                } else {
+                    return result;
+                }
+
+                // Neither end may reach the values that mean unknown either.
+                if (overflows || bounds.lower == noBound || bounds.upper == noUpper) {
+                    return result;
+                }
+
+                return bounds;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+
+                Facts thenFacts = facts;
+                learn(*ex.condition, true, thenFacts);
+
+                Facts elseFacts = facts;
+                learn(*ex.condition, false, elseFacts);
+
+                auto thenRange = range(*ex.thenEx, thenFacts);
+                auto elseRange = range(*ex.elseEx, elseFacts);
+
+                result.lower = thenRange.lower == noBound || elseRange.lower == noBound ? noBound : min(thenRange.lower, elseRange.lower);
+                result.upper = max(thenRange.upper, elseRange.upper);
+                return result;
+            }
+            case ExpressionKind::block: {
+                auto &ex = (Block &) expression;
+                Facts inner = facts;
+
+                for (unsigned int i = 0; i + 1 < ex.body.size(); i++) {
+                    if (ex.body[i]->kind == ExpressionKind::assignment) {
+                        let((Assignment &) *ex.body[i], inner);
+                    } else if (ex.body[i]->kind == ExpressionKind::function) {
+                        inner.bind(((Function &) *ex.body[i]).id);
+                    }
+                }
+
+                return ex.body.empty() ? result : range(*ex.body.back(), inner);
+            }
+            default:
+                return result;
+        }
+    }
+
+    /**
+     * Whether expression is size(list), directly or through a name bound to it, and if so which list.
+     */
+    bool sizeOf(Expression &expression, Facts &facts, string &list) {
+        if (expression.kind == ExpressionKind::variable) {
+            auto alias = facts.sizeOf.find(((Variable &) expression).id);
+
+            if (alias == facts.sizeOf.end()) {
+                return false;
+            }
+
+            list = alias->second;
+            return true;
+        }
+
+        if (expression.kind != ExpressionKind::call || facts.sizeShadowed) {
+            return false;
+        }
+
+        auto &ex = (Call &) expression;
+
+        if (ex.source->kind != ExpressionKind::variable || ((Variable &) *ex.source).id != "size"
+            || ex.args.size() != 1 || ex.args[0]->kind != ExpressionKind::variable) {
+            return false;
+        }
+
+        list = ((Variable &) *ex.args[0]).id;
+        return true;
+    }
+
+    /**
+     * Names and Int literals combined with + - and *, written out so equal expressions get equal keys. Anything else
+     * has no key.
+     */
+    string keyOf(Expression &expression) {
+        switch (expression.kind) {
+            case ExpressionKind::variable:
+                return ((Variable &) expression).id;
+            case ExpressionKind::numberLiteral:
+                return isInt(expression) ? "#" + to_string(((NumberLiteral &) expression).intValue) : "";
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+
+                if (ex.op != "+" && ex.op != "-" && ex.op != "*") {
+                    return "";
+                }
+
+                auto left = keyOf(*ex.left);
+                auto right = keyOf(*ex.right);
+
+                return left.empty() || right.empty() ? "" : "(" + ex.op + " " + left + " " + right + ")";
+            }
+            default:
+                return "";
+        }
+    }
+
+    void collectNames(Expression &expression, set<string> &names) {
+        if (expression.kind == ExpressionKind::variable) {
+            names.insert(((Variable &) expression).id);
+        } else if (expression.kind == ExpressionKind::binaryOp) {
+            collectNames(*((BinaryOp &) expression).left, names);
+            collectNames(*((BinaryOp &) expression).right, names);
+        }
+    }
+
+    bool isInt(Expression &expression) {
+        return BaseTypeToken(BasicTypeTokenKind::Int) == expression.type();
+    }
+
+};
+
+void markSafeIndexes(Module &module) {
+    BoundsChecker checker(module);
+    checker.run();
+}
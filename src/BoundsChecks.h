@@ -0,0 +1,8 @@
+#ifndef TYPEDLETLANG_BOUNDSCHECKS_H
+#define TYPEDLETLANG_BOUNDSCHECKS_H
+
+#include "Ast.h"
+
+void markSafeIndexes(Module &module);
+
+#endif //TYPEDLETLANG_BOUNDSCHECKS_H
@@ -0,0 +1,204 @@
+#include "CallGraph.h"
+
+using namespace std;
+
+// Library functions that do more than compute their result.
+const set<string> effectFunctions = {"printd", "printds", "printi", "printis", "printbs"};
+
+CallGraph::CallGraph(Module &module) {
+    for (auto &fun : module.functions) {
+        functions[fun->id] = fun.get();
+    }
+
+    for (auto &fun : module.functions) {
+        collect(*fun->body, edges[fun->id]);
+    }
+}
+
+Function *CallGraph::lookup(const string &id) {
+    auto found = functions.find(id);
+    return found == functions.end() ? nullptr : found->second;
+}
+
+set<string> &CallGraph::callees(const string &id) {
+    return edges[id];
+}
+
+set<string> CallGraph::reachableFrom(const string &id) {
+    set<string> seen;
+    vector<string> pending{id};
+
+    while (!pending.empty()) {
+        auto next = pending.back();
+        pending.pop_back();
+
+        if (!seen.insert(next).second) {
+            continue;
+        }
+
+        for (auto &callee : edges[next]) {
+            pending.push_back(callee);
+        }
+    }
+
+    return seen;
+}
+
+bool CallGraph::isRecursive(const string &id) {
+    for (auto &callee : edges[id]) {
+        if (reachableFrom(callee).count(id) == 1) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+string CallGraph::reachableEffect(const string &id) {
+    auto reachable = reachableFrom(id);
+
+    for (auto &name : effectFunctions) {
+        if (reachable.count(name) == 1) {
+            return name;
+        }
+    }
+
+    return "";
+}
+
+vector<Function *> CallGraph::bottomUp() {
+    set<string> seen;
+    vector<Function *> order;
+
+    for (auto &fun : functions) {
+        visit(fun.first, seen, order);
+    }
+
+    return order;
+}
+
+void CallGraph::visit(const string &id, set<string> &seen, vector<Function *> &order) {
+    if (functions.count(id) == 0 || !seen.insert(id).second) {
+        return;
+    }
+
+    for (auto &callee : edges[id]) {
+        visit(callee, seen, order);
+    }
+
+    order.push_back(functions[id]);
+}
+
+void CallGraph::collect(Expression &expression, set<string> &names) {
+    switch (expression.kind) {
+        case ExpressionKind::assignment:
+            collect(*((Assignment &) expression).body, names);
+            break;
+        case ExpressionKind::function:
+            collect(*((Function &) expression).body, names);
+            break;
+        case ExpressionKind::call: {
+            auto &ex = (Call &) expression;
+            collect(*ex.source, names);
+
+            for (auto &arg : ex.args) {
+                collect(*arg, names);
+            }
+            break;
+        }
+        case ExpressionKind::ifEx: {
+            auto &ex = (If &) expression;
+            collect(*ex.condition, names);
+            collect(*ex.thenEx, names);
+            collect(*ex.elseEx, names);
+            break;
+        }
+        case ExpressionKind::binaryOp: {
+            auto &ex = (BinaryOp &) expression;
+            collect(*ex.left, names);
+            collect(*ex.right, names);
+            break;
+        }
+        case ExpressionKind::block:
+            for (auto &next : ((Block &) expression).body) {
+                collect(*next, names);
+            }
+            break;
+        case ExpressionKind::variable:
+            names.insert(((Variable &) expression).id);
+            break;
+        case ExpressionKind::fieldAccess:
+            collect(*((FieldAccess &) expression).object, names);
+            break;
+        case ExpressionKind::indexAccess:
+            collect(*((IndexAccess &) expression).list, names);
+            collect(*((IndexAccess &) expression).index, names);
+            break;
+        case ExpressionKind::listLiteral:
+            for (auto &next : ((ListLiteral &) expression).values) {
+                collect(*next, names);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void collectBindings(Expression &expression, set<string> &names) {
+    switch (expression.kind) {
+        case ExpressionKind::assignment: {
+            auto &ex = (Assignment &) expression;
+            names.insert(ex.id);
+            collectBindings(*ex.body, names);
+            break;
+        }
+        case ExpressionKind::function: {
+            auto &ex = (Function &) expression;
+            names.insert(ex.id);
+            names.insert(ex.params.begin(), ex.params.end());
+            collectBindings(*ex.body, names);
+            break;
+        }
+        case ExpressionKind::call: {
+            auto &ex = (Call &) expression;
+            collectBindings(*ex.source, names);
+
+            for (auto &arg : ex.args) {
+                collectBindings(*arg, names);
+            }
+            break;
+        }
+        case ExpressionKind::ifEx: {
+            auto &ex = (If &) expression;
+            collectBindings(*ex.condition, names);
+            collectBindings(*ex.thenEx, names);
+            collectBindings(*ex.elseEx, names);
+            break;
+        }
+        case ExpressionKind::binaryOp: {
+            auto &ex = (BinaryOp &) expression;
+            collectBindings(*ex.left, names);
+            collectBindings(*ex.right, names);
+            break;
+        }
+        case ExpressionKind::block:
+            for (auto &next : ((Block &) expression).body) {
+                collectBindings(*next, names);
+            }
+            break;
+        case ExpressionKind::fieldAccess:
+            collectBindings(*((FieldAccess &) expression).object, names);
+            break;
+        case ExpressionKind::indexAccess:
+            collectBindings(*((IndexAccess &) expression).list, names);
+            collectBindings(*((IndexAccess &) expression).index, names);
+            break;
+        case ExpressionKind::listLiteral:
+            for (auto &next : ((ListLiteral &) expression).values) {
+                collectBindings(*next, names);
+            }
+            break;
+        default:
+            break;
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef TYPEDLETLANG_CALLGRAPH_H
+#define TYPEDLETLANG_CALLGRAPH_H
+
+#include <map>
+#include <set>
+#include "Ast.h"
+
+/**
+ * Which names each module function refers to. A reference counts as a call whether or not it is called directly,
+ * since a function that is passed around may be called later. Every name read is kept, library functions and locals
+ * included, so the graph can only overestimate what a function calls.
+ */
+class CallGraph {
+
+    std::map<std::string, Function *> functions;
+    std::map<std::string, std::set<std::string>> edges;
+
+public:
+
+    explicit CallGraph(Module &module);
+
+    Function *lookup(const std::string &id);
+
+    std::set<std::string> &callees(const std::string &id);
+
+    std::set<std::string> reachableFrom(const std::string &id);
+
+    bool isRecursive(const std::string &id);
+
+    /**
+     * A library function with effects that the function might end up calling, or empty if there is none.
+     */
+    std::string reachableEffect(const std::string &id);
+
+    /**
+     * Module functions ordered so that every function comes after the ones it calls, cycles aside.
+     */
+    std::vector<Function *> bottomUp();
+
+private:
+
+    void collect(Expression &expression, std::set<std::string> &names);
+
+    void visit(const std::string &id, std::set<std::string> &seen, std::vector<Function *> &order);
+
+};
+
+/**
+ * Adds every name the expression binds, through lets, nested functions and their parameters.
+ */
+void collectBindings(Expression &expression, std::set<std::string> &names);
+
+#endif //TYPEDLETLANG_CALLGRAPH_H
@@ -0,0 +1,393 @@
+#include "Closures.h"
+#include <algorithm>
+#include <map>
+#include <set>
+
+using namespace std;
+
+/**
+ * Gives nested functions a way to read the names of the functions around them. A nested function that is only ever
+ * called directly is lambda lifted: everything it reads from outside becomes an extra parameter, and every call passes
+ * it along, so it needs no allocation at all. One that is used as a value keeps its signature and lists what it reads
+ * in Function::captures, which the compiler stores in a single environment when the function is defined.
+ */
+class ClosureConverter {
+
+    // Nested functions that compile to a plain function, so reading them doesn't capture anything.
+    set<string> plainFunctions;
+
+public:
+    void convertModuleFunction(Function &func) {
+        plainFunctions.clear();
+
+        map<string, TypeToken *> outer;
+        convert(func, outer);
+    }
+
+private:
+    /**
+     * @param outer names bound by the enclosing functions along with their types
+     * @return the names from outer that func reads
+     */
+    set<string> convert(Function &func, map<string, TypeToken *> &outer) {
+        map<string, TypeToken *> own;
+        auto &funcType = (BasicFunctionTypeToken &) func.type();
+
+        for (size_t i = 0; i < func.params.size(); i++) {
+            own[func.params[i]] = funcType.params[i].get();
+        }
+
+        collectOwnBindings(*func.body, own);
+
+        auto visible = outer;
+
+        for (auto &entry : own) {
+            visible[entry.first] = entry.second;
+        }
+
+        vector<Function *> nested;
+        collectNested(*func.body, nested);
+
+        for (auto inner : nested) {
+            auto captured = convert(*inner, visible);
+
+            if (captured.empty()) {
+                plainFunctions.insert(inner->id);
+            } else if (isOnlyCalled(*func.body, inner->id)) {
+                lift(*inner, captured, visible, *func.body);
+                plainFunctions.insert(inner->id);
+            } else {
+                inner->captures.assign(captured.begin(), captured.end());
+            }
+        }
+
+        set<string> reads;
+        collectReads(*func.body, reads);
+
+        set<string> captured;
+
+        for (auto &name : reads) {
+            if (own.count(name) == 0 && outer.count(name) == 1 && plainFunctions.count(name) == 0) {
+                captured.insert(name);
+            }
+        }
+
+        return captured;
+    }
+
+    void lift(Function &func, set<string> &captured, map<string, TypeToken *> &visible, Expression &scope) {
+        auto &funcType = (BasicFunctionTypeToken &) func.type();
+
+        for (auto &name : captured) {
+            func.params.push_back(name);
+            funcType.params.push_back(visible[name]->clone());
+        }
+
+        addArguments(scope, func.id, captured, visible);
+    }
+
+    /**
+     * Names bound directly by the function, not counting the insides of nested functions.
+     */
+    void collectOwnBindings(Expression &expression, map<string, TypeToken *> &names) {
+        switch (expression.kind) {
+            case ExpressionKind::assignment: {
+                auto &ex = (Assignment &) expression;
+                names[ex.id] = &ex.type();
+                collectOwnBindings(*ex.body, names);
+                break;
+            }
+            case ExpressionKind::function: {
+                auto &ex = (Function &) expression;
+                names[ex.id] = &ex.type();
+                break;
+            }
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                collectOwnBindings(*ex.source, names);
+
+                for (auto &arg : ex.args) {
+                    collectOwnBindings(*arg, names);
+                }
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                collectOwnBindings(*ex.condition, names);
+                collectOwnBindings(*ex.thenEx, names);
+                collectOwnBindings(*ex.elseEx, names);
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                collectOwnBindings(*ex.left, names);
+                collectOwnBindings(*ex.right, names);
+                break;
+            }
+            case ExpressionKind::block:
+                for (auto &next : ((Block &) expression).body) {
+                    collectOwnBindings(*next, names);
+                }
+                break;
+            case ExpressionKind::fieldAccess:
+                collectOwnBindings(*((FieldAccess &) expression).object, names);
+                break;
+            case ExpressionKind::indexAccess:
+                collectOwnBindings(*((IndexAccess &) expression).list, names);
+                collectOwnBindings(*((IndexAccess &) expression).index, names);
+                break;
+            case ExpressionKind::listLiteral:
+                for (auto &next : ((ListLiteral &) expression).values) {
+                    collectOwnBindings(*next, names);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    /**
+     * Nested functions defined directly in the body, in the order they are defined.
+     */
+    void collectNested(Expression &expression, vector<Function *> &nested) {
+        switch (expression.kind) {
+            case ExpressionKind::assignment:
+                collectNested(*((Assignment &) expression).body, nested);
+                break;
+            case ExpressionKind::function:
+                nested.push_back((Function *) &expression);
+                break;
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                collectNested(*ex.source, nested);
+
+                for (auto &arg : ex.args) {
+                    collectNested(*arg, nested);
+                }
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                collectNested(*ex.condition, nested);
+                collectNested(*ex.thenEx, nested);
+                collectNested(*ex.elseEx, nested);
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                collectNested(*ex.left, nested);
+                collectNested(*ex.right, nested);
+                break;
+            }
+            case ExpressionKind::block:
+                for (auto &next : ((Block &) expression).body) {
+                    collectNested(*next, nested);
+                }
+                break;
+            case ExpressionKind::fieldAccess:
+                collectNested(*((FieldAccess &) expression).object, nested);
+                break;
+            case ExpressionKind::indexAccess:
+                collectNested(*((IndexAccess &) expression).list, nested);
+                collectNested(*((IndexAccess &) expression).index, nested);
+                break;
+            case ExpressionKind::listLiteral:
+                for (auto &next : ((ListLiteral &) expression).values) {
+                    collectNested(*next, nested);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    /**
+     * Names read by the body, including what its nested functions need from it: the environment of a closure is
+     * filled where it is defined, and lifted functions already had their arguments added to the calls.
+     */
+    void collectReads(Expression &expression, set<string> &reads) {
+        switch (expression.kind) {
+            case ExpressionKind::assignment:
+                collectReads(*((Assignment &) expression).body, reads);
+                break;
+            case ExpressionKind::function: {
+                auto &ex = (Function &) expression;
+                reads.insert(ex.captures.begin(), ex.captures.end());
+                break;
+            }
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                collectReads(*ex.source, reads);
+
+                for (auto &arg : ex.args) {
+                    collectReads(*arg, reads);
+                }
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                collectReads(*ex.condition, reads);
+                collectReads(*ex.thenEx, reads);
+                collectReads(*ex.elseEx, reads);
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                collectReads(*ex.left, reads);
+                collectReads(*ex.right, reads);
+                break;
+            }
+            case ExpressionKind::block:
+                for (auto &next : ((Block &) expression).body) {
+                    collectReads(*next, reads);
+                }
+                break;
+            case ExpressionKind::variable:
+                reads.insert(((Variable &) expression).id);
+                break;
+            case ExpressionKind::fieldAccess:
+                collectReads(*((FieldAccess &) expression).object, reads);
+                break;
+            case ExpressionKind::indexAccess:
+                collectReads(*((IndexAccess &) expression).list, reads);
+                collectReads(*((IndexAccess &) expression).index, reads);
+                break;
+            case ExpressionKind::listLiteral:
+                for (auto &next : ((ListLiteral &) expression).values) {
+                    collectReads(*next, reads);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    bool shadows(Function &func, const string &id) {
+        return func.id == id || find(func.params.begin(), func.params.end(), id) != func.params.end();
+    }
+
+    /**
+     * Is every use of the name the function being called, in this scope and any nested function that can see it?
+     */
+    bool isOnlyCalled(Expression &expression, const string &id) {
+        switch (expression.kind) {
+            case ExpressionKind::assignment:
+                return isOnlyCalled(*((Assignment &) expression).body, id);
+            case ExpressionKind::function: {
+                auto &ex = (Function &) expression;
+                return shadows(ex, id) || isOnlyCalled(*ex.body, id);
+            }
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                bool called = ex.source->kind == ExpressionKind::variable || isOnlyCalled(*ex.source, id);
+
+                for (auto &arg : ex.args) {
+                    called = called && isOnlyCalled(*arg, id);
+                }
+
+                return called;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                return isOnlyCalled(*ex.condition, id) && isOnlyCalled(*ex.thenEx, id) && isOnlyCalled(*ex.elseEx, id);
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                return isOnlyCalled(*ex.left, id) && isOnlyCalled(*ex.right, id);
+            }
+            case ExpressionKind::block:
+                for (auto &next : ((Block &) expression).body) {
+                    if (!isOnlyCalled(*next, id)) {
+                        return false;
+                    }
+                }
+                return true;
+            case ExpressionKind::variable:
+                return ((Variable &) expression).id != id;
+            case ExpressionKind::fieldAccess:
+                return isOnlyCalled(*((FieldAccess &) expression).object, id);
+            case ExpressionKind::indexAccess:
+                return isOnlyCalled(*((IndexAccess &) expression).list, id) && isOnlyCalled(*((IndexAccess &) expression).index, id);
+            case ExpressionKind::listLiteral:
+                for (auto &next : ((ListLiteral &) expression).values) {
+                    if (!isOnlyCalled(*next, id)) {
+                        return false;
+                    }
+                }
+                return true;
+            default:
+                return true;
+        }
+    }
+
+    void addArguments(Expression &expression, const string &id, set<string> &captured, map<string, TypeToken *> &visible) {
+        switch (expression.kind) {
+            case ExpressionKind::assignment:
+                addArguments(*((Assignment &) expression).body, id, captured, visible);
+                break;
+            case ExpressionKind::function: {
+                auto &ex = (Function &) expression;
+
+                if (!shadows(ex, id)) {
+                    addArguments(*ex.body, id, captured, visible);
+                }
+                break;
+            }
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+
+                for (auto &arg : ex.args) {
+                    addArguments(*arg, id, captured, visible);
+                }
+
+                if (ex.source->kind == ExpressionKind::variable && ((Variable &) *ex.source).id == id) {
+                    for (auto &name : captured) {
+                        ex.args.push_back(make_unique<Variable>(ex.loc(), name, visible[name]->clone()));
+                    }
+                }
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                addArguments(*ex.condition, id, captured, visible);
+                addArguments(*ex.thenEx, id, captured, visible);
+                addArguments(*ex.elseEx, id, captured, visible);
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                addArguments(*ex.left, id, captured, visible);
+                addArguments(*ex.right, id, captured, visible);
+                break;
+            }
+            case ExpressionKind::block:
+                for (auto &next : ((Block &) expression).body) {
+                    addArguments(*next, id, captured, visible);
+                }
+                break;
+            case ExpressionKind::fieldAccess:
+                addArguments(*((FieldAccess &) expression).object, id, captured, visible);
+                break;
+            case ExpressionKind::indexAccess:
+                addArguments(*((IndexAccess &) expression).list, id, captured, visible);
+                addArguments(*((IndexAccess &) expression).index, id, captured, visible);
+                break;
+            case ExpressionKind::listLiteral:
+                for (auto &next : ((ListLiteral &) expression).values) {
+                    addArguments(*next, id, captured, visible);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+};
+
+void convertClosures(Module &module) {
+    ClosureConverter converter;
+
+    for (auto &fun : module.functions) {
+        converter.convertModuleFunction(*fun);
+    }
+}
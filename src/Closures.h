@@ -0,0 +1,8 @@
+#ifndef TYPEDLETLANG_CLOSURES_H
+#define TYPEDLETLANG_CLOSURES_H
+
+#include "Ast.h"
+
+void convertClosures(Module &module);
+
+#endif //TYPEDLETLANG_CLOSURES_H
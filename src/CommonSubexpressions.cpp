@@ -0,0 +1,534 @@
+#include "CommonSubexpressions.h"
+#include "CallGraph.h"
+#include <cstdio>
+
+using namespace std;
+
+/**
+ * Where an expression that might be shared is first computed unconditionally in a block.
+ */
+struct Candidate {
+    size_t statement;
+    Expression *first;
+    int cost;
+};
+
+/**
+ * Finds pure expressions that a block computes more than once and computes them once in a new let instead. Two
+ * expressions are the same when they print to the same key, which works because every name is bound once per
+ * function and never changes.
+ *
+ * An expression is only hoisted from a position the block always evaluates, and never from after a call with effects
+ * in the same statement, so that nothing runs earlier or more often than it used to. Names, literals and field
+ * accesses cost nothing to repeat, and LLVM shares a single operation by itself, so cheaper expressions than
+ * minSharedCost are left alone.
+ */
+class CommonSubexpressions {
+
+    // Library functions that only compute their result.
+    const set<string> pureFunctions = {"toInt", "toFloat", "get", "count"};
+    const int minSharedCost = 2;
+    const int callCost = 2;
+
+    CallGraph graph;
+    set<string> locals;
+    int counter = 0;
+
+public:
+    explicit CommonSubexpressions(Module &module) : graph(module) {
+
+    }
+
+    void run(Module &module) {
+        for (auto &fun : module.functions) {
+            locals.clear();
+            locals.insert(fun->params.begin(), fun->params.end());
+            collectBindings(*fun->body, locals);
+            visit(*fun->body);
+        }
+    }
+
+private:
+    void visit(Expression &expression) {
+        switch (expression.kind) {
+            case ExpressionKind::assignment:
+                visit(*((Assignment &) expression).body);
+                break;
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                visit(*ex.source);
+
+                for (auto &arg : ex.args) {
+                    visit(*arg);
+                }
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                visit(*ex.condition);
+                visit(*ex.thenEx);
+                visit(*ex.elseEx);
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                visit(*ex.left);
+                visit(*ex.right);
+                break;
+            }
+            case ExpressionKind::block: {
+                auto &ex = (Block &) expression;
+                shareInBlock(ex);
+
+                for (auto &next : ex.body) {
+                    visit(*next);
+                }
+                break;
+            }
+            case ExpressionKind::fieldAccess:
+                visit(*((FieldAccess &) expression).object);
+                break;
+            case ExpressionKind::indexAccess:
+                visit(*((IndexAccess &) expression).list);
+                visit(*((IndexAccess &) expression).index);
+                break;
+            case ExpressionKind::listLiteral:
+                for (auto &next : ((ListLiteral &) expression).values) {
+                    visit(*next);
+                }
+                break;
+            default:
+                // Nested functions would have to capture the new let, leave them alone.
+                break;
+        }
+    }
+
+    void shareInBlock(Block &block) {
+        auto &body = block.body;
+
+        while (true) {
+            map<string, Candidate> candidates;
+
+            for (size_t i = 0; i < body.size(); i++) {
+                bool effectSeen = false;
+                scan(*body[i], i, effectSeen, candidates);
+            }
+
+            string bestKey;
+            Candidate *best = nullptr;
+
+            for (auto &entry : candidates) {
+                auto &candidate = entry.second;
+
+                if (best != nullptr && candidate.cost <= best->cost) {
+                    continue;
+                }
+
+                int uses = 0;
+
+                for (size_t i = candidate.statement; i < body.size(); i++) {
+                    uses += countOccurrences(*body[i], entry.first);
+                }
+
+                if (uses > 1) {
+                    bestKey = entry.first;
+                    best = &candidate;
+                }
+            }
+
+            if (best == nullptr) {
+                return;
+            }
+
+            auto &statement = *body[best->statement];
+
+            // Already bound by a let, later uses can just read it.
+            if (statement.kind == ExpressionKind::assignment && ((Assignment &) statement).body.get() == best->first) {
+                auto name = ((Assignment &) statement).id;
+
+                for (size_t i = best->statement + 1; i < body.size(); i++) {
+                    replaceOccurrences(body[i], bestKey, name);
+                }
+
+                continue;
+            }
+
+            auto name = "cse$" + to_string(++counter);
+            auto value = cloneExpression(*best->first);
+            auto location = value->loc();
+
+            for (size_t i = best->statement; i < body.size(); i++) {
+                replaceOccurrences(body[i], bestKey, name);
+            }
+
+            auto type = value->type().clone();
+            body.insert(body.begin() + best->statement, make_unique<Assignment>(location, move(type), name, move(value)));
+        }
+    }
+
+    /**
+     * Records the first place each shareable expression is computed, walking a statement in evaluation order.
+     */
+    void scan(Expression &expression, size_t statement, bool &effectSeen, map<string, Candidate> &candidates) {
+        switch (expression.kind) {
+            case ExpressionKind::assignment:
+                scan(*((Assignment &) expression).body, statement, effectSeen, candidates);
+                return;
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                scan(*ex.source, statement, effectSeen, candidates);
+
+                for (auto &arg : ex.args) {
+                    scan(*arg, statement, effectSeen, candidates);
+                }
+
+                record(expression, statement, effectSeen, candidates);
+
+                if (keyOf(expression).empty()) {
+                    effectSeen = true;
+                }
+                return;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                scan(*ex.condition, statement, effectSeen, candidates);
+                effectSeen = effectSeen || hasEffects(*ex.thenEx) || hasEffects(*ex.elseEx);
+                record(expression, statement, effectSeen, candidates);
+                return;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                scan(*ex.left, statement, effectSeen, candidates);
+
+                // The right side of a short circuit only runs sometimes.
+                if (ex.op == "&&" || ex.op == "||") {
+                    effectSeen = effectSeen || hasEffects(*ex.right);
+                } else {
+                    scan(*ex.right, statement, effectSeen, candidates);
+                }
+
+                record(expression, statement, effectSeen, candidates);
+                return;
+            }
+            case ExpressionKind::block:
+                // Anything found inside binds names from the block, which aren't visible out here.
+                effectSeen = effectSeen || hasEffects(expression);
+                return;
+            case ExpressionKind::fieldAccess:
+                scan(*((FieldAccess &) expression).object, statement, effectSeen, candidates);
+                record(expression, statement, effectSeen, candidates);
+                return;
+            case ExpressionKind::indexAccess:
+                scan(*((IndexAccess &) expression).list, statement, effectSeen, candidates);
+                scan(*((IndexAccess &) expression).index, statement, effectSeen, candidates);
+                return;
+            case ExpressionKind::listLiteral:
+                for (auto &next : ((ListLiteral &) expression).values) {
+                    scan(*next, statement, effectSeen, candidates);
+                }
+                return;
+            default:
+                return;
+        }
+    }
+
+    void record(Expression &expression, size_t statement, bool effectSeen, map<string, Candidate> &candidates) {
+        if (effectSeen || !isScalar(expression.type()) || cost(expression) < minSharedCost) {
+            return;
+        }
+
+        auto key = keyOf(expression);
+
+        if (!key.empty() && candidates.find(key) == candidates.end()) {
+            candidates[key] = Candidate{statement, &expression, cost(expression)};
+        }
+    }
+
+    /**
+     * A key that is equal for equal pure expressions, or empty when the expression might have effects or bind names.
+     */
+    string keyOf(Expression &expression) {
+        switch (expression.kind) {
+            case ExpressionKind::numberLiteral: {
+                auto &ex = (NumberLiteral &) expression;
+
+                if (BaseTypeToken(BasicTypeTokenKind::Int) == ex.type()) {
+                    return "Int:" + to_string(ex.intValue);
+                }
+
+                char buffer[32];
+                snprintf(buffer, sizeof(buffer), "%a", ex.value);
+                return expression.type().pretty() + ":" + buffer;
+            }
+            case ExpressionKind::booleanLiteral:
+                return ((BooleanLiteral &) expression).value ? "true" : "false";
+            case ExpressionKind::variable:
+                return "$" + ((Variable &) expression).id;
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                auto left = keyOf(*ex.left);
+                auto right = keyOf(*ex.right);
+
+                if (left.empty() || right.empty()) {
+                    return "";
+                }
+
+                return "(" + ex.op + " " + left + " " + right + ")";
+            }
+            case ExpressionKind::fieldAccess: {
+                auto &ex = (FieldAccess &) expression;
+                auto object = keyOf(*ex.object);
+
+                return object.empty() ? "" : "(." + ex.field + " " + object + ")";
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                auto condition = keyOf(*ex.condition);
+                auto thenEx = keyOf(*ex.thenEx);
+                auto elseEx = keyOf(*ex.elseEx);
+
+                if (condition.empty() || thenEx.empty() || elseEx.empty()) {
+                    return "";
+                }
+
+                return "(if " + condition + " " + thenEx + " " + elseEx + ")";
+            }
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+
+                if (ex.source->kind != ExpressionKind::variable || !isPure(((Variable &) *ex.source).id)) {
+                    return "";
+                }
+
+                string key = "(" + ((Variable &) *ex.source).id;
+
+                for (auto &arg : ex.args) {
+                    auto argKey = keyOf(*arg);
+
+                    if (argKey.empty()) {
+                        return "";
+                    }
+
+                    key += " " + argKey;
+                }
+
+                return key + ")";
+            }
+            default:
+                return "";
+        }
+    }
+
+    bool isPure(const string &id) {
+        if (locals.count(id) == 1) {
+            return false;
+        }
+
+        if (pureFunctions.count(id) == 1) {
+            return true;
+        }
+
+        return graph.lookup(id) != nullptr && graph.reachableEffect(id).empty();
+    }
+
+    bool isScalar(TypeToken &type) {
+        return BaseTypeToken(BasicTypeTokenKind::Float) == type
+               || BaseTypeToken(BasicTypeTokenKind::Int) == type
+               || BaseTypeToken(BasicTypeTokenKind::Boolean) == type;
+    }
+
+    bool hasEffects(Expression &expression) {
+        switch (expression.kind) {
+            case ExpressionKind::assignment:
+                return hasEffects(*((Assignment &) expression).body);
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+
+                if (ex.source->kind != ExpressionKind::variable || !isPure(((Variable &) *ex.source).id)) {
+                    return true;
+                }
+
+                for (auto &arg : ex.args) {
+                    if (hasEffects(*arg)) {
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                return hasEffects(*ex.condition) || hasEffects(*ex.thenEx) || hasEffects(*ex.elseEx);
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                return hasEffects(*ex.left) || hasEffects(*ex.right);
+            }
+            case ExpressionKind::block:
+                for (auto &next : ((Block &) expression).body) {
+                    if (hasEffects(*next)) {
+                        return true;
+                    }
+                }
+                return false;
+            case ExpressionKind::fieldAccess:
+                return hasEffects(*((FieldAccess &) expression).object);
+            case ExpressionKind::indexAccess:
+                return hasEffects(*((IndexAccess &) expression).list) || hasEffects(*((IndexAccess &) expression).index);
+            case ExpressionKind::listLiteral:
+                for (auto &next : ((ListLiteral &) expression).values) {
+                    if (hasEffects(*next)) {
+                        return true;
+                    }
+                }
+                return false;
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * Roughly how much work computing the expression again would be. A field access only reads part of a value that
+     * is already there.
+     */
+    int cost(Expression &expression) {
+        switch (expression.kind) {
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                int total = callCost;
+
+                for (auto &arg : ex.args) {
+                    total += cost(*arg);
+                }
+
+                return total;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                return 1 + cost(*ex.condition) + cost(*ex.thenEx) + cost(*ex.elseEx);
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                return 1 + cost(*ex.left) + cost(*ex.right);
+            }
+            case ExpressionKind::fieldAccess:
+                return cost(*((FieldAccess &) expression).object);
+            case ExpressionKind::indexAccess:
+                return 1 + cost(*((IndexAccess &) expression).list) + cost(*((IndexAccess &) expression).index);
+            default:
+                return 0;
+        }
+    }
+
+    int countOccurrences(Expression &expression, const string &key) {
+        if (keyOf(expression) == key) {
+            return 1;
+        }
+
+        switch (expression.kind) {
+            case ExpressionKind::assignment:
+                return countOccurrences(*((Assignment &) expression).body, key);
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                int total = 0;
+
+                for (auto &arg : ex.args) {
+                    total += countOccurrences(*arg, key);
+                }
+
+                return total;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                return countOccurrences(*ex.condition, key) + countOccurrences(*ex.thenEx, key) + countOccurrences(*ex.elseEx, key);
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                return countOccurrences(*ex.left, key) + countOccurrences(*ex.right, key);
+            }
+            case ExpressionKind::block: {
+                int total = 0;
+
+                for (auto &next : ((Block &) expression).body) {
+                    total += countOccurrences(*next, key);
+                }
+
+                return total;
+            }
+            case ExpressionKind::fieldAccess:
+                return countOccurrences(*((FieldAccess &) expression).object, key);
+            case ExpressionKind::indexAccess:
+                return countOccurrences(*((IndexAccess &) expression).list, key) + countOccurrences(*((IndexAccess &) expression).index, key);
+            case ExpressionKind::listLiteral: {
+                int total = 0;
+
+                for (auto &next : ((ListLiteral &) expression).values) {
+                    total += countOccurrences(*next, key);
+                }
+
+                return total;
+            }
+            default:
+                return 0;
+        }
+    }
+
+    void replaceOccurrences(unique_ptr<Expression> &expression, const string &key, const string &name) {
+        if (keyOf(*expression) == key) {
+            expression = make_unique<Variable>(expression->loc(), name, expression->type().clone());
+            return;
+        }
+
+        switch (expression->kind) {
+            case ExpressionKind::assignment:
+                replaceOccurrences(((Assignment &) *expression).body, key, name);
+                break;
+            case ExpressionKind::call: {
+                auto &ex = (Call &) *expression;
+
+                for (auto &arg : ex.args) {
+                    replaceOccurrences(arg, key, name);
+                }
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) *expression;
+                replaceOccurrences(ex.condition, key, name);
+                replaceOccurrences(ex.thenEx, key, name);
+                replaceOccurrences(ex.elseEx, key, name);
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) *expression;
+                replaceOccurrences(ex.left, key, name);
+                replaceOccurrences(ex.right, key, name);
+                break;
+            }
+            case ExpressionKind::block:
+                for (auto &next : ((Block &) *expression).body) {
+                    replaceOccurrences(next, key, name);
+                }
+                break;
+            case ExpressionKind::fieldAccess:
+                replaceOccurrences(((FieldAccess &) *expression).object, key, name);
+                break;
+            case ExpressionKind::indexAccess:
+                replaceOccurrences(((IndexAccess &) *expression).list, key, name);
+                replaceOccurrences(((IndexAccess &) *expression).index, key, name);
+                break;
+            case ExpressionKind::listLiteral:
+                for (auto &next : ((ListLiteral &) *expression).values) {
+                    replaceOccurrences(next, key, name);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+};
+
+void shareCommonSubexpressions(Module &module) {
+    CommonSubexpressions sharer(module);
+    sharer.run(module);
+}
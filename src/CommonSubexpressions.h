@@ -0,0 +1,8 @@
+#ifndef TYPEDLETLANG_COMMONSUBEXPRESSIONS_H
+#define TYPEDLETLANG_COMMONSUBEXPRESSIONS_H
+
+#include "Ast.h"
+
+void shareCommonSubexpressions(Module &module);
+
+#endif //TYPEDLETLANG_COMMONSUBEXPRESSIONS_H
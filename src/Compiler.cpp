@@ -3,15 +3,28 @@
 //
 
 #include "Compiler.h"
+#include "TailCalls.h"
+#include "Closures.h"
+#include "ParallelLets.h"
+#include "CallGraph.h"
+#include "BoundsChecks.h"
+#include "Utils.h"
+#include <algorithm>
 #include <fstream>
+#include <functional>
+#include <set>
 #include "llvm/ADT/APFloat.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Verifier.h"
 
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
@@ -20,35 +33,100 @@
 
 using namespace std;
 
+enum BranchHint {
+    none,
+    likely,
+    unlikely
+};
+
+/**
+ * A let running as a task on the runtime's pool, and where it writes its value.
+ */
+struct SpawnedLet {
+    Assignment* let;
+    llvm::Value* task;
+    llvm::Value* result;
+};
+
 class Compiler {
 
+    CompilerOptions options;
     llvm::LLVMContext con;
     llvm::Module mod;
     llvm::IRBuilder<> builder;
 
     vector<map<string, llvm::Value *>> contextStack;
+    // Largest combined cost of both arms that is still worth evaluating unconditionally to avoid a branch.
+    const int maxSelectCost = 4;
+    const int notSpeculatable = -1;
+    // Library functions on the packed Float types, which become a few vector instructions each.
+    const set<string> packedFunctions = {"float2", "float4", "float8", "lane", "withLane", "shuffle", "hsum", "hmin", "hmax"};
+    // Elements per pool task for parMap, and per partial result for parReduce so its grouping doesn't depend on the
+    // number of workers.
+    const long long parallelGrain = 2048;
+
     vector<vector<llvm::AllocaInst*>> declaredArraysStack;
+    vector<vector<llvm::Value*>> declaredVectorsStack;
+    set<llvm::Value*> listResultFunctions;
+    set<llvm::Value*> userFunctions;
+    map<Function*, llvm::Function*> declaredFunctions;
+    map<llvm::Function*, llvm::Function*> closureAdapters;
+
+    // Scopes below these indexes belong to enclosing functions.
+    size_t functionArraysBase = 0;
+    size_t functionVectorsBase = 0;
+
+    // Self calls in tail position jump back here with the new arguments instead of calling. Each parameter is a phi,
+    // or for a list the ArrayRef the loop keeps it in.
+    llvm::BasicBlock *tailRecursionHeader = nullptr;
+    vector<llvm::Value*> tailRecursionParams;
     map<string, llvm::Type *> types;
+    // Record declarations by name, each passed around as the struct of the same name in types.
+    map<string, Record *> records;
 
 public:
-    Compiler() : mod(llvm::Module("main", con)), builder(con) {
+    explicit Compiler(const CompilerOptions &options) : options(options), mod(llvm::Module("main", con)), builder(con) {
 
     }
 
     void compileModule(Module* ex) {
+        // Without a target opt has no cost model, and won't vectorise loops such as fused pipelines.
+        mod.setTargetTriple(llvm::sys::getDefaultTargetTriple());
+
         setupLibrary();
+        declareRecords(ex);
+
+        vector<Function *> live;
+
+        if (options.wholeProgram) {
+            CallGraph graph(*ex);
+            auto reachable = graph.reachableFrom("main");
+
+            for (auto &fun : ex->functions) {
+                if (reachable.count(fun->id) == 1) {
+                    live.push_back(fun.get());
+                } else {
+                    println("Skipping unreachable function " + fun->id);
+                }
+            }
+        } else {
+            for (auto &fun : ex->functions) {
+                live.push_back(fun.get());
+            }
+        }
 
         map<string, llvm::Value*> context;
 
-        for (auto &fun : ex->functions) {
-            context[fun->id] = getOrCreateFunction(fun.get());
+        for (auto fun : live) {
+            context[fun->id] = getOrCreateFunction(fun);
         }
 
         contextStack.push_back(move(context));
         declaredArraysStack.emplace_back();
+        declaredVectorsStack.emplace_back();
 
-        for (auto &fun : ex->functions) {
-            compileFunction(fun.get());
+        for (auto fun : live) {
+            compileFunction(fun);
         }
 
         std::string errorMessage;
@@ -79,31 +157,101 @@ private:
             }
             case ExpressionKind::function: {
                 auto ex = (Function *) expression;
+                llvm::Value *value = compileFunction(ex);
+
+                if (!ex->captures.empty()) {
+                    value = makeClosure(value, compileEnvironment(ex));
+                }
 
-                return compileFunction(ex);
+                contextStack.back()[ex->id] = value;
+                return value;
             }
             case ExpressionKind::call: {
                 auto ex = (Call *) expression;
 
-                auto func = compile(ex->source.get());
+                if (isPipelineEnd(ex)) {
+                    return compilePipeline(ex);
+                }
+
+                if (isPipelineCall(ex, { "parMap", "parReduce", "parFor" })) {
+                    return compileParallel(ex);
+                }
+
+                if (isPipelineCall(ex, { "slice", "head", "tail" })) {
+                    return compileSlice(ex);
+                }
+
+                if (isPipelineCall(ex, { "size" })) {
+                    return builder.CreateZExt(loadArraySize(compile(ex->args[0].get())), builder.getInt64Ty(), "size");
+                }
+
+                if (isPipelineCall(ex, packedFunctions)) {
+                    return compilePackedCall(ex);
+                }
+
+                // Named functions are called directly, anything else is a closure value.
+                auto func = ex->source->kind == ExpressionKind::variable
+                            ? lookupVariable((Variable *) ex->source.get())
+                            : compile(ex->source.get());
+
+                vector<llvm::Value *> args;
+                llvm::AllocaInst *resultArray = nullptr;
+
+                // Library functions that produce a list write it into an ArrayRef owned by the calling scope.
+                if (listResultFunctions.count(func) == 1) {
+                    resultArray = arrayAlloca("resultArray");
+                    declaredArraysStack.back().push_back(resultArray);
+                    args.push_back(resultArray);
+                }
+
+                for (auto &arg : ex->args) {
+                    args.push_back(compile(arg.get()));
+                }
+
+                if (ex->tail && resultArray == nullptr && userFunctions.count(func) == 1 && canTailCall(func)) {
+                    return compileTailCall(ex, (llvm::Function *) func, args);
+                }
+
+                llvm::CallInst *result;
+
+                if (llvm::isa<llvm::Function>(func)) {
+                    result = builder.CreateCall(func, args);
+
+                    if (userFunctions.count(func) == 1) {
+                        result->setCallingConv(((llvm::Function *) func)->getCallingConv());
+                    }
+                } else {
+                    result = callClosure(func, (BasicFunctionTypeToken &) ex->source->type(), args);
+                }
 
-                auto rawArgs = &ex->args;
+                if (resultArray != nullptr) {
+                    return resultArray;
+                }
 
-                llvm::Value *args[rawArgs->size()];
+                if (isListType(ex->type())) {
+                    return adoptList(result);
+                }
 
-                for (unsigned int i = 0; i < rawArgs->size(); i++) {
-                    args[i] = compile((*rawArgs)[i].get());
+                if (isVectorType(ex->type())) {
+                    declaredVectorsStack.back().push_back(result);
                 }
 
-                return builder.CreateCall(func, *args);
+                return result;
             }
             case ExpressionKind::ifEx: {
                 auto ex = (If *) expression;
 
                 //create condition
-                auto condition = compile(ex->condition.get());
-
-                auto ifBlock = builder.CreateICmpEQ(condition, llvm::ConstantInt::getTrue(con), "ifCondition");
+                BranchHint hint = BranchHint::none;
+                auto condition = compileCondition(ex->condition.get(), hint);
+
+                // Cheap side effect free arms are evaluated together and picked with a select, saving a branch
+                // that is hard to predict. A hinted condition is predictable, so it keeps its branch.
+                if (hint == BranchHint::none && isSelectable(ex)) {
+                    auto thenResult = compile(ex->thenEx.get());
+                    auto elseResult = compile(ex->elseEx.get());
+                    return builder.CreateSelect(condition, thenResult, elseResult, "selectTemp");
+                }
 
                 // create blocks
                 auto currentFunction = builder.GetInsertBlock()->getParent();
@@ -112,18 +260,24 @@ private:
                 auto elseBlock = llvm::BasicBlock::Create(con, "elseBlock");
                 auto mergeBlock = llvm::BasicBlock::Create(con, "ifContinued");
 
-                builder.CreateCondBr(ifBlock, thenBlock, elseBlock);
+                builder.CreateCondBr(condition, thenBlock, elseBlock, branchWeights(hint));
+
+                bool vectorResult = isVectorType(ex->type());
 
                 // Create then block
                 builder.SetInsertPoint(thenBlock);
+                declaredVectorsStack.emplace_back();
                 auto thenResult = compile(ex->thenEx.get());
+                releaseVectors(thenResult, vectorResult);
                 builder.CreateBr(mergeBlock);
                 thenBlock = builder.GetInsertBlock();
 
                 // Create else block
                 currentFunction->getBasicBlockList().push_back(elseBlock);
                 builder.SetInsertPoint(elseBlock);
+                declaredVectorsStack.emplace_back();
                 auto elseResult = compile(ex->elseEx.get());
+                releaseVectors(elseResult, vectorResult);
                 builder.CreateBr(mergeBlock);
                 elseBlock = builder.GetInsertBlock();
 
@@ -131,10 +285,21 @@ private:
                 currentFunction->getBasicBlockList().push_back(mergeBlock);
                 builder.SetInsertPoint(mergeBlock);
 
+                auto resultType = mapTypes(ex->type());
+
+                if (resultType->isVoidTy()) {
+                    return llvm::ConstantFP::get(con, llvm::APFloat(0.0));
+                }
+
                 // Merge resulting values
-                auto phi = builder.CreatePHI(mapTypes(ex->type()), 2, "ifTemp");
+                auto phi = builder.CreatePHI(resultType, 2, "ifTemp");
                 phi->addIncoming(thenResult, thenBlock);
                 phi->addIncoming(elseResult, elseBlock);
+
+                if (vectorResult) {
+                    declaredVectorsStack.back().push_back(phi);
+                }
+
                 return phi;
             }
             case ExpressionKind::binaryOp: {
@@ -147,12 +312,21 @@ private:
 
                 contextStack.emplace_back();
                 declaredArraysStack.emplace_back();
+                declaredVectorsStack.emplace_back();
 
                 // TODO: Think about Unit better.
                 llvm::Value *last = llvm::ConstantFP::get(con, llvm::APFloat(0.0));
+                vector<SpawnedLet> spawned;
 
-                for (auto &next : ex->body) {
-                    last = compile(next.get());
+                for (size_t i = 0; i < ex->body.size(); i++) {
+                    auto next = ex->body[i].get();
+                    joinLets(spawned, i);
+
+                    if (next->kind == ExpressionKind::assignment && ((Assignment *) next)->spawn) {
+                        spawned.push_back(spawnLet((Assignment *) next));
+                    } else {
+                        last = compile(next);
+                    }
                 }
 
                 contextStack.pop_back();
@@ -161,49 +335,119 @@ private:
 
                 auto destroyArray = lookupValue("destroyArray");
 
+                // Like vectors, an array produced by the last expression moves to the parent scope. A view holds on to
+                // the buffer of its list, so that list can still be destroyed here.
                 for (auto &next : lastDelaredScope) {
-                    builder.CreateCall(destroyArray, { next });
+                    if (next == last) {
+                        declaredArraysStack.back().push_back(next);
+                    } else {
+                        builder.CreateCall(destroyArray, { next });
+                    }
+                }
+
+                // A vector produced by the block's last expression outlives it, ownership moves to the parent scope.
+                auto lastDeclaredVectors = declaredVectorsStack.back();
+                declaredVectorsStack.pop_back();
+
+                auto vectorRelease = lookupValue("vectorRelease");
+
+                for (auto &next : lastDeclaredVectors) {
+                    if (next == last) {
+                        declaredVectorsStack.back().push_back(next);
+                    } else {
+                        builder.CreateCall(vectorRelease, { next });
+                    }
                 }
 
                 return last;
             }
             case ExpressionKind::variable: {
                 auto ex = (Variable *) expression;
-                auto var = lookupValue(ex->id);
+                auto var = lookupVariable(ex);
 
-                if (var == nullptr) {
-                    throw std::runtime_error("Variable " + ex->id + " is not declared at " + ex->loc().pretty());
+                // A function read as a value, rather than called, needs to become a closure.
+                if (llvm::isa<llvm::Function>(var)) {
+                    return plainClosure((llvm::Function *) var, ex);
                 }
 
                 return var;
             }
+            case ExpressionKind::fieldAccess: {
+                auto ex = (FieldAccess *) expression;
+                auto object = compile(ex->object.get());
+                auto &objectType = ex->object->type();
+
+                if (objectType.kind == TypeTokenKind::generic) {
+                    return projectField(object, objectType, ex->field, ex->type());
+                }
+
+                return builder.CreateExtractValue(object, fieldIndex(recordOf(objectType), ex->field), ex->field);
+            }
+            case ExpressionKind::indexAccess: {
+                auto ex = (IndexAccess *) expression;
+                auto list = compile(ex->list.get());
+                auto index = compile(ex->index.get());
+
+                if (ex->checked && options.checkBounds) {
+                    checkBounds(ex, list, index);
+                }
+
+                auto columns = listColumns(list, ex->list->type());
+                return loadElement(columns, ex->list->type(), index);
+            }
             case ExpressionKind::listLiteral: {
                 auto ex = (ListLiteral *) expression;
                 auto size = ex->values.size();
 
-                // TODO: List types besides Float
+                // No runtime insert takes a record or packed Floats, they are stored in place.
+                if (isRecordList(ex->type()) || listElementType(ex->type())->isArrayTy()) {
+                    auto array = arrayAlloca("tempArray");
+                    declaredArraysStack.back().push_back(array);
+
+                    createList(array, ex->type(), builder.getInt32(size), builder.getInt32(size));
+                    auto columns = listColumns(array, ex->type());
+
+                    for (unsigned int index = 0; index < size; index++) {
+                        storeElement(columns, ex->type(), builder.getInt64(index), compile(ex->values[index].get()));
+                    }
+
+                    return array;
+                }
+
+                auto elementType = listElementType(ex->type());
                 auto createArray = lookupValue("createArray");
                 auto intType = llvm::IntegerType::get(con, 32);
                 auto sizeConst = llvm::ConstantInt::get(intType,  size, false);
-                auto doubleConst = llvm::ConstantInt::get(intType,  sizeof(double), false);
+                auto itemSizeConst = llvm::ConstantInt::get(intType,  elementType->getPrimitiveSizeInBits() / 8, false);
 
-                auto array = builder.CreateAlloca(types["arrayRefType"], nullptr, "tempArray");
+                auto array = arrayAlloca("tempArray");
                 declaredArraysStack.back().push_back(array);
 
-                builder.CreateCall(createArray, { array, sizeConst, sizeConst, doubleConst });
+                builder.CreateCall(createArray, { array, sizeConst, sizeConst, itemSizeConst });
 
-                auto doubleInsert = lookupValue("mutableInsertArrayDouble");
+                auto insert = listInsertFunction(elementType);
 
                 unsigned int index = 0;
                 for (auto &nextEx : ex->values) {
                     auto nextValue = compile(nextEx.get());
-                    builder.CreateCall(doubleInsert, {array, llvm::ConstantInt::get(intType,  index++, false), nextValue} );
+
+                    // Booleans are stored a byte each.
+                    if (nextValue->getType() != elementType) {
+                        nextValue = builder.CreateZExt(nextValue, elementType, "byteTemp");
+                    }
+
+                    builder.CreateCall(insert, {array, llvm::ConstantInt::get(intType,  index++, false), nextValue} );
                 }
 
                 return array;
             }
             case ExpressionKind::numberLiteral: {
                 auto ex = (NumberLiteral *) expression;
+
+                if (isIntType(ex->type())) {
+                    return llvm::ConstantInt::get(llvm::Type::getInt64Ty(con), ex->intValue, true);
+                }
+
                 return llvm::ConstantFP::get(con, llvm::APFloat(ex->value));
             }
             case ExpressionKind::booleanLiteral: {
@@ -224,19 +468,36 @@ private:
     }
 
     llvm::Function* getOrCreateFunction(Function* ex) {
-        auto lookedUp = lookupValue(ex->id);
+        // Keyed by node rather than name, a nested function may share its name with anything outside it.
+        auto lookedUp = declaredFunctions[ex];
 
         if (lookedUp == nullptr) {
-            auto *functionType = mapTypes((BasicFunctionTypeToken &) ex->type());
+            auto &type = (BasicFunctionTypeToken &) ex->type();
+            auto *functionType = ex->captures.empty() ? mapTypes(type) : closureFunctionType(type);
+
+            auto linkage = options.wholeProgram && ex->id != "main"
+                           ? llvm::Function::InternalLinkage
+                           : llvm::Function::ExternalLinkage;
+
+            auto func = llvm::Function::Create(functionType, linkage, ex->id, &mod);
+            userFunctions.insert(func);
+
+            // Only main is called from outside, everything else can use the cheaper convention that also allows
+            // guaranteed tail calls.
+            if (ex->id != "main") {
+                func->setCallingConv(llvm::CallingConv::Fast);
+            }
 
-            return llvm::Function::Create(functionType, llvm::Function::ExternalLinkage, ex->id, &mod);
+            declaredFunctions[ex] = func;
+            return func;
         } else {
-            return (llvm::Function*) lookedUp;
+            return lookedUp;
         }
     }
 
     llvm::Function* compileFunction(Function* ex) {
-        auto *func = getOrCreateFunction(ex);
+        auto *entry = getOrCreateFunction(ex);
+        auto *func = ex->memo ? compileMemoWrapper(ex, entry) : entry;
 
         auto *body = llvm::BasicBlock::Create(con, "body", func);
         auto initStartPoint = builder.GetInsertBlock();
@@ -244,25 +505,103 @@ private:
 
         auto rawBody = &ex->body;
 
+        auto outerArraysBase = functionArraysBase;
+        auto outerVectorsBase = functionVectorsBase;
+        auto outerTailRecursionHeader = tailRecursionHeader;
+        auto outerTailRecursionParams = move(tailRecursionParams);
+
+        functionArraysBase = declaredArraysStack.size();
+        functionVectorsBase = declaredVectorsStack.size();
+        tailRecursionHeader = nullptr;
+        tailRecursionParams.clear();
+
+        if (ex->tailRecursive) {
+            tailRecursionHeader = llvm::BasicBlock::Create(con, "tailRecurse", func);
+            builder.CreateBr(tailRecursionHeader);
+            builder.SetInsertPoint(tailRecursionHeader);
+        }
 
         map<string, llvm::Value*> context;
+        vector<llvm::AllocaInst*> ownedArrays;
+        vector<llvm::Value*> ownedParams;
 
         {
             // Block to keep i out of scope.
             int i = 0;
+            auto &paramTypes = ((BasicFunctionTypeToken &) ex->type()).params;
+
             for (auto &arg : func->args()) {
+                if (!ex->captures.empty() && arg.getArgNo() == 0) {
+                    arg.setName("env");
+                    continue;
+                }
+
                 auto name = ex->params[i++];
                 arg.setName(name);
-                context[name] = &arg;
+
+                if (tailRecursionHeader != nullptr && isListType(*paramTypes[i - 1])) {
+                    // The ArrayRef of a list argument lives in the caller's frame, or in a scope the previous
+                    // iteration ended. So the loop keeps its own copy, holding a reference to the buffer.
+                    auto array = arrayAlloca(name + "Loop");
+                    builder.SetInsertPoint(body->getTerminator());
+                    builder.CreateCall(lookupValue("retainArray"), { &arg });
+                    builder.CreateStore(builder.CreateLoad(types["arrayRefType"], &arg), array);
+                    builder.SetInsertPoint(tailRecursionHeader);
+
+                    tailRecursionParams.push_back(array);
+                    ownedArrays.push_back(array);
+                    context[name] = array;
+                } else if (tailRecursionHeader != nullptr) {
+                    auto param = builder.CreatePHI(arg.getType(), 2, name + "Loop");
+                    param->addIncoming(&arg, body);
+                    tailRecursionParams.push_back(param);
+                    context[name] = param;
+
+                    // Later iterations own their Vector arguments, so the first one takes a reference as well.
+                    if (isVectorType(*paramTypes[i - 1])) {
+                        builder.SetInsertPoint(body->getTerminator());
+                        builder.CreateCall(lookupValue("vectorRetain"), { &arg });
+                        builder.SetInsertPoint(tailRecursionHeader);
+                        ownedParams.push_back(param);
+                    }
+                } else {
+                    context[name] = &arg;
+                }
             }
         }
 
+        if (!ex->captures.empty()) {
+            loadEnvironment(ex, func, context);
+        }
+
         contextStack.push_back(move(context));
+        declaredArraysStack.emplace_back(ownedArrays);
+        declaredVectorsStack.emplace_back(ownedParams);
         llvm::Value *result = compile(rawBody->get());
+        auto &resultType = *((BasicFunctionTypeToken &) ex->type()).result;
+        releaseVectors(result, isVectorType(resultType));
+
+        // A list is returned by value, since its ArrayRef is in this frame. One this scope owns moves to the caller,
+        // anything else, such as a parameter, is shared with it.
+        if (isListType(resultType)) {
+            auto &owned = declaredArraysStack.back();
+
+            if (find(owned.begin(), owned.end(), result) == owned.end()) {
+                builder.CreateCall(lookupValue("retainArray"), { result });
+            }
+        }
+
+        releaseArrays(result);
 
+        functionArraysBase = outerArraysBase;
+        functionVectorsBase = outerVectorsBase;
+        tailRecursionHeader = outerTailRecursionHeader;
+        tailRecursionParams = move(outerTailRecursionParams);
 
         if (func->getReturnType()->isVoidTy()) {
             builder.CreateRetVoid();
+        } else if (isListType(resultType)) {
+            builder.CreateRet(builder.CreateLoad(types["arrayRefType"], result, "returned"));
         } else {
             builder.CreateRet(result);
         }
@@ -271,140 +610,1984 @@ private:
 
         builder.SetInsertPoint(initStartPoint);
 
-        return func;
+        return entry;
     }
 
-    llvm::Value* compileBinaryOp(BinaryOp *ex) {
-        auto left = compile(ex->left.get());
-        auto right = compile(ex->right.get());
+    /**
+     * Compiles the body of a let marked by markParallelLets into a function of its own and starts it on the pool. The
+     * names it reads are copied into a struct on this function's stack, which also holds the slot for its value.
+     */
+    SpawnedLet spawnLet(Assignment* ex) {
+        auto rawType = llvm::PointerType::getInt8PtrTy(con);
+        vector<string> names;
+        vector<llvm::Type*> fieldTypes;
+        vector<llvm::Value*> values;
+
+        // Functions are constants that the task can still find by name.
+        for (auto &name : ex->captures) {
+            auto value = lookupValue(name);
+
+            if (value != nullptr && !llvm::isa<llvm::Function>(value)) {
+                names.push_back(name);
+                fieldTypes.push_back(value->getType());
+                values.push_back(value);
+            }
+        }
 
-        auto op = ex->op;
+        fieldTypes.push_back(mapTypes(ex->body->type()));
+        auto contextType = llvm::StructType::get(con, fieldTypes);
+        auto letContext = entryAlloca(contextType, ex->id + "Context");
 
-        // TODO: Handle types besides Float
-        if (op == "+") {
-            return builder.CreateFAdd(left, right, "addTemp");
-        } else if (op == "-") {
-            return builder.CreateFSub(left, right, "subTemp");
-        } else if (op == "*") {
-            return builder.CreateFMul(left, right, "mulTemp");
-        } else if (op == "/") {
-            return builder.CreateFDiv(left, right, "divTemp");
-        } else if (op == "==") {
-            return builder.CreateFCmpOEQ(left, right, "equalTemp");
-        } else if (op == "!=") {
-            return builder.CreateFCmpONE(left, right, "notEqualTemp");
-        } else if (op == ">=") {
-            return builder.CreateFCmpOGE(left, right, "greaterOrEqualTemp");
-        } else if (op == ">") {
-            return builder.CreateFCmpOGT(left, right, "greaterTemp");
-        } else if (op == "<") {
-            return builder.CreateFCmpOLT(left, right, "lessTemp");
-        } else if (op == "<=") {
-            return builder.CreateFCmpOLE(left, right, "lessOrEqualTemp");
-        } else if (op == "&&") {
-            return builder.CreateAnd(left, right, "andTemp");
-        } else if (op == "||") {
-            return builder.CreateOr(left, right, "orTemp");
-        } else {
-            throw std::runtime_error("Unknown binary operator: " + op + " at " + ex->loc().pretty());
+        for (unsigned int i = 0; i < values.size(); i++) {
+            builder.CreateStore(values[i], builder.CreateStructGEP(contextType, letContext, i));
         }
-    }
 
-    llvm::Value* lookupValue(const string &id) {
+        auto initStartPoint = builder.GetInsertBlock();
 
-        for (auto i = contextStack.size(); i > 0; --i) {
-            auto &context = contextStack[i - 1];
+        auto longType = builder.getInt64Ty();
+        auto taskType = llvm::FunctionType::get(builder.getVoidTy(), { rawType, longType, longType }, false);
+        auto task = llvm::Function::Create(taskType, llvm::Function::InternalLinkage, ex->id + ".task", &mod);
+        builder.SetInsertPoint(llvm::BasicBlock::Create(con, "body", task));
 
-            if (context.find(id) != context.end()) {
-                return context[id];
-            }
+        auto typedContext = builder.CreateBitCast(&*task->arg_begin(), llvm::PointerType::get(contextType, 0));
+        map<string, llvm::Value*> context;
+
+        for (unsigned int i = 0; i < names.size(); i++) {
+            context[names[i]] = builder.CreateLoad(fieldTypes[i], builder.CreateStructGEP(contextType, typedContext, i), names[i]);
         }
 
-        return nullptr;
+        auto outerArraysBase = functionArraysBase;
+        auto outerVectorsBase = functionVectorsBase;
+        auto outerTailRecursionHeader = tailRecursionHeader;
+        auto outerTailRecursionParams = move(tailRecursionParams);
+
+        functionArraysBase = declaredArraysStack.size();
+        functionVectorsBase = declaredVectorsStack.size();
+        tailRecursionHeader = nullptr;
+        tailRecursionParams.clear();
+
+        contextStack.push_back(move(context));
+        declaredArraysStack.emplace_back();
+        declaredVectorsStack.emplace_back();
+
+        auto result = compile(ex->body.get());
+        builder.CreateStore(result, builder.CreateStructGEP(contextType, typedContext, names.size()));
+        releaseVectors(result, false);
+        releaseArrays(result);
+        builder.CreateRetVoid();
+
+        contextStack.pop_back();
+        functionArraysBase = outerArraysBase;
+        functionVectorsBase = outerVectorsBase;
+        tailRecursionHeader = outerTailRecursionHeader;
+        tailRecursionParams = move(outerTailRecursionParams);
+
+        builder.SetInsertPoint(initStartPoint);
+
+        auto handle = builder.CreateCall(lookupValue("spawnTask"), { task, builder.CreateBitCast(letContext, rawType) }, ex->id + "Task");
+        return { ex, handle, builder.CreateStructGEP(contextType, letContext, names.size()) };
     }
 
-    llvm::Type* mapTypes(TypeToken& raw) {
-        switch (raw.kind) {
-            case TypeTokenKind::base: {
-                return mapTypes((BaseTypeToken&) raw);
-            }
-            case TypeTokenKind::basicFunction: {
-                return mapTypes((BasicFunctionTypeToken&) raw);
+    /**
+     * Waits for the spawned lets that the statement at index reads first, and binds their values.
+     */
+    void joinLets(vector<SpawnedLet> &spawned, size_t index) {
+        for (auto &next : spawned) {
+            if (next.let->joinBefore == index) {
+                builder.CreateCall(lookupValue("joinTask"), { next.task });
+                auto valueType = llvm::cast<llvm::PointerType>(next.result->getType())->getElementType();
+                contextStack.back()[next.let->id] = builder.CreateLoad(valueType, next.result, next.let->id);
             }
-            default:
-                throw runtime_error("Unknown type token kind");
         }
     }
 
-    llvm::Type* mapTypes(BaseTypeToken& raw) {
-        switch (raw.base) {
-            case BasicTypeTokenKind::Float:
-                return llvm::Type::getDoubleTy(con);
-            case BasicTypeTokenKind::Unit:
-                return llvm::Type::getVoidTy(con);
-            default:
-                throw runtime_error("Unknown base type token kind");
+    /**
+     * Fills the named function with a lookup in its memo table and returns a new function for the real body, which
+     * only runs on a miss. Recursive calls go through the named function so they hit the table too.
+     */
+    llvm::Function* compileMemoWrapper(Function* ex, llvm::Function* wrapper) {
+        auto impl = llvm::Function::Create(wrapper->getFunctionType(), llvm::Function::InternalLinkage, ex->id + ".impl", &mod);
+        impl->setCallingConv(llvm::CallingConv::Fast);
+
+        auto tableType = (llvm::PointerType *) types["memoTablePointerType"];
+        auto table = new llvm::GlobalVariable(mod, tableType, false, llvm::GlobalValue::InternalLinkage,
+                                              llvm::ConstantPointerNull::get(tableType), ex->id + ".memo");
+
+        auto initStartPoint = builder.GetInsertBlock();
+        auto body = llvm::BasicBlock::Create(con, "body", wrapper);
+        auto hit = llvm::BasicBlock::Create(con, "memoHit", wrapper);
+        auto miss = llvm::BasicBlock::Create(con, "memoMiss", wrapper);
+        builder.SetInsertPoint(body);
+
+        auto wordType = builder.getInt64Ty();
+        auto keySize = (unsigned int) wrapper->arg_size();
+        auto key = builder.CreateAlloca(wordType, builder.getInt32(max(keySize, 1u)), "memoKey");
+        auto found = builder.CreateAlloca(wordType, nullptr, "memoFound");
+        vector<llvm::Value *> args;
+
+        for (auto &arg : wrapper->args()) {
+            arg.setName(ex->params[args.size()]);
+            builder.CreateStore(toMemoWord(&arg), builder.CreateConstGEP1_32(wordType, key, (unsigned int) args.size()));
+            args.push_back(&arg);
         }
+
+        auto keySizeValue = builder.getInt32(keySize);
+        auto isHit = builder.CreateCall(lookupValue("memoLookup"), { table, keySizeValue, key, found });
+        builder.CreateCondBr(builder.CreateICmpNE(isHit, builder.getInt32(0)), hit, miss);
+
+        builder.SetInsertPoint(hit);
+        builder.CreateRet(fromMemoWord(builder.CreateLoad(wordType, found), wrapper->getReturnType()));
+
+        builder.SetInsertPoint(miss);
+        auto result = builder.CreateCall(impl, args);
+        result->setCallingConv(impl->getCallingConv());
+        builder.CreateCall(lookupValue("memoStore"), { table, keySizeValue, key, toMemoWord(result) });
+        builder.CreateRet(result);
+
+        builder.SetInsertPoint(initStartPoint);
+
+        return impl;
     }
 
-    llvm::FunctionType* mapTypes(BasicFunctionTypeToken& token) {
-        vector<llvm::Type*> paramTypes;
-        paramTypes.reserve(token.params.size());
+    llvm::Value* toMemoWord(llvm::Value* value) {
+        auto type = value->getType();
 
-        for (auto &param : token.params) {
-            paramTypes.push_back(mapTypes(*param));
+        if (type->isDoubleTy()) {
+            return builder.CreateBitCast(value, builder.getInt64Ty());
+        } else if (type->isIntegerTy(1)) {
+            return builder.CreateZExt(value, builder.getInt64Ty());
+        } else {
+            return value;
         }
+    }
 
-        return llvm::FunctionType::get(mapTypes(*token.result), paramTypes, false);
+    llvm::Value* fromMemoWord(llvm::Value* word, llvm::Type* type) {
+        if (type->isDoubleTy()) {
+            return builder.CreateBitCast(word, type);
+        } else if (type->isIntegerTy(1)) {
+            return builder.CreateTrunc(word, type);
+        } else {
+            return word;
+        }
     }
 
-    void setupLibrary() {
-        map<string, llvm::Value*> context;
+    /**
+     * A call in tail position returns its result straight away. A self call becomes a jump back to the top of the
+     * function, any other call is marked musttail when the signatures allow it and tail otherwise.
+     */
+    llvm::Value* compileTailCall(Call *ex, llvm::Function *func, vector<llvm::Value *> &args) {
+        auto caller = builder.GetInsertBlock()->getParent();
+
+        if (func == caller && tailRecursionHeader != nullptr) {
+            auto &paramTypes = ((BasicFunctionTypeToken &) ex->source->type()).params;
+            set<llvm::Value*> moved;
+            vector<llvm::Value*> arrays(args.size(), nullptr);
+
+            // The next iteration owns its list and Vector arguments. One this iteration owns is handed over, anything
+            // else is retained. Lists are read before anything is released, since an argument may be a view of a
+            // list that is. Everything left is released before jumping back.
+            for (unsigned int i = 0; i < args.size(); i++) {
+                bool owned = (ownsArray(args[i]) || ownsVector(args[i])) && moved.insert(args[i]).second;
+
+                if (isListType(*paramTypes[i])) {
+                    if (!owned) {
+                        builder.CreateCall(lookupValue("retainArray"), { args[i] });
+                    }
+
+                    arrays[i] = builder.CreateLoad(types["arrayRefType"], args[i]);
+                } else if (isVectorType(*paramTypes[i]) && !owned) {
+                    builder.CreateCall(lookupValue("vectorRetain"), { args[i] });
+                }
+            }
 
-        auto voidType = llvm::Type::getVoidTy(con);
-        auto intType = llvm::IntegerType::get(con, 32);
+            releaseFunctionScopes(moved);
 
-        llvm::ArrayRef<llvm::Type *> arrayRefMembers = {llvm::PointerType::getInt8PtrTy(con), intType, intType, intType};
-        auto arrayRefType = llvm::StructType::create(con, arrayRefMembers, "ArrayRef");
-        auto arrayRefPointerType = llvm::PointerType::get(arrayRefType, 0);
-        types["arrayRefType"] = arrayRefType;
-        types["arrayRefPointerType"] = arrayRefPointerType;
+            for (unsigned int i = 0; i < args.size(); i++) {
+                if (arrays[i] != nullptr) {
+                    builder.CreateStore(arrays[i], tailRecursionParams[i]);
+                } else {
+                    ((llvm::PHINode *) tailRecursionParams[i])->addIncoming(args[i], builder.GetInsertBlock());
+                }
+            }
 
-        llvm::ArrayRef<llvm::Type *> args = {llvm::Type::getDoubleTy(con)};
-        auto printdType = llvm::FunctionType::get(voidType, args, false);
-        mod.getOrInsertFunction("printd", printdType);
-        context["printd"] = mod.getFunction("printd");
+            builder.CreateBr(tailRecursionHeader);
+        } else {
+            auto call = builder.CreateCall(func, args);
+            call->setCallingConv(func->getCallingConv());
 
-        llvm::ArrayRef<llvm::Type *> printdsArgs = { arrayRefPointerType };
-        auto printdsType = llvm::FunctionType::get(voidType, printdsArgs, false);
-        mod.getOrInsertFunction("printds", printdsType);
-        context["printds"] = mod.getFunction("printds");
+            bool sameSignature = func->getFunctionType() == caller->getFunctionType() && func->getCallingConv() == caller->getCallingConv();
+            call->setTailCallKind(sameSignature ? llvm::CallInst::TCK_MustTail : llvm::CallInst::TCK_Tail);
 
+            if (caller->getReturnType()->isVoidTy()) {
+                builder.CreateRetVoid();
+            } else {
+                builder.CreateRet(call);
+            }
+        }
 
-        llvm::ArrayRef<llvm::Type*> createArrayArgs = { arrayRefPointerType, intType, intType, intType};
-        auto createArrayType = llvm::FunctionType::get(voidType, createArrayArgs, false);
-        mod.getOrInsertFunction("createArray", createArrayType);
-        context["createArray"] = mod.getFunction("createArray");
+        // Whatever the surrounding expression still emits is unreachable.
+        builder.SetInsertPoint(llvm::BasicBlock::Create(con, "afterTailCall", caller));
 
-        llvm::ArrayRef<llvm::Type*> destroyArrayArgs = { arrayRefPointerType };
-        auto destroyArrayType = llvm::FunctionType::get(voidType, destroyArrayArgs, false);
-        mod.getOrInsertFunction("destroyArray", destroyArrayType);
-        context["destroyArray"] = mod.getFunction("destroyArray");
+        auto resultType = mapTypes(ex->type());
 
-        llvm::ArrayRef<llvm::Type*> mutableInsertArrayDoubleArgs = { arrayRefPointerType, intType, llvm::Type::getDoubleTy(con) };
-        auto mutableInsertArrayDoubleType = llvm::FunctionType::get(voidType, mutableInsertArrayDoubleArgs, false);
-        mod.getOrInsertFunction("mutableInsertArrayDouble", mutableInsertArrayDoubleType);
-        context["mutableInsertArrayDouble"] = mod.getFunction("mutableInsertArrayDouble");
+        if (resultType->isVoidTy()) {
+            return llvm::ConstantFP::get(con, llvm::APFloat(0.0));
+        }
 
-        contextStack.clear();
-        contextStack.push_back(move(context));
+        return llvm::UndefValue::get(resultType);
     }
 
-};
+    /**
+     * A call to one of the list pipeline builtins, unless a user definition shadows it.
+     */
+    bool isPipelineCall(Expression* expression, const set<string> &names) {
+        if (expression->kind != ExpressionKind::call) {
+            return false;
+        }
+
+        auto &source = *((Call *) expression)->source;
+
+        return source.kind == ExpressionKind::variable && names.count(((Variable &) source).id) == 1
+               && lookupValue(((Variable &) source).id) == nullptr;
+    }
+
+    /**
+     * The last stage of a pipeline: a fold, a sum of a map, filter or range, or one of those whose result is kept as
+     * a list.
+     */
+    bool isPipelineEnd(Call* ex) {
+        if (isPipelineCall(ex, { "range", "map", "filter", "fold" })) {
+            return true;
+        }
+
+        auto &source = *ex->source;
+
+        return source.kind == ExpressionKind::variable && ((Variable &) source).id == "sum"
+               && lookupValue("sum") == contextStack.front()["sum"] && isPipelineCall(ex->args[0].get(), { "range", "map", "filter" });
+    }
+
+    /**
+     * Compiles a chain like fold(map(filter(xs, p), f), 0, g) into one loop over xs that applies each stage to an
+     * element in turn, so no list is built between stages. Only a pipeline whose result is a list writes one.
+     */
+    llvm::Value* compilePipeline(Call* end) {
+        auto &endName = ((Variable &) *end->source).id;
+        bool reduces = endName == "fold" || endName == "sum";
+
+        vector<Call*> stages;
+        auto source = reduces ? end->args[0].get() : (Expression *) end;
+
+        while (isPipelineCall(source, { "map", "filter" })) {
+            stages.insert(stages.begin(), (Call *) source);
+            source = ((Call *) source)->args[0].get();
+        }
+
+        auto longType = builder.getInt64Ty();
+        auto intType = builder.getInt32Ty();
+        bool isRange = isPipelineCall(source, { "range" });
+
+        // Everything outside the loop is evaluated first, in the order it is written.
+        llvm::Value *start;
+        llvm::Value *stop;
+        vector<llvm::Value*> sourceColumns;
+
+        if (isRange) {
+            start = compile(((Call *) source)->args[0].get());
+            stop = compile(((Call *) source)->args[1].get());
+        } else {
+            auto sourceArray = compile(source);
+            start = builder.getInt64(0);
+            stop = builder.CreateZExt(loadArraySize(sourceArray), longType, "size");
+            sourceColumns = listColumns(sourceArray, source->type());
+        }
+
+        vector<llvm::Value*> stageFunctions;
+
+        for (auto stage : stages) {
+            stageFunctions.push_back(compileFunctionValue(stage->args[1].get()));
+        }
+
+        llvm::AllocaInst *accumulator = nullptr;
+        llvm::Value *foldFunction = nullptr;
+        llvm::AllocaInst *resultArray = nullptr;
+        vector<llvm::Value*> resultColumns;
+
+        if (reduces) {
+            accumulator = entryAlloca(mapTypes(end->type()), "accumulator");
+
+            if (endName == "fold") {
+                builder.CreateStore(compile(end->args[1].get()), accumulator);
+                foldFunction = compileFunctionValue(end->args[2].get());
+            } else {
+                builder.CreateStore(llvm::ConstantFP::get(con, llvm::APFloat(0.0)), accumulator);
+            }
+        } else {
+            // Sized for every element, a filter may leave some unused.
+            auto span = builder.CreateSub(stop, start);
+            auto capacity = builder.CreateSelect(builder.CreateICmpSGT(span, builder.getInt64(0)), span, builder.getInt64(0));
+
+            resultArray = arrayAlloca("resultArray");
+            declaredArraysStack.back().push_back(resultArray);
+
+            createList(resultArray, end->type(), builder.getInt32(0), builder.CreateTrunc(capacity, intType));
+            resultColumns = listColumns(resultArray, end->type());
+            accumulator = entryAlloca(longType, "resultSize");
+            builder.CreateStore(builder.getInt64(0), accumulator);
+        }
+
+        countedLoop(start, stop, "pipeline", [&](llvm::Value* index, llvm::BasicBlock* next) {
+            llvm::Value *element = index;
+
+            if (!isRange) {
+                element = loadElement(sourceColumns, source->type(), index);
+            }
+
+            for (unsigned int i = 0; i < stages.size(); i++) {
+                auto &stageType = (BasicFunctionTypeToken &) stages[i]->args[1]->type();
+                vector<llvm::Value*> args{element};
+                auto result = applyFunction(stageFunctions[i], stageType, args);
+
+                if (((Variable &) *stages[i]->source).id == "map") {
+                    element = result;
+                } else {
+                    auto kept = llvm::BasicBlock::Create(con, "pipelineKept", builder.GetInsertBlock()->getParent());
+                    builder.CreateCondBr(result, kept, next);
+                    builder.SetInsertPoint(kept);
+                }
+            }
+
+            if (endName == "fold") {
+                vector<llvm::Value*> args{builder.CreateLoad(accumulator->getAllocatedType(), accumulator), element};
+                builder.CreateStore(applyFunction(foldFunction, (BasicFunctionTypeToken &) end->args[2]->type(), args), accumulator);
+            } else if (endName == "sum") {
+                builder.CreateStore(builder.CreateFAdd(builder.CreateLoad(accumulator->getAllocatedType(), accumulator), element), accumulator);
+            } else {
+                auto size = builder.CreateLoad(longType, accumulator);
+                storeElement(resultColumns, end->type(), size, element);
+                builder.CreateStore(builder.CreateAdd(size, builder.getInt64(1)), accumulator);
+            }
+        });
+
+        if (reduces) {
+            return builder.CreateLoad(accumulator->getAllocatedType(), accumulator, "folded");
+        }
+
+        auto size = builder.CreateTrunc(builder.CreateLoad(longType, accumulator), intType);
+        builder.CreateStore(size, builder.CreateStructGEP(types["arrayRefType"], resultArray, 1));
+
+        // A filter may have kept far fewer elements than it had room for. Columns lists space their columns by the
+        // capacity so keep it.
+        bool filters = any_of(stages.begin(), stages.end(), [](Call* stage) { return ((Variable &) *stage->source).id == "filter"; });
+
+        if (filters && !isColumnsList(end->type())) {
+            builder.CreateCall(lookupValue("shrinkArray"), { resultArray });
+        }
+
+        return resultArray;
+    }
+
+    /**
+     * Emits a loop over the indexes from start up to but not including stop. The body may branch to next to skip the
+     * rest of an iteration, otherwise it falls through to it.
+     */
+    void countedLoop(llvm::Value* start, llvm::Value* stop, const string &name, const std::function<void(llvm::Value*, llvm::BasicBlock*)> &body) {
+        auto currentFunction = builder.GetInsertBlock()->getParent();
+        auto preheader = builder.GetInsertBlock();
+        auto header = llvm::BasicBlock::Create(con, name + "Header", currentFunction);
+        auto bodyBlock = llvm::BasicBlock::Create(con, name + "Body", currentFunction);
+        auto latch = llvm::BasicBlock::Create(con, name + "Next", currentFunction);
+        auto exit = llvm::BasicBlock::Create(con, name + "Done", currentFunction);
+
+        builder.CreateBr(header);
+        builder.SetInsertPoint(header);
+        auto index = builder.CreatePHI(start->getType(), 2, "index");
+        index->addIncoming(start, preheader);
+        builder.CreateCondBr(builder.CreateICmpSLT(index, stop), bodyBlock, exit);
+
+        builder.SetInsertPoint(bodyBlock);
+        body(index, latch);
+        builder.CreateBr(latch);
+
+        builder.SetInsertPoint(latch);
+        auto next = builder.CreateAdd(index, llvm::ConstantInt::get(start->getType(), 1), "nextIndex");
+        index->addIncoming(next, latch);
+        builder.CreateBr(header);
+
+        builder.SetInsertPoint(exit);
+    }
+
+    /**
+     * parMap, parReduce and parFor. Each runs its loop on the runtime's pool, which calls an outlined copy of the
+     * loop body with ranges of indexes.
+     */
+    llvm::Value* compileParallel(Call* ex) {
+        auto &name = ((Variable &) *ex->source).id;
+        auto longType = builder.getInt64Ty();
+
+        if (name == "parFor") {
+            auto start = compile(ex->args[0].get());
+            auto stop = compile(ex->args[1].get());
+            auto func = compileFunctionValue(ex->args[2].get());
+            auto &funcType = (BasicFunctionTypeToken &) ex->args[2]->type();
+            vector<llvm::Value*> captured;
+
+            if (!llvm::isa<llvm::Function>(func)) {
+                captured.push_back(func);
+            }
+
+            parallelRange("parFor", start, stop, builder.getInt64(1), captured, [&](vector<llvm::Value*> &values, llvm::Value* from, llvm::Value* to) {
+                auto body = captured.empty() ? func : values[0];
+
+                countedLoop(from, to, "parFor", [&](llvm::Value* index, llvm::BasicBlock* next) {
+                    vector<llvm::Value*> args{index};
+                    applyFunction(body, funcType, args);
+                });
+            });
+
+            return llvm::ConstantFP::get(con, llvm::APFloat(0.0));
+        }
+
+        auto &sourceType = ex->args[0]->type();
+        auto sourceArray = compile(ex->args[0].get());
+        auto size = builder.CreateZExt(loadArraySize(sourceArray), longType, "size");
+        auto sourceColumns = listColumns(sourceArray, sourceType);
+        auto sourceCount = sourceColumns.size();
+
+        if (name == "parMap") {
+            auto func = compileFunctionValue(ex->args[1].get());
+            auto &funcType = (BasicFunctionTypeToken &) ex->args[1]->type();
+
+            auto resultArray = arrayAlloca("resultArray");
+            declaredArraysStack.back().push_back(resultArray);
+
+            auto resultSize = builder.CreateTrunc(size, builder.getInt32Ty());
+            createList(resultArray, ex->type(), resultSize, resultSize);
+            auto resultColumns = listColumns(resultArray, ex->type());
+
+            // The columns of both lists, then the function if it is a closure.
+            vector<llvm::Value*> captured(sourceColumns);
+            captured.insert(captured.end(), resultColumns.begin(), resultColumns.end());
+            auto columnCount = captured.size();
+
+            if (!llvm::isa<llvm::Function>(func)) {
+                captured.push_back(func);
+            }
+
+            parallelRange("parMap", builder.getInt64(0), size, builder.getInt64(parallelGrain), captured, [&](vector<llvm::Value*> &values, llvm::Value* from, llvm::Value* to) {
+                auto mapper = captured.size() == columnCount ? func : values[columnCount];
+                vector<llvm::Value*> source(values.begin(), values.begin() + sourceCount);
+                vector<llvm::Value*> result(values.begin() + sourceCount, values.begin() + columnCount);
+
+                countedLoop(from, to, "parMap", [&](llvm::Value* index, llvm::BasicBlock* next) {
+                    vector<llvm::Value*> args{loadElement(source, sourceType, index)};
+                    storeElement(result, ex->type(), index, applyFunction(mapper, funcType, args));
+                });
+            });
+
+            return resultArray;
+        }
+
+        // A parReduce folds fixed size chunks from the initial value, then combines their results in order. The
+        // grouping is the same however many workers there are, so the result is too.
+        auto init = compile(ex->args[1].get());
+        auto func = compileFunctionValue(ex->args[2].get());
+        auto &funcType = (BasicFunctionTypeToken &) ex->args[2]->type();
+
+        auto grain = builder.getInt64(parallelGrain);
+        auto chunks = builder.CreateUDiv(builder.CreateAdd(size, builder.getInt64(parallelGrain - 1)), grain, "chunks");
+
+        // Partial results, with room for the initial value when the list is empty. They are kept a whole element
+        // after another whatever the layout of the source.
+        auto partials = arrayAlloca("partials");
+        declaredArraysStack.back().push_back(partials);
+
+        auto partialType = storageType(*((GenericTypeToken &) sourceType).typeParams[0]);
+        auto capacity = builder.CreateTrunc(builder.CreateSelect(builder.CreateICmpUGT(chunks, builder.getInt64(0)), chunks, builder.getInt64(1)), builder.getInt32Ty());
+        builder.CreateCall(lookupValue("createArray"), { partials, capacity, capacity, storageSize(partialType) });
+
+        auto partialData = loadArrayData(partials, partialType);
+        builder.CreateStore(toListElement(init, partialType), partialData);
+
+        // The source columns, then the partials, the initial value, the size and the function if it is a closure.
+        vector<llvm::Value*> captured(sourceColumns);
+        captured.insert(captured.end(), { partialData, init, size });
+        auto valueCount = captured.size();
+
+        if (!llvm::isa<llvm::Function>(func)) {
+            captured.push_back(func);
+        }
+
+        parallelRange("parReduce", builder.getInt64(0), chunks, builder.getInt64(1), captured, [&](vector<llvm::Value*> &values, llvm::Value* from, llvm::Value* to) {
+            auto reducer = captured.size() == valueCount ? func : values[valueCount];
+            vector<llvm::Value*> source(values.begin(), values.begin() + sourceCount);
+            auto partialValues = values[sourceCount];
+            auto initValue = values[sourceCount + 1];
+            auto sizeValue = values[sourceCount + 2];
+            auto accumulator = entryAlloca(init->getType(), "accumulator");
+
+            countedLoop(from, to, "parReduceChunk", [&](llvm::Value* chunk, llvm::BasicBlock* next) {
+                auto chunkStart = builder.CreateMul(chunk, grain, "chunkStart");
+                auto chunkEnd = builder.CreateAdd(chunkStart, grain);
+                chunkEnd = builder.CreateSelect(builder.CreateICmpULT(chunkEnd, sizeValue), chunkEnd, sizeValue, "chunkEnd");
+                builder.CreateStore(initValue, accumulator);
+
+                countedLoop(chunkStart, chunkEnd, "parReduce", [&](llvm::Value* index, llvm::BasicBlock* next) {
+                    vector<llvm::Value*> args{builder.CreateLoad(init->getType(), accumulator), loadElement(source, sourceType, index)};
+                    builder.CreateStore(applyFunction(reducer, funcType, args), accumulator);
+                });
+
+                auto partial = toListElement(builder.CreateLoad(init->getType(), accumulator), partialType);
+                builder.CreateStore(partial, builder.CreateGEP(partialType, partialValues, chunk));
+            });
+        });
+
+        auto accumulator = entryAlloca(init->getType(), "reduced");
+        builder.CreateStore(fromListElement(builder.CreateLoad(partialType, partialData), sourceType), accumulator);
+
+        countedLoop(builder.getInt64(1), chunks, "parReduceCombine", [&](llvm::Value* chunk, llvm::BasicBlock* next) {
+            auto partial = builder.CreateLoad(partialType, builder.CreateGEP(partialType, partialData, chunk), "partial");
+            vector<llvm::Value*> args{builder.CreateLoad(init->getType(), accumulator), fromListElement(partial, sourceType)};
+            builder.CreateStore(applyFunction(func, funcType, args), accumulator);
+        });
+
+        return builder.CreateLoad(init->getType(), accumulator, "reduced");
+    }
+
+    llvm::Value* compilePackedCall(Call* ex) {
+        auto &name = ((Variable &) *ex->source).id;
+        vector<llvm::Value*> args;
+
+        for (auto &arg : ex->args) {
+            args.push_back(compile(arg.get()));
+        }
+
+        if (name == "float2" || name == "float4" || name == "float8") {
+            auto packedType = mapTypes(ex->type());
+            auto lanes = packedType->getVectorNumElements();
+
+            if (args.size() == 1) {
+                return builder.CreateVectorSplat(lanes, args[0], "splatTemp");
+            }
+
+            llvm::Value *packed = llvm::UndefValue::get(packedType);
+
+            for (unsigned int i = 0; i < lanes; i++) {
+                packed = builder.CreateInsertElement(packed, args[i], builder.getInt64(i), "packTemp");
+            }
+
+            return packed;
+        }
+
+        auto lanes = args[0]->getType()->getVectorNumElements();
+        // Lane numbers wrap around, the number of lanes is always a power of two.
+        auto laneIndex = [&](llvm::Value* index) { return builder.CreateAnd(index, builder.getInt64(lanes - 1), "laneIndex"); };
+
+        if (name == "lane") {
+            return builder.CreateExtractElement(args[0], laneIndex(args[1]), "laneTemp");
+        } else if (name == "withLane") {
+            return builder.CreateInsertElement(args[0], args[2], laneIndex(args[1]), "withLaneTemp");
+        } else if (name == "shuffle") {
+            vector<llvm::Constant*> mask;
+
+            for (unsigned int i = 2; i < args.size(); i++) {
+                auto index = llvm::dyn_cast<llvm::ConstantInt>(args[i]);
+
+                if (index == nullptr || index->getZExtValue() >= 2 * lanes) {
+                    throw runtime_error("Lanes passed to shuffle must be Int literals below " + to_string(2 * lanes) + " at " + ex->args[i]->loc().pretty());
+                }
+
+                mask.push_back(builder.getInt32((uint32_t) index->getZExtValue()));
+            }
+
+            return builder.CreateShuffleVector(args[0], args[1], llvm::ConstantVector::get(mask), "shuffleTemp");
+        }
+
+        // The reductions fold the upper half of the lanes onto the lower half until one is left.
+        auto packed = args[0];
+
+        for (auto width = lanes / 2; width > 0; width /= 2) {
+            vector<llvm::Constant*> lower;
+            vector<llvm::Constant*> upper;
+
+            for (unsigned int i = 0; i < width; i++) {
+                lower.push_back(builder.getInt32(i));
+                upper.push_back(builder.getInt32(i + width));
+            }
+
+            auto undef = llvm::UndefValue::get(packed->getType());
+            auto low = builder.CreateShuffleVector(packed, undef, llvm::ConstantVector::get(lower), "lowTemp");
+            auto high = builder.CreateShuffleVector(packed, undef, llvm::ConstantVector::get(upper), "highTemp");
+
+            if (name == "hsum") {
+                packed = builder.CreateFAdd(low, high, "addTemp");
+            } else if (name == "hmin") {
+                packed = builder.CreateSelect(builder.CreateFCmpOLT(low, high), low, high, "minTemp");
+            } else {
+                packed = builder.CreateSelect(builder.CreateFCmpOGT(low, high), low, high, "maxTemp");
+            }
+        }
+
+        return builder.CreateExtractElement(packed, builder.getInt64(0), "reducedTemp");
+    }
+
+    /**
+     * Outlines body into a function the pool calls with (context, from, to) and runs it over start to stop. The
+     * captured values are passed through a struct on this function's stack, which lives until parallelFor returns,
+     * and body receives them loaded again inside the outlined function.
+     */
+    void parallelRange(const string &name, llvm::Value* start, llvm::Value* stop, llvm::Value* grain, vector<llvm::Value*> &captured,
+                       const std::function<void(vector<llvm::Value*>&, llvm::Value*, llvm::Value*)> &body) {
+        auto rawType = llvm::PointerType::getInt8PtrTy(con);
+        vector<llvm::Type*> fieldTypes;
+
+        for (auto value : captured) {
+            fieldTypes.push_back(value->getType());
+        }
+
+        auto contextType = llvm::StructType::get(con, fieldTypes);
+        auto context = entryAlloca(contextType, name + "Context");
+
+        for (unsigned int i = 0; i < captured.size(); i++) {
+            builder.CreateStore(captured[i], builder.CreateStructGEP(contextType, context, i));
+        }
+
+        auto initStartPoint = builder.GetInsertBlock();
+
+        auto longType = builder.getInt64Ty();
+        auto rangeBodyType = llvm::FunctionType::get(builder.getVoidTy(), { rawType, longType, longType }, false);
+        auto rangeBody = llvm::Function::Create(rangeBodyType, llvm::Function::InternalLinkage, name + ".body", &mod);
+        builder.SetInsertPoint(llvm::BasicBlock::Create(con, "body", rangeBody));
+
+        auto args = rangeBody->arg_begin();
+        auto typedContext = builder.CreateBitCast(&*args, llvm::PointerType::get(contextType, 0));
+        vector<llvm::Value*> values;
+
+        for (unsigned int i = 0; i < captured.size(); i++) {
+            values.push_back(builder.CreateLoad(fieldTypes[i], builder.CreateStructGEP(contextType, typedContext, i)));
+        }
+
+        body(values, &*(args + 1), &*(args + 2));
+        builder.CreateRetVoid();
+
+        builder.SetInsertPoint(initStartPoint);
+        builder.CreateCall(lookupValue("parallelFor"), { start, stop, grain, rangeBody, builder.CreateBitCast(context, rawType) });
+    }
+
+    /**
+     * Aborts unless 0 <= index < size. A negative index is a huge unsigned one, so one compare covers both ends and
+     * LLVM can drop it when the index is known to be in range, as in a loop counting up to the size.
+     */
+    void checkBounds(IndexAccess* ex, llvm::Value* list, llvm::Value* index) {
+        auto size = builder.CreateZExt(loadArraySize(list), builder.getInt64Ty(), "size");
+        failUnless(builder.CreateICmpULT(index, size, "inBounds"), "indexOutOfBounds", { index, size }, ex);
+    }
+
+    /**
+     * Calls the runtime function that reports the failure, with the location of ex after its arguments, unless
+     * condition holds. It never returns, so the rest of the function only runs when the condition holds.
+     */
+    void failUnless(llvm::Value* condition, const string &failure, vector<llvm::Value*> args, Expression* ex) {
+        auto currentFunction = builder.GetInsertBlock()->getParent();
+        auto failBlock = llvm::BasicBlock::Create(con, "checkFailed", currentFunction);
+        auto okBlock = llvm::BasicBlock::Create(con, "checkPassed", currentFunction);
+
+        builder.CreateCondBr(condition, okBlock, failBlock, branchWeights(BranchHint::likely));
+
+        builder.SetInsertPoint(failBlock);
+        args.push_back(builder.getInt32(ex->loc().y));
+        args.push_back(builder.getInt32(ex->loc().x));
+        builder.CreateCall(lookupValue(failure), args);
+        builder.CreateUnreachable();
+
+        builder.SetInsertPoint(okBlock);
+    }
+
+    llvm::Value* loadArraySize(llvm::Value* array) {
+        return builder.CreateLoad(builder.getInt32Ty(), builder.CreateStructGEP(types["arrayRefType"], array, 1), "size");
+    }
+
+    llvm::Value* loadArrayData(llvm::Value* array, llvm::Type* elementType) {
+        auto raw = builder.CreateLoad(llvm::PointerType::getInt8PtrTy(con), builder.CreateStructGEP(types["arrayRefType"], array, 0));
+        return builder.CreateBitCast(raw, llvm::PointerType::get(elementType, 0), "data");
+    }
+
+    /**
+     * Where the elements of a list are: its data, or for a Columns list one column per field in declaration order.
+     * The columns share one allocation, each taking capacity elements, with the most aligned first so every column
+     * starts aligned. A slice of a Columns list starts its columns offset elements in.
+     */
+    vector<llvm::Value*> listColumns(llvm::Value* array, TypeToken& listType) {
+        if (!isColumnsList(listType)) {
+            return { loadArrayData(array, listElementType(listType)) };
+        }
+
+        auto &record = recordOf(listType);
+        auto raw = builder.CreateLoad(llvm::PointerType::getInt8PtrTy(con), builder.CreateStructGEP(types["arrayRefType"], array, 0));
+        auto capacity = builder.CreateZExt(builder.CreateLoad(builder.getInt32Ty(), builder.CreateStructGEP(types["arrayRefType"], array, 2)), builder.getInt64Ty(), "capacity");
+        auto first = builder.CreateZExt(builder.CreateLoad(builder.getInt32Ty(), builder.CreateStructGEP(types["arrayRefType"], array, 4)), builder.getInt64Ty(), "first");
+
+        vector<llvm::Value*> columns(record.fields.size());
+        llvm::Value *offset = builder.getInt64(0);
+
+        for (auto field : columnOrder(record)) {
+            auto columnType = storageType(*record.fieldTypes[field]);
+            auto column = builder.CreateBitCast(builder.CreateGEP(builder.getInt8Ty(), raw, offset), llvm::PointerType::get(columnType, 0));
+            columns[field] = builder.CreateGEP(columnType, column, first, record.fields[field] + "Column");
+
+            auto columnSize = builder.CreateMul(capacity, builder.CreateZExt(storageSize(columnType), builder.getInt64Ty()));
+            offset = builder.CreateAdd(offset, columnSize);
+        }
+
+        return columns;
+    }
+
+    vector<unsigned int> columnOrder(Record& record) {
+        vector<unsigned int> order;
+
+        for (unsigned int i = 0; i < record.fields.size(); i++) {
+            order.push_back(i);
+        }
+
+        stable_sort(order.begin(), order.end(), [&](unsigned int left, unsigned int right) {
+            return alignmentOf(storageType(*record.fieldTypes[left])) > alignmentOf(storageType(*record.fieldTypes[right]));
+        });
+
+        return order;
+    }
+
+    unsigned int alignmentOf(llvm::Type* type) {
+        if (type->isStructTy()) {
+            unsigned int alignment = 1;
+
+            for (auto element : ((llvm::StructType *) type)->elements()) {
+                alignment = max(alignment, alignmentOf(element));
+            }
+
+            return alignment;
+        }
+
+        return max(1u, (unsigned int) type->getPrimitiveSizeInBits() / 8);
+    }
+
+    /**
+     * Reads the element at index from the columns given by listColumns.
+     */
+    llvm::Value* loadElement(vector<llvm::Value*> &columns, TypeToken& listType, llvm::Value* index) {
+        if (!isColumnsList(listType)) {
+            auto elementType = listElementType(listType);
+            auto element = builder.CreateLoad(elementType, builder.CreateGEP(elementType, columns[0], index), "element");
+            return fromListElement(element, listType);
+        }
+
+        auto &record = recordOf(listType);
+        llvm::Value *element = llvm::UndefValue::get(types[record.id]);
+
+        for (unsigned int i = 0; i < columns.size(); i++) {
+            auto columnType = storageType(*record.fieldTypes[i]);
+            auto valueType = mapTypes(*record.fieldTypes[i]);
+            llvm::Value *field = builder.CreateLoad(columnType, builder.CreateGEP(columnType, columns[i], index), record.fields[i]);
+
+            if (field->getType() != valueType) {
+                field = builder.CreateTrunc(field, valueType);
+            }
+
+            element = builder.CreateInsertValue(element, field, i, "element");
+        }
+
+        return element;
+    }
+
+    void storeElement(vector<llvm::Value*> &columns, TypeToken& listType, llvm::Value* index, llvm::Value* element) {
+        if (!isColumnsList(listType)) {
+            auto elementType = listElementType(listType);
+            builder.CreateStore(toListElement(element, elementType), builder.CreateGEP(elementType, columns[0], index));
+            return;
+        }
+
+        auto &record = recordOf(listType);
+
+        for (unsigned int i = 0; i < columns.size(); i++) {
+            auto columnType = storageType(*record.fieldTypes[i]);
+            auto field = toListElement(builder.CreateExtractValue(element, i, record.fields[i]), columnType);
+            builder.CreateStore(field, builder.CreateGEP(columnType, columns[i], index));
+        }
+    }
+
+    /**
+     * Allocates a list with room for capacity elements, sized for its layout.
+     */
+    void createList(llvm::Value* array, TypeToken& listType, llvm::Value* size, llvm::Value* capacity) {
+        llvm::Value *itemSize;
+
+        if (isColumnsList(listType)) {
+            auto &record = recordOf(listType);
+            itemSize = builder.getInt32(0);
+
+            for (auto &fieldType : record.fieldTypes) {
+                itemSize = builder.CreateAdd(itemSize, storageSize(storageType(*fieldType)));
+            }
+        } else {
+            itemSize = storageSize(listElementType(listType));
+        }
+
+        builder.CreateCall(lookupValue("createArray"), { array, size, capacity, itemSize });
+    }
+
+    /**
+     * The bytes a list element of the type takes, which the runtime needs as an unsigned int. A struct's or an array's
+     * size depends on the target so is left for LLVM to work out.
+     */
+    llvm::Value* storageSize(llvm::Type* type) {
+        if (type->isStructTy() || type->isArrayTy()) {
+            return llvm::ConstantExpr::getTruncOrBitCast(llvm::ConstantExpr::getSizeOf(type), builder.getInt32Ty());
+        }
+
+        return builder.getInt32(type->getPrimitiveSizeInBits() / 8);
+    }
+
+    /**
+     * One field of every record in a list. A column of a Columns list is already laid out as a list of that field, so
+     * it is returned as a view of the same memory. Otherwise the field is gathered into a new list.
+     */
+    llvm::Value* projectField(llvm::Value* list, TypeToken& listType, const string &field, TypeToken& fieldListType) {
+        auto index = fieldIndex(recordOf(listType), field);
+        auto columns = listColumns(list, listType);
+        auto size = loadArraySize(list);
+
+        if (isColumnsList(listType)) {
+            auto arrayRefType = types["arrayRefType"];
+            auto view = makeView(list, field + "View");
+            auto itemSize = storageSize(listElementType(fieldListType));
+
+            builder.CreateStore(builder.CreateBitCast(columns[index], llvm::PointerType::getInt8PtrTy(con)), builder.CreateStructGEP(arrayRefType, view, 0));
+            builder.CreateStore(size, builder.CreateStructGEP(arrayRefType, view, 2));
+            builder.CreateStore(itemSize, builder.CreateStructGEP(arrayRefType, view, 3));
+            builder.CreateStore(builder.getInt32(0), builder.CreateStructGEP(arrayRefType, view, 4));
+            return view;
+        }
+
+        auto result = arrayAlloca(field + "List");
+        declaredArraysStack.back().push_back(result);
+
+        createList(result, fieldListType, size, size);
+        auto resultColumns = listColumns(result, fieldListType);
+
+        countedLoop(builder.getInt64(0), builder.CreateZExt(size, builder.getInt64Ty()), "project", [&](llvm::Value* i, llvm::BasicBlock* next) {
+            auto element = loadElement(columns, listType, i);
+            storeElement(resultColumns, fieldListType, i, builder.CreateExtractValue(element, index, field));
+        });
+
+        return result;
+    }
+
+    /**
+     * A copy of the ArrayRef of list that shares its buffer. It is owned by the current scope like any other list,
+     * destroying it only releases its hold on the buffer.
+     */
+    llvm::AllocaInst* makeView(llvm::Value* list, const string &name) {
+        auto arrayRefType = types["arrayRefType"];
+        auto view = arrayAlloca(name);
+        declaredArraysStack.back().push_back(view);
+
+        builder.CreateStore(builder.CreateLoad(arrayRefType, list), view);
+        builder.CreateCall(lookupValue("retainArray"), { view });
+        return view;
+    }
+
+    /**
+     * slice(list, start, end), head(list) and tail(list). Slices are views, so take constant time whatever their
+     * length. A Columns slice moves its offset, any other moves its data pointer.
+     */
+    llvm::Value* compileSlice(Call* ex) {
+        auto &name = ((Variable &) *ex->source).id;
+        auto &listType = ex->args[0]->type();
+        auto list = compile(ex->args[0].get());
+        auto size = builder.CreateZExt(loadArraySize(list), builder.getInt64Ty(), "size");
+
+        if (name == "head") {
+            auto first = builder.getInt64(0);
+
+            if (options.checkBounds) {
+                failUnless(builder.CreateICmpULT(first, size), "indexOutOfBounds", { first, size }, ex);
+            }
+
+            auto columns = listColumns(list, listType);
+            return loadElement(columns, listType, first);
+        }
+
+        auto start = name == "tail" ? builder.getInt64(1) : compile(ex->args[1].get());
+        auto end = name == "tail" ? size : compile(ex->args[2].get());
+
+        // Unsigned, so a negative start or end is out of range too.
+        if (options.checkBounds) {
+            auto inBounds = builder.CreateAnd(builder.CreateICmpULE(start, end), builder.CreateICmpULE(end, size), "inBounds");
+            failUnless(inBounds, "sliceOutOfBounds", { start, end, size }, ex);
+        }
+
+        auto arrayRefType = types["arrayRefType"];
+        auto view = makeView(list, name);
+        auto length = builder.CreateTrunc(builder.CreateSub(end, start), builder.getInt32Ty(), "length");
+
+        if (isColumnsList(listType)) {
+            auto offset = builder.CreateLoad(builder.getInt32Ty(), builder.CreateStructGEP(arrayRefType, list, 4));
+            builder.CreateStore(builder.CreateAdd(offset, builder.CreateTrunc(start, builder.getInt32Ty())), builder.CreateStructGEP(arrayRefType, view, 4));
+        } else {
+            auto data = builder.CreateLoad(llvm::PointerType::getInt8PtrTy(con), builder.CreateStructGEP(arrayRefType, list, 0));
+            auto itemSize = builder.CreateZExt(builder.CreateLoad(builder.getInt32Ty(), builder.CreateStructGEP(arrayRefType, list, 3)), builder.getInt64Ty());
+            builder.CreateStore(builder.CreateGEP(builder.getInt8Ty(), data, builder.CreateMul(start, itemSize)), builder.CreateStructGEP(arrayRefType, view, 0));
+            builder.CreateStore(length, builder.CreateStructGEP(arrayRefType, view, 2));
+        }
+
+        builder.CreateStore(length, builder.CreateStructGEP(arrayRefType, view, 1));
+        return view;
+    }
+
+    /**
+     * The record a value or the elements of a list are.
+     */
+    Record& recordOf(TypeToken& type) {
+        auto &recordType = type.kind == TypeTokenKind::generic ? *((GenericTypeToken &) type).typeParams[0] : type;
+
+        return *records[((NamedTypeToken &) recordType).id];
+    }
+
+    unsigned int fieldIndex(Record& record, const string &field) {
+        return find(record.fields.begin(), record.fields.end(), field) - record.fields.begin();
+    }
+
+    bool isRecordList(TypeToken& type) {
+        return type.kind == TypeTokenKind::generic && ((GenericTypeToken &) type).typeParams[0]->kind == TypeTokenKind::named;
+    }
+
+    bool isColumnsList(TypeToken& type) {
+        return type.kind == TypeTokenKind::generic && ((GenericTypeToken &) type).typeParams.size() == 2;
+    }
+
+    /**
+     * Undo the storage widening of listElementType, so a Boolean read from a list is an i1 again and packed Floats are
+     * a vector.
+     */
+    llvm::Value* fromListElement(llvm::Value* stored, TypeToken& listType) {
+        auto valueType = mapTypes(*((GenericTypeToken &) listType).typeParams[0]);
+
+        if (stored->getType() == valueType) {
+            return stored;
+        }
+
+        if (stored->getType()->isArrayTy()) {
+            llvm::Value *packed = llvm::UndefValue::get(valueType);
+
+            for (unsigned int lane = 0; lane < stored->getType()->getArrayNumElements(); lane++) {
+                packed = builder.CreateInsertElement(packed, builder.CreateExtractValue(stored, lane), lane, "packed");
+            }
+
+            return packed;
+        }
+
+        return builder.CreateTrunc(stored, valueType);
+    }
+
+    /**
+     * Widens a value to the storage type listElementType gave its list.
+     */
+    llvm::Value* toListElement(llvm::Value* value, llvm::Type* storageType) {
+        if (value->getType() == storageType) {
+            return value;
+        }
+
+        if (storageType->isArrayTy()) {
+            llvm::Value *lanes = llvm::UndefValue::get(storageType);
+
+            for (unsigned int lane = 0; lane < storageType->getArrayNumElements(); lane++) {
+                lanes = builder.CreateInsertValue(lanes, builder.CreateExtractElement(value, lane), lane, "lanes");
+            }
+
+            return lanes;
+        }
+
+        return builder.CreateZExt(value, storageType, "byteTemp");
+    }
+
+    /**
+     * A function argument. Named functions are kept as they are so the call to them stays direct.
+     */
+    llvm::Value* compileFunctionValue(Expression* expression) {
+        if (expression->kind == ExpressionKind::variable) {
+            auto func = lookupVariable((Variable *) expression);
+
+            if (llvm::isa<llvm::Function>(func) && listResultFunctions.count(func) == 0) {
+                return func;
+            }
+        }
+
+        return compile(expression);
+    }
+
+    llvm::Value* applyFunction(llvm::Value* func, BasicFunctionTypeToken& type, vector<llvm::Value*> &args) {
+        llvm::CallInst *call;
+
+        if (!llvm::isa<llvm::Function>(func)) {
+            call = callClosure(func, type, args);
+        } else {
+            call = builder.CreateCall(func, args);
+
+            if (userFunctions.count(func) == 1) {
+                call->setCallingConv(((llvm::Function *) func)->getCallingConv());
+            }
+        }
+
+        return isListType(*type.result) ? adoptList(call) : call;
+    }
+
+    llvm::AllocaInst* entryAlloca(llvm::Type* type, const string &name) {
+        auto &entryBlock = builder.GetInsertBlock()->getParent()->getEntryBlock();
+        llvm::IRBuilder<> entryBuilder(&entryBlock, entryBlock.begin());
+
+        return entryBuilder.CreateAlloca(type, nullptr, name);
+    }
+
+    /**
+     * Arrays are destroyed at the end of their scope even when the branch that creates them didn't run, so they
+     * start out empty and destroying one that was never created frees nothing.
+     */
+    /**
+     * Keeps a list a user function returned by value in an ArrayRef owned by the calling scope.
+     */
+    llvm::Value* adoptList(llvm::Value* returned) {
+        auto array = arrayAlloca("returnedArray");
+        declaredArraysStack.back().push_back(array);
+        builder.CreateStore(returned, array);
+        return array;
+    }
+
+    llvm::AllocaInst* arrayAlloca(const string &name) {
+        auto &entryBlock = builder.GetInsertBlock()->getParent()->getEntryBlock();
+        llvm::IRBuilder<> entryBuilder(&entryBlock, entryBlock.begin());
+
+        auto array = entryBuilder.CreateAlloca(types["arrayRefType"], nullptr, name);
+        entryBuilder.CreateStore(llvm::ConstantAggregateZero::get(types["arrayRefType"]), array);
+        return array;
+    }
+
+    /**
+     * A self call that loops back cleans up before the jump, see compileTailCall.
+     */
+    bool canTailCall(llvm::Value *func) {
+        return (func == builder.GetInsertBlock()->getParent() && tailRecursionHeader != nullptr) || !hasPendingCleanup();
+    }
+
+    bool ownsArray(llvm::Value *value) {
+        for (auto i = functionArraysBase; i < declaredArraysStack.size(); i++) {
+            auto &owned = declaredArraysStack[i];
+
+            if (find(owned.begin(), owned.end(), value) != owned.end()) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool ownsVector(llvm::Value *value) {
+        for (auto i = functionVectorsBase; i < declaredVectorsStack.size(); i++) {
+            auto &owned = declaredVectorsStack[i];
+
+            if (find(owned.begin(), owned.end(), value) != owned.end()) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Releases everything the current function owns apart from the moved values, without ending any scope. The
+     * scopes are still closed normally after the tail call, in a block that never runs. Arrays are emptied, so one
+     * the next iteration doesn't create again is not destroyed twice.
+     */
+    void releaseFunctionScopes(set<llvm::Value*> &moved) {
+        for (auto i = functionArraysBase; i < declaredArraysStack.size(); i++) {
+            for (auto &next : declaredArraysStack[i]) {
+                if (moved.count(next) == 0) {
+                    builder.CreateCall(lookupValue("destroyArray"), { next });
+                }
+
+                builder.CreateStore(llvm::ConstantAggregateZero::get(types["arrayRefType"]), next);
+            }
+        }
+
+        for (auto i = functionVectorsBase; i < declaredVectorsStack.size(); i++) {
+            for (auto &next : declaredVectorsStack[i]) {
+                if (moved.count(next) == 0) {
+                    builder.CreateCall(lookupValue("vectorRelease"), { next });
+                }
+            }
+        }
+    }
+
+    /**
+     * Arrays and vectors are cleaned up after a block's last expression, so nothing is in tail position while the
+     * current function still owns any.
+     */
+    bool hasPendingCleanup() {
+        for (auto i = functionArraysBase; i < declaredArraysStack.size(); i++) {
+            if (!declaredArraysStack[i].empty()) {
+                return true;
+            }
+        }
+
+        for (auto i = functionVectorsBase; i < declaredVectorsStack.size(); i++) {
+            if (!declaredVectorsStack[i].empty()) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool isSelectable(If *ex) {
+        if (ex->type().kind != TypeTokenKind::base || ((BaseTypeToken &) ex->type()).base == BasicTypeTokenKind::Unit) {
+            return false;
+        }
+
+        auto thenCost = speculationCost(ex->thenEx.get());
+        auto elseCost = speculationCost(ex->elseEx.get());
+
+        return thenCost != notSpeculatable && elseCost != notSpeculatable && thenCost + elseCost <= maxSelectCost;
+    }
+
+    /**
+     * Estimates the cost of evaluating an expression even when its result may be thrown away.
+     * @return notSpeculatable if the expression has side effects, allocates, or may trap
+     */
+    int speculationCost(Expression *expression) {
+        switch (expression->kind) {
+            case ExpressionKind::numberLiteral:
+            case ExpressionKind::booleanLiteral:
+            case ExpressionKind::variable:
+                return 0;
+            case ExpressionKind::assignment: {
+                auto ex = (Assignment *) expression;
+                return speculationCost(ex->body.get());
+            }
+            case ExpressionKind::binaryOp: {
+                auto ex = (BinaryOp *) expression;
+                auto left = speculationCost(ex->left.get());
+                auto right = speculationCost(ex->right.get());
+
+                if (left == notSpeculatable || right == notSpeculatable) {
+                    return notSpeculatable;
+                }
+
+                if (ex->op == "/" || ex->op == "%") {
+                    // Integer division by zero stops the program, floating point division is just slow.
+                    return isIntType(ex->left->type()) ? notSpeculatable : left + right + 4;
+                }
+
+                return left + right + 1;
+            }
+            case ExpressionKind::block: {
+                auto ex = (Block *) expression;
+                int total = 0;
+
+                for (auto &next : ex->body) {
+                    auto cost = speculationCost(next.get());
+
+                    if (cost == notSpeculatable) {
+                        return notSpeculatable;
+                    }
+
+                    total += cost;
+                }
+
+                return total;
+            }
+            case ExpressionKind::ifEx: {
+                auto ex = (If *) expression;
+
+                if (!isSelectable(ex)) {
+                    return notSpeculatable;
+                }
+
+                auto condition = speculationCost(ex->condition.get());
+
+                if (condition == notSpeculatable) {
+                    return notSpeculatable;
+                }
+
+                return condition + speculationCost(ex->thenEx.get()) + speculationCost(ex->elseEx.get()) + 1;
+            }
+            case ExpressionKind::fieldAccess: {
+                auto ex = (FieldAccess *) expression;
+
+                // A field of a record is free to read, projecting a list may build a new one.
+                return ex->object->type().kind == TypeTokenKind::generic ? notSpeculatable : speculationCost(ex->object.get());
+            }
+            default:
+                return notSpeculatable;
+        }
+    }
+
+    /**
+     * Compiles a branch condition, unwrapping a likely/unlikely hint around it.
+     */
+    llvm::Value* compileCondition(Expression *expression, BranchHint &hint) {
+        if (expression->kind == ExpressionKind::call) {
+            auto ex = (Call *) expression;
+
+            if (ex->source->kind == ExpressionKind::variable && ex->args.size() == 1) {
+                auto func = lookupValue(((Variable *) ex->source.get())->id);
+
+                if (func != nullptr && func == lookupValue("likely")) {
+                    hint = BranchHint::likely;
+                    return compile(ex->args[0].get());
+                } else if (func != nullptr && func == lookupValue("unlikely")) {
+                    hint = BranchHint::unlikely;
+                    return compile(ex->args[0].get());
+                }
+            }
+        }
+
+        return compile(expression);
+    }
+
+    llvm::MDNode* branchWeights(BranchHint hint) {
+        llvm::MDBuilder weights(con);
+
+        switch (hint) {
+            case BranchHint::likely:
+                return weights.createBranchWeights(2000, 1);
+            case BranchHint::unlikely:
+                return weights.createBranchWeights(1, 2000);
+            default:
+                return nullptr;
+        }
+    }
+
+    /**
+     * && and || only evaluate their right hand side when the left one doesn't already decide the result.
+     */
+    llvm::Value* compileShortCircuit(BinaryOp *ex) {
+        bool isAnd = ex->op == "&&";
+
+        BranchHint hint = BranchHint::none;
+        auto left = compileCondition(ex->left.get(), hint);
+        auto leftBlock = builder.GetInsertBlock();
+
+        auto currentFunction = leftBlock->getParent();
+        auto rightBlock = llvm::BasicBlock::Create(con, isAnd ? "andRight" : "orRight", currentFunction);
+        auto mergeBlock = llvm::BasicBlock::Create(con, isAnd ? "andContinued" : "orContinued");
+
+        if (isAnd) {
+            builder.CreateCondBr(left, rightBlock, mergeBlock, branchWeights(hint));
+        } else {
+            builder.CreateCondBr(left, mergeBlock, rightBlock, branchWeights(hint));
+        }
+
+        builder.SetInsertPoint(rightBlock);
+        auto right = compile(ex->right.get());
+        builder.CreateBr(mergeBlock);
+        rightBlock = builder.GetInsertBlock();
+
+        currentFunction->getBasicBlockList().push_back(mergeBlock);
+        builder.SetInsertPoint(mergeBlock);
+
+        auto phi = builder.CreatePHI(llvm::Type::getInt1Ty(con), 2, isAnd ? "andTemp" : "orTemp");
+        phi->addIncoming(isAnd ? llvm::ConstantInt::getFalse(con) : llvm::ConstantInt::getTrue(con), leftBlock);
+        phi->addIncoming(right, rightBlock);
+        return phi;
+    }
+
+    llvm::Value* compileBinaryOp(BinaryOp *ex) {
+        if (ex->op == "&&" || ex->op == "||") {
+            return compileShortCircuit(ex);
+        }
+
+        auto left = compile(ex->left.get());
+        auto right = compile(ex->right.get());
+
+        auto op = ex->op;
+
+        if (isIntType(ex->left->type())) {
+            return compileIntBinaryOp(ex, left, right);
+        }
+
+        // A Float next to a packed type is used in every lane.
+        if (left->getType()->isVectorTy() && !right->getType()->isVectorTy()) {
+            right = builder.CreateVectorSplat(left->getType()->getVectorNumElements(), right, "splatTemp");
+        } else if (right->getType()->isVectorTy() && !left->getType()->isVectorTy()) {
+            left = builder.CreateVectorSplat(right->getType()->getVectorNumElements(), left, "splatTemp");
+        }
+
+        if (op == "+") {
+            return builder.CreateFAdd(left, right, "addTemp");
+        } else if (op == "-") {
+            return builder.CreateFSub(left, right, "subTemp");
+        } else if (op == "*") {
+            return builder.CreateFMul(left, right, "mulTemp");
+        } else if (op == "/") {
+            return builder.CreateFDiv(left, right, "divTemp");
+        } else if (op == "%") {
+            return builder.CreateFRem(left, right, "remTemp");
+        } else if (op == "==") {
+            return builder.CreateFCmpOEQ(left, right, "equalTemp");
+        } else if (op == "!=") {
+            return builder.CreateFCmpONE(left, right, "notEqualTemp");
+        } else if (op == ">=") {
+            return builder.CreateFCmpOGE(left, right, "greaterOrEqualTemp");
+        } else if (op == ">") {
+            return builder.CreateFCmpOGT(left, right, "greaterTemp");
+        } else if (op == "<") {
+            return builder.CreateFCmpOLT(left, right, "lessTemp");
+        } else if (op == "<=") {
+            return builder.CreateFCmpOLE(left, right, "lessOrEqualTemp");
+        } else {
+            throw std::runtime_error("Unknown binary operator: " + op + " at " + ex->loc().pretty());
+        }
+    }
+
+    llvm::Value* compileIntBinaryOp(BinaryOp *ex, llvm::Value *left, llvm::Value *right) {
+        auto op = ex->op;
+
+        if (op == "+") {
+            return builder.CreateAdd(left, right, "addTemp");
+        } else if (op == "-") {
+            return builder.CreateSub(left, right, "subTemp");
+        } else if (op == "*") {
+            return builder.CreateMul(left, right, "mulTemp");
+        } else if (op == "/" || op == "%") {
+            return compileIntDivision(ex, left, right);
+        } else if (op == "<<") {
+            // Shift amounts are taken modulo 64, like the hardware does.
+            return builder.CreateShl(left, builder.CreateAnd(right, 63), "shiftLeftTemp");
+        } else if (op == ">>") {
+            return builder.CreateAShr(left, builder.CreateAnd(right, 63), "shiftRightTemp");
+        } else if (op == "==") {
+            return builder.CreateICmpEQ(left, right, "equalTemp");
+        } else if (op == "!=") {
+            return builder.CreateICmpNE(left, right, "notEqualTemp");
+        } else if (op == ">=") {
+            return builder.CreateICmpSGE(left, right, "greaterOrEqualTemp");
+        } else if (op == ">") {
+            return builder.CreateICmpSGT(left, right, "greaterTemp");
+        } else if (op == "<") {
+            return builder.CreateICmpSLT(left, right, "lessTemp");
+        } else if (op == "<=") {
+            return builder.CreateICmpSLE(left, right, "lessOrEqualTemp");
+        } else {
+            throw std::runtime_error("Unknown integer operator: " + op + " at " + ex->loc().pretty());
+        }
+    }
+
+    /**
+     * Dividing by zero stops the program. Otherwise division wraps like the other operators, so INT64_MIN / -1 is
+     * INT64_MIN with no remainder. Dividing by -1 is done as a negation since sdiv and srem are undefined there.
+     */
+    llvm::Value* compileIntDivision(BinaryOp *ex, llvm::Value *left, llvm::Value *right) {
+        failUnless(builder.CreateICmpNE(right, builder.getInt64(0), "nonZero"), "divideByZero", {}, ex);
+
+        auto byMinusOne = builder.CreateICmpEQ(right, builder.getInt64(-1), "byMinusOne");
+        auto divisor = builder.CreateSelect(byMinusOne, builder.getInt64(1), right, "divisor");
+
+        if (ex->op == "/") {
+            auto quotient = builder.CreateSDiv(left, divisor, "divTemp");
+            return builder.CreateSelect(byMinusOne, builder.CreateSub(builder.getInt64(0), left), quotient, "divTemp");
+        } else {
+            auto remainder = builder.CreateSRem(left, divisor, "remTemp");
+            return builder.CreateSelect(byMinusOne, builder.getInt64(0), remainder, "remTemp");
+        }
+    }
+
+    /**
+     * Releases the vectors owned by the innermost scope and pops it. If the scope yields a vector it is handed to the
+     * caller with exactly one reference, retaining it first if the scope only borrowed it.
+     */
+    void releaseVectors(llvm::Value *result, bool vectorResult) {
+        auto owned = declaredVectorsStack.back();
+        declaredVectorsStack.pop_back();
+
+        bool resultOwned = false;
+
+        for (auto &next : owned) {
+            if (vectorResult && next == result) {
+                resultOwned = true;
+            } else {
+                builder.CreateCall(lookupValue("vectorRelease"), { next });
+            }
+        }
+
+        if (vectorResult && !resultOwned) {
+            builder.CreateCall(lookupValue("vectorRetain"), { result });
+        }
+    }
+
+    bool isIntType(TypeToken &type) {
+        return type.kind == TypeTokenKind::base && ((BaseTypeToken &) type).base == BasicTypeTokenKind::Int;
+    }
+
+    /**
+     * Ends the array scope of a function body, destroying everything but its result.
+     */
+    void releaseArrays(llvm::Value* result) {
+        auto destroyArray = lookupValue("destroyArray");
+        for (auto &next : declaredArraysStack.back()) {
+            if (next != result) {
+                builder.CreateCall(destroyArray, { next });
+            }
+        }
+
+        declaredArraysStack.pop_back();
+    }
+
+    bool isListType(TypeToken &type) {
+        return type.kind == TypeTokenKind::generic && ((GenericTypeToken &) type).parent->base == "List";
+    }
+
+    bool isVectorType(TypeToken &type) {
+        return type.kind == TypeTokenKind::generic && ((GenericTypeToken &) type).parent->base == "Vector";
+    }
+
+    llvm::Value* lookupVariable(Variable* ex) {
+        auto var = lookupValue(ex->id);
+
+        if (var == nullptr) {
+            throw std::runtime_error("Variable " + ex->id + " is not declared at " + ex->loc().pretty());
+        }
+
+        return var;
+    }
+
+    /**
+     * A closure is a function that takes an environment pointer before its own parameters, paired with that pointer.
+     */
+    llvm::FunctionType* closureFunctionType(BasicFunctionTypeToken& token) {
+        vector<llvm::Type*> paramTypes{llvm::PointerType::getInt8PtrTy(con)};
+
+        for (auto &param : token.params) {
+            paramTypes.push_back(mapTypes(*param));
+        }
+
+        return llvm::FunctionType::get(returnType(*token.result), paramTypes, false);
+    }
+
+    llvm::Value* makeClosure(llvm::Value* func, llvm::Value* env) {
+        llvm::Value *closure = llvm::UndefValue::get(types["closureType"]);
+        closure = builder.CreateInsertValue(closure, builder.CreateBitCast(func, llvm::PointerType::getInt8PtrTy(con)), 0);
+        return builder.CreateInsertValue(closure, env, 1, "closure");
+    }
+
+    llvm::CallInst* callClosure(llvm::Value* closure, BasicFunctionTypeToken& type, vector<llvm::Value*> &args) {
+        auto functionType = closureFunctionType(type);
+        auto func = builder.CreateExtractValue(closure, 0);
+        auto env = builder.CreateExtractValue(closure, 1, "env");
+
+        vector<llvm::Value*> closureArgs{env};
+        closureArgs.insert(closureArgs.end(), args.begin(), args.end());
+
+        auto call = builder.CreateCall(builder.CreateBitCast(func, llvm::PointerType::get(functionType, 0)), closureArgs);
+        call->setCallingConv(llvm::CallingConv::Fast);
+        return call;
+    }
+
+    /**
+     * Module functions and nested functions that capture nothing don't need an environment. As values they are
+     * wrapped in an adapter that takes one and ignores it.
+     */
+    llvm::Value* plainClosure(llvm::Function* func, Variable* ex) {
+        if (listResultFunctions.count(func) == 1) {
+            throw std::runtime_error("Function " + ex->id + " can only be called directly at " + ex->loc().pretty());
+        }
+
+        auto &adapter = closureAdapters[func];
+
+        if (adapter == nullptr) {
+            auto initStartPoint = builder.GetInsertBlock();
+
+            vector<llvm::Type*> paramTypes{llvm::PointerType::getInt8PtrTy(con)};
+            auto funcType = func->getFunctionType();
+            paramTypes.insert(paramTypes.end(), funcType->param_begin(), funcType->param_end());
+
+            auto adapterType = llvm::FunctionType::get(funcType->getReturnType(), paramTypes, false);
+            adapter = llvm::Function::Create(adapterType, llvm::Function::InternalLinkage, func->getName() + ".closure", &mod);
+            adapter->setCallingConv(llvm::CallingConv::Fast);
+
+            builder.SetInsertPoint(llvm::BasicBlock::Create(con, "body", adapter));
+
+            vector<llvm::Value*> args;
+
+            for (auto &arg : adapter->args()) {
+                if (arg.getArgNo() > 0) {
+                    args.push_back(&arg);
+                }
+            }
+
+            auto call = builder.CreateCall(func, args);
+            call->setCallingConv(func->getCallingConv());
+
+            if (funcType->getReturnType()->isVoidTy()) {
+                builder.CreateRetVoid();
+            } else {
+                builder.CreateRet(call);
+            }
+
+            builder.SetInsertPoint(initStartPoint);
+        }
+
+        return makeClosure(adapter, llvm::ConstantPointerNull::get(llvm::PointerType::getInt8PtrTy(con)));
+    }
+
+    /**
+     * The captured values in the order of Function::captures. Only valid while they are still in scope, which is
+     * both where the closure is defined and while its own body is compiled.
+     */
+    llvm::StructType* environmentType(Function* ex) {
+        vector<llvm::Type*> fieldTypes;
+
+        for (auto &name : ex->captures) {
+            fieldTypes.push_back(lookupValue(name)->getType());
+        }
+
+        return llvm::StructType::get(con, fieldTypes);
+    }
+
+    /**
+     * Fills the single environment of a closure. Function types can't be named in a signature, so a closure can
+     * never outlive the function that defines it and the environment lives on its stack.
+     */
+    llvm::Value* compileEnvironment(Function* ex) {
+        auto envType = environmentType(ex);
+        auto &entryBlock = builder.GetInsertBlock()->getParent()->getEntryBlock();
+
+        // Allocated up front so that loops made from tail calls reuse it.
+        llvm::IRBuilder<> entryBuilder(&entryBlock, entryBlock.begin());
+        auto env = entryBuilder.CreateAlloca(envType, nullptr, ex->id + "Env");
+
+        for (unsigned int i = 0; i < ex->captures.size(); i++) {
+            builder.CreateStore(lookupValue(ex->captures[i]), builder.CreateStructGEP(envType, env, i));
+        }
+
+        return builder.CreateBitCast(env, llvm::PointerType::getInt8PtrTy(con));
+    }
+
+    void loadEnvironment(Function* ex, llvm::Function* func, map<string, llvm::Value*> &context) {
+        auto envType = environmentType(ex);
+        auto env = builder.CreateBitCast(&*func->arg_begin(), llvm::PointerType::get(envType, 0));
+
+        for (unsigned int i = 0; i < ex->captures.size(); i++) {
+            auto &name = ex->captures[i];
+            context[name] = builder.CreateLoad(envType->getElementType(i), builder.CreateStructGEP(envType, env, i), name);
+        }
+    }
+
+    llvm::Value* lookupValue(const string &id) {
+
+        for (auto i = contextStack.size(); i > 0; --i) {
+            auto &context = contextStack[i - 1];
+
+            if (context.find(id) != context.end()) {
+                return context[id];
+            }
+        }
+
+        return nullptr;
+    }
+
+    llvm::Type* mapTypes(TypeToken& raw) {
+        switch (raw.kind) {
+            case TypeTokenKind::base: {
+                return mapTypes((BaseTypeToken&) raw);
+            }
+            case TypeTokenKind::basicFunction: {
+                // Function values are closures, the function type itself is only for declarations.
+                return types["closureType"];
+            }
+            case TypeTokenKind::generic: {
+                return mapTypes((GenericTypeToken&) raw);
+            }
+            case TypeTokenKind::named: {
+                // Records are the only named types left after type checking.
+                return types.at(((NamedTypeToken&) raw).id);
+            }
+            default:
+                throw runtime_error("Unknown type token kind");
+        }
+    }
+
+    llvm::Type* mapTypes(BaseTypeToken& raw) {
+        switch (raw.base) {
+            case BasicTypeTokenKind::Float:
+                return llvm::Type::getDoubleTy(con);
+            case BasicTypeTokenKind::Int:
+                return llvm::Type::getInt64Ty(con);
+            case BasicTypeTokenKind::Boolean:
+                return llvm::Type::getInt1Ty(con);
+            case BasicTypeTokenKind::Unit:
+                return llvm::Type::getVoidTy(con);
+            case BasicTypeTokenKind::Float2:
+                return llvm::VectorType::get(llvm::Type::getDoubleTy(con), 2);
+            case BasicTypeTokenKind::Float4:
+                return llvm::VectorType::get(llvm::Type::getDoubleTy(con), 4);
+            case BasicTypeTokenKind::Float8:
+                return llvm::VectorType::get(llvm::Type::getDoubleTy(con), 8);
+            default:
+                throw runtime_error("Unknown base type token kind");
+        }
+    }
+
+    llvm::Type* mapTypes(GenericTypeToken& raw) {
+        auto &base = raw.parent->base;
+
+        if (base == "List") {
+            return types["arrayRefPointerType"];
+        } else if (base == "Vector") {
+            return types["vectorPointerType"];
+        } else {
+            throw runtime_error("Unknown generic type " + base);
+        }
+    }
+
+    /**
+     * The unboxed type a list stores its elements as, taken from the element type of the list at compile time.
+     */
+    llvm::Type* listElementType(TypeToken& listType) {
+        return storageType(*((GenericTypeToken&) listType).typeParams[0]);
+    }
+
+    /**
+     * How a value of the type is kept in memory. Booleans take a byte, records are stored whole. Packed Floats are
+     * stored as an array of their lanes, which needs no more alignment than a Float does, where a vector would need its
+     * whole width.
+     */
+    llvm::Type* storageType(TypeToken& element) {
+        if (element.kind == TypeTokenKind::named) {
+            return mapTypes(element);
+        }
+
+        if (element.kind == TypeTokenKind::base) {
+            switch (((BaseTypeToken&) element).base) {
+                case BasicTypeTokenKind::Float:
+                    return llvm::Type::getDoubleTy(con);
+                case BasicTypeTokenKind::Int:
+                    return llvm::Type::getInt64Ty(con);
+                case BasicTypeTokenKind::Boolean:
+                case BasicTypeTokenKind::Unit:
+                    return llvm::Type::getInt8Ty(con);
+                case BasicTypeTokenKind::Float2:
+                    return llvm::ArrayType::get(llvm::Type::getDoubleTy(con), 2);
+                case BasicTypeTokenKind::Float4:
+                    return llvm::ArrayType::get(llvm::Type::getDoubleTy(con), 4);
+                case BasicTypeTokenKind::Float8:
+                    return llvm::ArrayType::get(llvm::Type::getDoubleTy(con), 8);
+            }
+        }
+
+        throw runtime_error("Unsupported list element type " + element.pretty());
+    }
+
+    llvm::Value* listInsertFunction(llvm::Type* elementType) {
+        if (elementType->isDoubleTy()) {
+            return lookupValue("mutableInsertArrayDouble");
+        } else if (elementType->isIntegerTy(64)) {
+            return lookupValue("mutableInsertArrayLong");
+        } else {
+            return lookupValue("mutableInsertArrayByte");
+        }
+    }
+
+    llvm::FunctionType* mapTypes(BasicFunctionTypeToken& token) {
+        vector<llvm::Type*> paramTypes;
+        paramTypes.reserve(token.params.size());
+
+        for (auto &param : token.params) {
+            paramTypes.push_back(mapTypes(*param));
+        }
+
+        return llvm::FunctionType::get(returnType(*token.result), paramTypes, false);
+    }
+
+    /**
+     * User functions return lists by value, see compileFunction.
+     */
+    llvm::Type* returnType(TypeToken& result) {
+        return isListType(result) ? types["arrayRefType"] : mapTypes(result);
+    }
+
+    /**
+     * Each record becomes a struct of its fields, and its constructor an always inlined function that fills one.
+     */
+    void declareRecords(Module* ex) {
+        for (auto &record : ex->records) {
+            records[record->id] = record.get();
+            types[record->id] = llvm::StructType::create(con, record->id);
+        }
+
+        for (auto &record : ex->records) {
+            auto structType = (llvm::StructType *) types[record->id];
+            vector<llvm::Type*> fieldTypes;
+
+            for (auto &fieldType : record->fieldTypes) {
+                fieldTypes.push_back(mapTypes(*fieldType));
+            }
+
+            structType->setBody(fieldTypes);
+
+            auto constructor = llvm::Function::Create(llvm::FunctionType::get(structType, fieldTypes, false), llvm::Function::InternalLinkage, record->id, &mod);
+            constructor->addFnAttr(llvm::Attribute::AlwaysInline);
+            builder.SetInsertPoint(llvm::BasicBlock::Create(con, "body", constructor));
+
+            llvm::Value *value = llvm::UndefValue::get(structType);
+
+            for (auto &arg : constructor->args()) {
+                arg.setName(record->fields[arg.getArgNo()]);
+                value = builder.CreateInsertValue(value, &arg, arg.getArgNo());
+            }
+
+            builder.CreateRet(value);
+            contextStack.front()[record->id] = constructor;
+        }
+    }
+
+    void setupLibrary() {
+        map<string, llvm::Value*> context;
+
+        auto voidType = llvm::Type::getVoidTy(con);
+        auto intType = llvm::IntegerType::get(con, 32);
+
+        auto bytePointerType = llvm::PointerType::getInt8PtrTy(con);
+        types["closureType"] = llvm::StructType::create(con, { bytePointerType, bytePointerType }, "Closure");
+
+        llvm::ArrayRef<llvm::Type *> arrayRefMembers = {llvm::PointerType::getInt8PtrTy(con), intType, intType, intType, intType, bytePointerType};
+        auto arrayRefType = llvm::StructType::create(con, arrayRefMembers, "ArrayRef");
+        auto arrayRefPointerType = llvm::PointerType::get(arrayRefType, 0);
+        types["arrayRefType"] = arrayRefType;
+        types["arrayRefPointerType"] = arrayRefPointerType;
+
+        llvm::ArrayRef<llvm::Type *> args = {llvm::Type::getDoubleTy(con)};
+        auto printdType = llvm::FunctionType::get(voidType, args, false);
+        mod.getOrInsertFunction("printd", printdType);
+        context["printd"] = mod.getFunction("printd");
+
+        llvm::ArrayRef<llvm::Type *> printdsArgs = { arrayRefPointerType };
+        auto printdsType = llvm::FunctionType::get(voidType, printdsArgs, false);
+        mod.getOrInsertFunction("printds", printdsType);
+        context["printds"] = mod.getFunction("printds");
+
+        mod.getOrInsertFunction("printis", printdsType);
+        context["printis"] = mod.getFunction("printis");
+
+        mod.getOrInsertFunction("printbs", printdsType);
+        context["printbs"] = mod.getFunction("printbs");
+
+
+        llvm::ArrayRef<llvm::Type*> createArrayArgs = { arrayRefPointerType, intType, intType, intType};
+        auto createArrayType = llvm::FunctionType::get(voidType, createArrayArgs, false);
+        mod.getOrInsertFunction("createArray", createArrayType);
+        context["createArray"] = mod.getFunction("createArray");
+
+        llvm::ArrayRef<llvm::Type*> destroyArrayArgs = { arrayRefPointerType };
+        auto destroyArrayType = llvm::FunctionType::get(voidType, destroyArrayArgs, false);
+        mod.getOrInsertFunction("destroyArray", destroyArrayType);
+        context["destroyArray"] = mod.getFunction("destroyArray");
+
+        mod.getOrInsertFunction("retainArray", destroyArrayType);
+        context["retainArray"] = mod.getFunction("retainArray");
+
+        mod.getOrInsertFunction("shrinkArray", destroyArrayType);
+        context["shrinkArray"] = mod.getFunction("shrinkArray");
+
+        llvm::ArrayRef<llvm::Type*> mutableInsertArrayDoubleArgs = { arrayRefPointerType, intType, llvm::Type::getDoubleTy(con) };
+        auto mutableInsertArrayDoubleType = llvm::FunctionType::get(voidType, mutableInsertArrayDoubleArgs, false);
+        mod.getOrInsertFunction("mutableInsertArrayDouble", mutableInsertArrayDoubleType);
+        context["mutableInsertArrayDouble"] = mod.getFunction("mutableInsertArrayDouble");
+
+        auto longInsertType = llvm::FunctionType::get(voidType, { arrayRefPointerType, intType, llvm::Type::getInt64Ty(con) }, false);
+        mod.getOrInsertFunction("mutableInsertArrayLong", longInsertType);
+        context["mutableInsertArrayLong"] = mod.getFunction("mutableInsertArrayLong");
+
+        auto byteInsertType = llvm::FunctionType::get(voidType, { arrayRefPointerType, intType, llvm::Type::getInt8Ty(con) }, false);
+        mod.getOrInsertFunction("mutableInsertArrayByte", byteInsertType);
+        context["mutableInsertArrayByte"] = mod.getFunction("mutableInsertArrayByte");
+
+        auto doubleType = llvm::Type::getDoubleTy(con);
+        auto longType = llvm::Type::getInt64Ty(con);
+
+        auto printiType = llvm::FunctionType::get(voidType, { longType }, false);
+        mod.getOrInsertFunction("printi", printiType);
+        context["printi"] = mod.getFunction("printi");
+
+        // Conversions are single instructions, defined here so that LLVM always inlines them.
+        auto toIntType = llvm::FunctionType::get(longType, { doubleType }, false);
+        auto toInt = llvm::Function::Create(toIntType, llvm::Function::InternalLinkage, "toInt", &mod);
+        toInt->addFnAttr(llvm::Attribute::AlwaysInline);
+        builder.SetInsertPoint(llvm::BasicBlock::Create(con, "body", toInt));
+        builder.CreateRet(builder.CreateFPToSI(&*toInt->arg_begin(), longType, "intTemp"));
+        context["toInt"] = toInt;
+
+        auto toFloatType = llvm::FunctionType::get(doubleType, { longType }, false);
+        auto toFloat = llvm::Function::Create(toFloatType, llvm::Function::InternalLinkage, "toFloat", &mod);
+        toFloat->addFnAttr(llvm::Attribute::AlwaysInline);
+        builder.SetInsertPoint(llvm::BasicBlock::Create(con, "body", toFloat));
+        builder.CreateRet(builder.CreateSIToFP(&*toFloat->arg_begin(), doubleType, "floatTemp"));
+        context["toFloat"] = toFloat;
+
+        // Outside of a branch condition the hints still reach LLVM through llvm.expect.
+        auto boolType = llvm::Type::getInt1Ty(con);
+        auto expect = llvm::Intrinsic::getDeclaration(&mod, llvm::Intrinsic::expect, { boolType });
+        auto hintType = llvm::FunctionType::get(boolType, { boolType }, false);
+
+        for (auto &hint : { make_pair("likely", true), make_pair("unlikely", false) }) {
+            auto hintFunc = llvm::Function::Create(hintType, llvm::Function::InternalLinkage, hint.first, &mod);
+            hintFunc->addFnAttr(llvm::Attribute::AlwaysInline);
+            builder.SetInsertPoint(llvm::BasicBlock::Create(con, "body", hintFunc));
+            auto expected = hint.second ? llvm::ConstantInt::getTrue(con) : llvm::ConstantInt::getFalse(con);
+            builder.CreateRet(builder.CreateCall(expect, { &*hintFunc->arg_begin(), expected }));
+            context[hint.first] = hintFunc;
+        }
+
+        auto vectorType = llvm::StructType::create(con, "PersistentVector");
+        auto vectorPointerType = llvm::PointerType::get(vectorType, 0);
+        types["vectorPointerType"] = vectorPointerType;
+
+        auto vectorFromArrayType = llvm::FunctionType::get(vectorPointerType, { arrayRefPointerType }, false);
+        mod.getOrInsertFunction("vectorFromArray", vectorFromArrayType);
+        context["vector"] = mod.getFunction("vectorFromArray");
+
+        auto vectorToArrayType = llvm::FunctionType::get(voidType, { arrayRefPointerType, vectorPointerType }, false);
+        mod.getOrInsertFunction("vectorToArray", vectorToArrayType);
+        context["toList"] = mod.getFunction("vectorToArray");
+        listResultFunctions.insert(context["toList"]);
+
+        auto vectorAppendType = llvm::FunctionType::get(vectorPointerType, { vectorPointerType, doubleType }, false);
+        mod.getOrInsertFunction("vectorAppend", vectorAppendType);
+        context["append"] = mod.getFunction("vectorAppend");
+
+        auto vectorSetType = llvm::FunctionType::get(vectorPointerType, { vectorPointerType, longType, doubleType }, false);
+        mod.getOrInsertFunction("vectorSet", vectorSetType);
+        context["set"] = mod.getFunction("vectorSet");
+
+        auto vectorGetType = llvm::FunctionType::get(doubleType, { vectorPointerType, longType }, false);
+        mod.getOrInsertFunction("vectorGet", vectorGetType);
+        context["get"] = mod.getFunction("vectorGet");
+
+        auto vectorSizeType = llvm::FunctionType::get(longType, { vectorPointerType }, false);
+        mod.getOrInsertFunction("vectorSize", vectorSizeType);
+        context["count"] = mod.getFunction("vectorSize");
+
+        auto vectorRetainType = llvm::FunctionType::get(voidType, { vectorPointerType }, false);
+        mod.getOrInsertFunction("vectorRetain", vectorRetainType);
+        context["vectorRetain"] = mod.getFunction("vectorRetain");
+
+        mod.getOrInsertFunction("vectorRelease", vectorRetainType);
+        context["vectorRelease"] = mod.getFunction("vectorRelease");
+
+        // Kernels over Float lists, vectorised in the runtime.
+        auto listReduceType = llvm::FunctionType::get(doubleType, { arrayRefPointerType }, false);
+
+        for (auto &kernel : { make_pair("sum", "listSum"), make_pair("min", "listMin"), make_pair("max", "listMax") }) {
+            mod.getOrInsertFunction(kernel.second, listReduceType);
+            context[kernel.first] = mod.getFunction(kernel.second);
+        }
+
+        auto listDotType = llvm::FunctionType::get(doubleType, { arrayRefPointerType, arrayRefPointerType }, false);
+        mod.getOrInsertFunction("listDot", listDotType);
+        context["dot"] = mod.getFunction("listDot");
+
+        auto listScalarType = llvm::FunctionType::get(voidType, { arrayRefPointerType, arrayRefPointerType, doubleType }, false);
+
+        for (auto &kernel : { make_pair("scale", "listScale"), make_pair("offset", "listOffset") }) {
+            mod.getOrInsertFunction(kernel.second, listScalarType);
+            context[kernel.first] = mod.getFunction(kernel.second);
+            listResultFunctions.insert(context[kernel.first]);
+        }
+
+        auto listPairType = llvm::FunctionType::get(voidType, { arrayRefPointerType, arrayRefPointerType, arrayRefPointerType }, false);
+
+        for (auto &kernel : { make_pair("add", "listAdd"), make_pair("mul", "listMul") }) {
+            mod.getOrInsertFunction(kernel.second, listPairType);
+            context[kernel.first] = mod.getFunction(kernel.second);
+            listResultFunctions.insert(context[kernel.first]);
+        }
+
+        auto listPrefixSumType = llvm::FunctionType::get(voidType, { arrayRefPointerType, arrayRefPointerType }, false);
+        mod.getOrInsertFunction("listPrefixSum", listPrefixSumType);
+        context["prefixSum"] = mod.getFunction("listPrefixSum");
+        listResultFunctions.insert(context["prefixSum"]);
+
+        // Lists read from the files named by program arguments. mapFloats shares the file's pages rather than copying.
+        auto mapFloatsType = llvm::FunctionType::get(voidType, { arrayRefPointerType, longType }, false);
+        mod.getOrInsertFunction("mapFloats", mapFloatsType);
+        context["mapFloats"] = mod.getFunction("mapFloats");
+        listResultFunctions.insert(context["mapFloats"]);
+
+        auto readCsvColumnType = llvm::FunctionType::get(voidType, { arrayRefPointerType, longType, longType }, false);
+        mod.getOrInsertFunction("readCsvColumn", readCsvColumnType);
+        context["readCsvColumn"] = mod.getFunction("readCsvColumn");
+        listResultFunctions.insert(context["readCsvColumn"]);
+
+        // Runs body over ranges of [start, end) on the runtime's work-stealing pool and returns once all are done.
+        auto rangeBodyType = llvm::FunctionType::get(voidType, { bytePointerType, longType, longType }, false);
+        auto parallelForType = llvm::FunctionType::get(voidType, { longType, longType, longType, llvm::PointerType::get(rangeBodyType, 0), bytePointerType }, false);
+        mod.getOrInsertFunction("parallelFor", parallelForType);
+        context["parallelFor"] = mod.getFunction("parallelFor");
+
+        // Runs one body as a task, the returned handle is passed to joinTask to wait for it.
+        auto spawnTaskType = llvm::FunctionType::get(bytePointerType, { llvm::PointerType::get(rangeBodyType, 0), bytePointerType }, false);
+        mod.getOrInsertFunction("spawnTask", spawnTaskType);
+        context["spawnTask"] = mod.getFunction("spawnTask");
+
+        auto joinTaskType = llvm::FunctionType::get(voidType, { bytePointerType }, false);
+        mod.getOrInsertFunction("joinTask", joinTaskType);
+        context["joinTask"] = mod.getFunction("joinTask");
+
+        // Reports an index outside its list and exits.
+        auto indexOutOfBoundsType = llvm::FunctionType::get(voidType, { longType, longType, intType, intType }, false);
+        mod.getOrInsertFunction("indexOutOfBounds", indexOutOfBoundsType);
+        context["indexOutOfBounds"] = mod.getFunction("indexOutOfBounds");
+        mod.getFunction("indexOutOfBounds")->addFnAttr(llvm::Attribute::NoReturn);
+        mod.getFunction("indexOutOfBounds")->addFnAttr(llvm::Attribute::Cold);
+
+        // Reports an Int division by zero and exits.
+        auto divideByZeroType = llvm::FunctionType::get(voidType, { intType, intType }, false);
+        mod.getOrInsertFunction("divideByZero", divideByZeroType);
+        context["divideByZero"] = mod.getFunction("divideByZero");
+        mod.getFunction("divideByZero")->addFnAttr(llvm::Attribute::NoReturn);
+        mod.getFunction("divideByZero")->addFnAttr(llvm::Attribute::Cold);
+
+        auto sliceOutOfBoundsType = llvm::FunctionType::get(voidType, { longType, longType, longType, intType, intType }, false);
+        mod.getOrInsertFunction("sliceOutOfBounds", sliceOutOfBoundsType);
+        context["sliceOutOfBounds"] = mod.getFunction("sliceOutOfBounds");
+        mod.getFunction("sliceOutOfBounds")->addFnAttr(llvm::Attribute::NoReturn);
+        mod.getFunction("sliceOutOfBounds")->addFnAttr(llvm::Attribute::Cold);
+
+        auto memoTableType = llvm::StructType::create(con, "MemoTable");
+        auto memoTablePointerType = llvm::PointerType::get(memoTableType, 0);
+        types["memoTablePointerType"] = memoTablePointerType;
+
+        auto memoTableRefType = llvm::PointerType::get(memoTablePointerType, 0);
+        auto wordPointerType = llvm::PointerType::get(longType, 0);
+
+        auto memoLookupType = llvm::FunctionType::get(intType, { memoTableRefType, intType, wordPointerType, wordPointerType }, false);
+        mod.getOrInsertFunction("memoLookup", memoLookupType);
+        context["memoLookup"] = mod.getFunction("memoLookup");
+
+        auto memoStoreType = llvm::FunctionType::get(voidType, { memoTableRefType, intType, wordPointerType, longType }, false);
+        mod.getOrInsertFunction("memoStore", memoStoreType);
+        context["memoStore"] = mod.getFunction("memoStore");
+
+        contextStack.clear();
+        contextStack.push_back(move(context));
+    }
+
+};
+
 
+void compile(const std::string &dest, Module *mod, const CompilerOptions &options) {
+    markSafeIndexes(*mod);
+    convertClosures(*mod);
+    markTailCalls(*mod);
+    markParallelLets(*mod);
 
-void compile(const std::string &dest, Module *mod) {
-    Compiler compiler;
+    Compiler compiler(options);
     compiler.compileModule(mod);
     compiler.output(dest);
 }
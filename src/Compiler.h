@@ -7,6 +7,20 @@
 
 #include "Ast.h"
 
-void compile(const std::string &dest, Module *mod);
+struct CompilerOptions {
+    /**
+     * Treat the module as the whole program. Functions that main can't reach are not compiled and everything else
+     * but main gets internal linkage, which leaves LLVM free to change their signatures.
+     */
+    bool wholeProgram = false;
+
+    /**
+     * Check list indexes against the size of the list at runtime. Turning this off leaves an out of range index
+     * undefined, which is only meant for measuring what the checks cost.
+     */
+    bool checkBounds = true;
+};
+
+void compile(const std::string &dest, Module *mod, const CompilerOptions &options = CompilerOptions());
 
 #endif //TYPEDLETLANG_COMPILER_H
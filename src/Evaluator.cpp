@@ -0,0 +1,475 @@
+#include "Evaluator.h"
+#include "CallGraph.h"
+#include "Utils.h"
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+/**
+ * A value produced at compile time. Only the basic types are supported since only they have literals.
+ */
+struct Constant {
+    BasicTypeTokenKind kind;
+    double floatValue = 0;
+    int64_t intValue = 0;
+    bool boolValue = false;
+};
+
+class CannotEvaluate : public runtime_error {
+public:
+    explicit CannotEvaluate(const string &reason) : runtime_error(reason) {}
+};
+
+/**
+ * Runs calls to pure module functions whose arguments are all literals and replaces them with their result. A
+ * function is pure when it can't reach the printing runtime. Each call site gets a fixed budget of steps and call
+ * depth, so a call that never returns only costs compile time up to that point.
+ */
+class Evaluator {
+
+    // Expressions evaluated for a single call site before giving up.
+    const int maxSteps = 1000000;
+    // How deep calls may nest while evaluating a single call site.
+    const int maxDepth = 256;
+    // Library functions that are also worth running on their own.
+    const set<string> conversionFunctions = {"toInt", "toFloat"};
+
+    CallGraph graph;
+    set<string> impure;
+    set<string> locals;
+    // Results of memoized functions, shared by every call site since they are pure.
+    map<string, map<vector<int64_t>, Constant>> memoResults;
+    int steps = 0;
+    int depth = 0;
+
+public:
+    explicit Evaluator(Module &module) : graph(module) {
+        for (auto &fun : module.functions) {
+            if (!graph.reachableEffect(fun->id).empty()) {
+                impure.insert(fun->id);
+            }
+        }
+    }
+
+    /**
+     * The literal op gives for two number literals, computed the same way as the generated code, or null when that is
+     * left for runtime.
+     */
+    static unique_ptr<Expression> foldLiterals(const string &op, NumberLiteral &left, NumberLiteral &right, const Location &location) {
+        try {
+            auto result = BaseTypeToken(BasicTypeTokenKind::Int) == left.type()
+                          ? evaluateIntOp(op, left.intValue, right.intValue)
+                          : evaluateFloatOp(op, left.value, right.value);
+
+            return toLiteral(result, location);
+        } catch (CannotEvaluate &e) {
+            return nullptr;
+        }
+    }
+
+    void run(Module &module) {
+        for (auto &fun : module.functions) {
+            locals.clear();
+            locals.insert(fun->params.begin(), fun->params.end());
+            collectBindings(*fun->body, locals);
+            visit(fun->body);
+        }
+    }
+
+private:
+    void visit(unique_ptr<Expression> &expression) {
+        switch (expression->kind) {
+            case ExpressionKind::assignment:
+                visit(((Assignment &) *expression).body);
+                break;
+            case ExpressionKind::function:
+                visit(((Function &) *expression).body);
+                break;
+            case ExpressionKind::call: {
+                auto &ex = (Call &) *expression;
+                visit(ex.source);
+
+                for (auto &arg : ex.args) {
+                    visit(arg);
+                }
+
+                tryEvaluate(expression);
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) *expression;
+                visit(ex.condition);
+                visit(ex.thenEx);
+                visit(ex.elseEx);
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) *expression;
+                visit(ex.left);
+                visit(ex.right);
+                break;
+            }
+            case ExpressionKind::block:
+                for (auto &next : ((Block &) *expression).body) {
+                    visit(next);
+                }
+                break;
+            case ExpressionKind::fieldAccess:
+                visit(((FieldAccess &) *expression).object);
+                break;
+            case ExpressionKind::indexAccess:
+                visit(((IndexAccess &) *expression).list);
+                visit(((IndexAccess &) *expression).index);
+                break;
+            case ExpressionKind::listLiteral:
+                for (auto &next : ((ListLiteral &) *expression).values) {
+                    visit(next);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    void tryEvaluate(unique_ptr<Expression> &expression) {
+        auto &ex = (Call &) *expression;
+
+        if (ex.source->kind != ExpressionKind::variable) {
+            return;
+        }
+
+        auto id = ((Variable &) *ex.source).id;
+        bool known = graph.lookup(id) != nullptr || conversionFunctions.count(id) == 1;
+
+        if (!known || locals.count(id) == 1 || impure.count(id) == 1 || !hasLiteralType(ex)) {
+            return;
+        }
+
+        for (auto &arg : ex.args) {
+            if (arg->kind != ExpressionKind::numberLiteral && arg->kind != ExpressionKind::booleanLiteral) {
+                return;
+            }
+        }
+
+        steps = 0;
+        depth = 0;
+
+        try {
+            map<string, Constant> empty;
+            auto result = evaluateCall(ex, empty);
+            auto replacement = toLiteral(result, ex.loc());
+
+            if (conversionFunctions.count(id) == 0) {
+                println("Evaluated " + id + " at " + ex.loc().pretty());
+            }
+
+            expression = move(replacement);
+        } catch (CannotEvaluate &e) {
+            println("Not evaluating " + id + " at " + ex.loc().pretty() + ": " + e.what());
+        }
+    }
+
+    static bool hasLiteralType(Expression &ex) {
+        return BaseTypeToken(BasicTypeTokenKind::Float) == ex.type()
+               || BaseTypeToken(BasicTypeTokenKind::Int) == ex.type()
+               || BaseTypeToken(BasicTypeTokenKind::Boolean) == ex.type();
+    }
+
+    Constant call(Function &func, vector<Constant> &args) {
+        if (++depth > maxDepth) {
+            throw CannotEvaluate("recursion limit reached");
+        }
+
+        vector<int64_t> key;
+
+        if (func.memo) {
+            for (auto &arg : args) {
+                key.push_back(toWord(arg));
+            }
+
+            auto found = memoResults[func.id].find(key);
+
+            if (found != memoResults[func.id].end()) {
+                depth--;
+                return found->second;
+            }
+        }
+
+        map<string, Constant> frame;
+
+        for (size_t i = 0; i < args.size(); i++) {
+            frame[func.params[i]] = args[i];
+        }
+
+        auto result = evaluate(*func.body, frame);
+
+        if (func.memo) {
+            memoResults[func.id][key] = result;
+        }
+
+        depth--;
+        return result;
+    }
+
+    /**
+     * Names are unique within a function, so a single frame per call covers every block inside it.
+     */
+    Constant evaluate(Expression &expression, map<string, Constant> &frame) {
+        if (++steps > maxSteps) {
+            throw CannotEvaluate("out of fuel");
+        }
+
+        switch (expression.kind) {
+            case ExpressionKind::numberLiteral: {
+                auto &ex = (NumberLiteral &) expression;
+
+                if (BaseTypeToken(BasicTypeTokenKind::Int) == ex.type()) {
+                    return makeInt(ex.intValue);
+                } else {
+                    return makeFloat(ex.value);
+                }
+            }
+            case ExpressionKind::booleanLiteral:
+                return makeBoolean(((BooleanLiteral &) expression).value);
+            case ExpressionKind::nullLiteral:
+                return Constant{BasicTypeTokenKind::Unit};
+            case ExpressionKind::variable: {
+                auto &ex = (Variable &) expression;
+                auto found = frame.find(ex.id);
+
+                if (found == frame.end()) {
+                    throw CannotEvaluate("uses " + ex.id + " as a value");
+                }
+
+                return found->second;
+            }
+            case ExpressionKind::assignment: {
+                auto &ex = (Assignment &) expression;
+                frame[ex.id] = evaluate(*ex.body, frame);
+                return Constant{BasicTypeTokenKind::Unit};
+            }
+            case ExpressionKind::block: {
+                Constant last{BasicTypeTokenKind::Unit};
+
+                for (auto &next : ((Block &) expression).body) {
+                    last = evaluate(*next, frame);
+                }
+
+                return last;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+
+                if (evaluate(*ex.condition, frame).boolValue) {
+                    return evaluate(*ex.thenEx, frame);
+                } else {
+                    return evaluate(*ex.elseEx, frame);
+                }
+            }
+            case ExpressionKind::binaryOp:
+                return evaluateBinaryOp((BinaryOp &) expression, frame);
+            case ExpressionKind::call:
+                return evaluateCall((Call &) expression, frame);
+            default:
+                throw CannotEvaluate("unsupported expression");
+        }
+    }
+
+    Constant evaluateCall(Call &ex, map<string, Constant> &frame) {
+        if (ex.source->kind != ExpressionKind::variable) {
+            throw CannotEvaluate("calls a function value");
+        }
+
+        auto id = ((Variable &) *ex.source).id;
+        vector<Constant> args;
+
+        for (auto &arg : ex.args) {
+            args.push_back(evaluate(*arg, frame));
+        }
+
+        if (id == "likely" || id == "unlikely") {
+            return args[0];
+        }
+
+        if (id == "toFloat") {
+            return makeFloat((double) args[0].intValue);
+        }
+
+        if (id == "toInt") {
+            auto value = args[0].floatValue;
+
+            // Out of range conversions are undefined at runtime.
+            if (!(value > -9223372036854775808.0 && value < 9223372036854775808.0)) {
+                throw CannotEvaluate("converts an out of range Float");
+            }
+
+            return makeInt((int64_t) value);
+        }
+
+        auto callee = graph.lookup(id);
+
+        if (callee == nullptr || frame.count(id) == 1) {
+            throw CannotEvaluate("calls " + id);
+        }
+
+        if (impure.count(id) == 1) {
+            throw CannotEvaluate("calls " + id + " which has effects");
+        }
+
+        return call(*callee, args);
+    }
+
+    Constant evaluateBinaryOp(BinaryOp &ex, map<string, Constant> &frame) {
+        auto &op = ex.op;
+        auto left = evaluate(*ex.left, frame);
+
+        if (op == "&&" || op == "||") {
+            if (left.boolValue == (op == "||")) {
+                return left;
+            }
+
+            return evaluate(*ex.right, frame);
+        }
+
+        auto right = evaluate(*ex.right, frame);
+
+        if (left.kind == BasicTypeTokenKind::Int) {
+            return evaluateIntOp(op, left.intValue, right.intValue);
+        } else {
+            return evaluateFloatOp(op, left.floatValue, right.floatValue);
+        }
+    }
+
+    static Constant evaluateFloatOp(const string &op, double left, double right) {
+        if (op == "+") {
+            return makeFloat(left + right);
+        } else if (op == "-") {
+            return makeFloat(left - right);
+        } else if (op == "*") {
+            return makeFloat(left * right);
+        } else if (op == "/") {
+            return makeFloat(left / right);
+        } else if (op == "%") {
+            return makeFloat(fmod(left, right));
+        } else if (op == "==") {
+            return makeBoolean(left == right);
+        } else if (op == "!=") {
+            // Ordered like the generated code, so NaN is not unequal to anything.
+            return makeBoolean(left < right || left > right);
+        } else if (op == ">=") {
+            return makeBoolean(left >= right);
+        } else if (op == ">") {
+            return makeBoolean(left > right);
+        } else if (op == "<") {
+            return makeBoolean(left < right);
+        } else if (op == "<=") {
+            return makeBoolean(left <= right);
+        } else {
+            throw CannotEvaluate("unsupported operator " + op);
+        }
+    }
+
+    static Constant evaluateIntOp(const string &op, int64_t left, int64_t right) {
+        // Arithmetic wraps like the generated code, going through unsigned to keep it defined here.
+        auto uleft = (uint64_t) left;
+        auto uright = (uint64_t) right;
+
+        if (op == "+") {
+            return makeInt((int64_t) (uleft + uright));
+        } else if (op == "-") {
+            return makeInt((int64_t) (uleft - uright));
+        } else if (op == "*") {
+            return makeInt((int64_t) (uleft * uright));
+        } else if (op == "/" || op == "%") {
+            // Dividing by zero stops the program, which is left for runtime to report.
+            if (right == 0) {
+                throw CannotEvaluate("divides by zero");
+            }
+
+            // Only INT64_MIN / -1 overflows, it wraps to itself and leaves no remainder.
+            if (right == -1) {
+                return makeInt(op == "/" ? (int64_t) (0 - uleft) : 0);
+            }
+
+            return makeInt(op == "/" ? left / right : left % right);
+        } else if (op == "<<" || op == ">>") {
+            // Shift amounts are taken modulo 64.
+            auto amount = right & 63;
+
+            return makeInt(op == "<<" ? (int64_t) (uleft << amount) : left >> amount);
+        } else if (op == "==") {
+            return makeBoolean(left == right);
+        } else if (op == "!=") {
+            return makeBoolean(left != right);
+        } else if (op == ">=") {
+            return makeBoolean(left >= right);
+        } else if (op == ">") {
+            return makeBoolean(left > right);
+        } else if (op == "<") {
+            return makeBoolean(left < right);
+        } else if (op == "<=") {
+            return makeBoolean(left <= right);
+        } else {
+            throw CannotEvaluate("unsupported operator " + op);
+        }
+    }
+
+    static unique_ptr<Expression> toLiteral(Constant &value, const Location &location) {
+        switch (value.kind) {
+            case BasicTypeTokenKind::Float:
+                return make_unique<NumberLiteral>(location, value.floatValue, false);
+            case BasicTypeTokenKind::Int:
+                return make_unique<NumberLiteral>(location, value.intValue);
+            case BasicTypeTokenKind::Boolean:
+                return make_unique<BooleanLiteral>(location, value.boolValue);
+            default:
+                throw CannotEvaluate("result has no literal");
+        }
+    }
+
+    /**
+     * The same 64 bit word the runtime memo table keys on.
+     */
+    static int64_t toWord(Constant &value) {
+        switch (value.kind) {
+            case BasicTypeTokenKind::Float: {
+                int64_t word;
+                memcpy(&word, &value.floatValue, sizeof(word));
+                return word;
+            }
+            case BasicTypeTokenKind::Boolean:
+                return value.boolValue ? 1 : 0;
+            default:
+                return value.intValue;
+        }
+    }
+
+    static Constant makeFloat(double value) {
+        Constant result{BasicTypeTokenKind::Float};
+        result.floatValue = value;
+        return result;
+    }
+
+    static Constant makeInt(int64_t value) {
+        Constant result{BasicTypeTokenKind::Int};
+        result.intValue = value;
+        return result;
+    }
+
+    static Constant makeBoolean(bool value) {
+        Constant result{BasicTypeTokenKind::Boolean};
+        result.boolValue = value;
+        return result;
+    }
+
+};
+
+void evaluateConstants(Module &module) {
+    Evaluator evaluator(module);
+    evaluator.run(module);
+}
+
+unique_ptr<Expression> foldLiterals(const string &op, NumberLiteral &left, NumberLiteral &right, const Location &location) {
+    return Evaluator::foldLiterals(op, left, right, location);
+}
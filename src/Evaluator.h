@@ -0,0 +1,10 @@
+#ifndef TYPEDLETLANG_EVALUATOR_H
+#define TYPEDLETLANG_EVALUATOR_H
+
+#include "Ast.h"
+
+void evaluateConstants(Module &module);
+
+std::unique_ptr<Expression> foldLiterals(const std::string &op, NumberLiteral &left, NumberLiteral &right, const Location &location);
+
+#endif //TYPEDLETLANG_EVALUATOR_H
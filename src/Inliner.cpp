@@ -0,0 +1,348 @@
+#include "Inliner.h"
+#include "CallGraph.h"
+#include "Utils.h"
+
+using namespace std;
+
+/**
+ * Replaces calls to small non-recursive module functions with a block that binds the arguments and then runs a copy
+ * of the body. Parameters and lets of the copy get fresh names so they can't capture anything at the call site, and a
+ * call is left alone when the caller binds a name the body reads from outside.
+ */
+class Inliner {
+
+    // Largest body, counted in expression nodes, that is copied into its callers.
+    const int maxInlineCost = 16;
+
+    CallGraph graph;
+    Function *current = nullptr;
+    set<string> locals;
+    int renameCounter = 0;
+
+public:
+    explicit Inliner(Module &module) : graph(module) {
+
+    }
+
+    void run() {
+        // Callees go first, so that whatever was inlined into them is part of what gets copied.
+        for (auto func : graph.bottomUp()) {
+            current = func;
+            locals.clear();
+            locals.insert(func->params.begin(), func->params.end());
+            collectBindings(*func->body, locals);
+            visit(func->body);
+        }
+    }
+
+private:
+    void visit(unique_ptr<Expression> &expression) {
+        switch (expression->kind) {
+            case ExpressionKind::assignment:
+                visit(((Assignment &) *expression).body);
+                break;
+            case ExpressionKind::function:
+                visit(((Function &) *expression).body);
+                break;
+            case ExpressionKind::call: {
+                auto &ex = (Call &) *expression;
+                visit(ex.source);
+
+                for (auto &arg : ex.args) {
+                    visit(arg);
+                }
+
+                tryInline(expression);
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) *expression;
+                visit(ex.condition);
+                visit(ex.thenEx);
+                visit(ex.elseEx);
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) *expression;
+                visit(ex.left);
+                visit(ex.right);
+                break;
+            }
+            case ExpressionKind::block:
+                for (auto &next : ((Block &) *expression).body) {
+                    visit(next);
+                }
+                break;
+            case ExpressionKind::fieldAccess:
+                visit(((FieldAccess &) *expression).object);
+                break;
+            case ExpressionKind::indexAccess:
+                visit(((IndexAccess &) *expression).list);
+                visit(((IndexAccess &) *expression).index);
+                break;
+            case ExpressionKind::listLiteral:
+                for (auto &next : ((ListLiteral &) *expression).values) {
+                    visit(next);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    void tryInline(unique_ptr<Expression> &expression) {
+        auto &ex = (Call &) *expression;
+
+        if (ex.source->kind != ExpressionKind::variable) {
+            return;
+        }
+
+        auto id = ((Variable &) *ex.source).id;
+        auto callee = graph.lookup(id);
+
+        // Either a library function or a local that shadows a module function.
+        if (callee == nullptr || locals.count(id) == 1) {
+            return;
+        }
+
+        auto reason = rejectReason(*callee);
+
+        if (!reason.empty()) {
+            println("Not inlining " + id + " into " + current->id + ": " + reason);
+            return;
+        }
+
+        auto &funcType = (BasicFunctionTypeToken &) callee->type();
+        map<string, string> renames;
+
+        for (auto &param : callee->params) {
+            renames[param] = freshName(param);
+        }
+
+        auto inlined = cloneExpression(*callee->body);
+        set<string> freeNames;
+        rename(*inlined, renames, freeNames);
+
+        // The rest of the names the body reads are module functions and library functions, which a local of the
+        // caller with the same name would capture.
+        for (auto &name : freeNames) {
+            if (locals.count(name) == 1) {
+                println("Not inlining " + id + " into " + current->id + ": reads " + name + ", which " + current->id + " binds");
+                return;
+            }
+        }
+
+        vector<unique_ptr<Expression>> body;
+
+        for (size_t i = 0; i < callee->params.size(); i++) {
+            body.push_back(make_unique<Assignment>(ex.loc(), funcType.params[i]->clone(), renames[callee->params[i]], move(ex.args[i])));
+        }
+
+        body.push_back(move(inlined));
+
+        println("Inlined " + id + " into " + current->id + " at " + ex.loc().pretty());
+
+        expression = make_unique<Block>(ex.loc(), ex.type().clone(), move(body));
+    }
+
+    string rejectReason(Function &callee) {
+        if (callee.id == "main") {
+            return "entry point";
+        }
+
+        if (callee.memo) {
+            return "memoized";
+        }
+
+        if (&callee == current || graph.isRecursive(callee.id)) {
+            return "recursive";
+        }
+
+        if (containsFunction(*callee.body)) {
+            return "defines nested functions";
+        }
+
+        auto cost = inlineCost(*callee.body);
+
+        if (cost > maxInlineCost) {
+            return "too large (cost " + to_string(cost) + ")";
+        }
+
+        return "";
+    }
+
+    string freshName(const string &id) {
+        return id + "$" + to_string(++renameCounter);
+    }
+
+    /**
+     * Gives the parameters and lets of a copied body their fresh names, and adds every other name it reads to
+     * freeNames.
+     */
+    void rename(Expression &expression, map<string, string> &renames, set<string> &freeNames) {
+        switch (expression.kind) {
+            case ExpressionKind::assignment: {
+                auto &ex = (Assignment &) expression;
+                rename(*ex.body, renames, freeNames);
+
+                auto name = freshName(ex.id);
+                renames[ex.id] = name;
+                ex.id = name;
+                break;
+            }
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                rename(*ex.source, renames, freeNames);
+
+                for (auto &arg : ex.args) {
+                    rename(*arg, renames, freeNames);
+                }
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                rename(*ex.condition, renames, freeNames);
+                rename(*ex.thenEx, renames, freeNames);
+                rename(*ex.elseEx, renames, freeNames);
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                rename(*ex.left, renames, freeNames);
+                rename(*ex.right, renames, freeNames);
+                break;
+            }
+            case ExpressionKind::block:
+                for (auto &next : ((Block &) expression).body) {
+                    rename(*next, renames, freeNames);
+                }
+                break;
+            case ExpressionKind::variable: {
+                auto &ex = (Variable &) expression;
+
+                if (renames.find(ex.id) != renames.end()) {
+                    ex.id = renames[ex.id];
+                } else {
+                    freeNames.insert(ex.id);
+                }
+                break;
+            }
+            case ExpressionKind::fieldAccess:
+                rename(*((FieldAccess &) expression).object, renames, freeNames);
+                break;
+            case ExpressionKind::indexAccess:
+                rename(*((IndexAccess &) expression).list, renames, freeNames);
+                rename(*((IndexAccess &) expression).index, renames, freeNames);
+                break;
+            case ExpressionKind::listLiteral:
+                for (auto &next : ((ListLiteral &) expression).values) {
+                    rename(*next, renames, freeNames);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    bool containsFunction(Expression &expression) {
+        switch (expression.kind) {
+            case ExpressionKind::function:
+                return true;
+            case ExpressionKind::assignment:
+                return containsFunction(*((Assignment &) expression).body);
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                bool found = containsFunction(*ex.source);
+
+                for (auto &arg : ex.args) {
+                    found = found || containsFunction(*arg);
+                }
+
+                return found;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                return containsFunction(*ex.condition) || containsFunction(*ex.thenEx) || containsFunction(*ex.elseEx);
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                return containsFunction(*ex.left) || containsFunction(*ex.right);
+            }
+            case ExpressionKind::block:
+                for (auto &next : ((Block &) expression).body) {
+                    if (containsFunction(*next)) {
+                        return true;
+                    }
+                }
+                return false;
+            case ExpressionKind::fieldAccess:
+                return containsFunction(*((FieldAccess &) expression).object);
+            case ExpressionKind::indexAccess:
+                return containsFunction(*((IndexAccess &) expression).list) || containsFunction(*((IndexAccess &) expression).index);
+            case ExpressionKind::listLiteral:
+                for (auto &next : ((ListLiteral &) expression).values) {
+                    if (containsFunction(*next)) {
+                        return true;
+                    }
+                }
+                return false;
+            default:
+                return false;
+        }
+    }
+
+    int inlineCost(Expression &expression) {
+        switch (expression.kind) {
+            case ExpressionKind::assignment:
+                return 1 + inlineCost(*((Assignment &) expression).body);
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                int total = 1 + inlineCost(*ex.source);
+
+                for (auto &arg : ex.args) {
+                    total += inlineCost(*arg);
+                }
+
+                return total;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                return 1 + inlineCost(*ex.condition) + inlineCost(*ex.thenEx) + inlineCost(*ex.elseEx);
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                return 1 + inlineCost(*ex.left) + inlineCost(*ex.right);
+            }
+            case ExpressionKind::block: {
+                int total = 0;
+
+                for (auto &next : ((Block &) expression).body) {
+                    total += inlineCost(*next);
+                }
+
+                return total;
+            }
+            case ExpressionKind::fieldAccess:
+                return 1 + inlineCost(*((FieldAccess &) expression).object);
+            case ExpressionKind::indexAccess:
+                return 1 + inlineCost(*((IndexAccess &) expression).list) + inlineCost(*((IndexAccess &) expression).index);
+            case ExpressionKind::listLiteral: {
+                int total = 1;
+
+                for (auto &next : ((ListLiteral &) expression).values) {
+                    total += inlineCost(*next);
+                }
+
+                return total;
+            }
+            default:
+                return 1;
+        }
+    }
+
+};
+
+void inlineFunctions(Module &module) {
+    Inliner inliner(module);
+    inliner.run();
+}
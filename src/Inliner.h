@@ -0,0 +1,8 @@
+#ifndef TYPEDLETLANG_INLINER_H
+#define TYPEDLETLANG_INLINER_H
+
+#include "Ast.h"
+
+void inlineFunctions(Module &module);
+
+#endif //TYPEDLETLANG_INLINER_H
@@ -0,0 +1,395 @@
+#include "Optimizer.h"
+#include "Inliner.h"
+#include "Evaluator.h"
+#include "CommonSubexpressions.h"
+#include <algorithm>
+
+using namespace std;
+
+bool isLiteral(Expression &expression) {
+    return expression.kind == ExpressionKind::numberLiteral || expression.kind == ExpressionKind::booleanLiteral;
+}
+
+bool isIntLiteral(Expression &expression) {
+    return expression.kind == ExpressionKind::numberLiteral && BaseTypeToken(BasicTypeTokenKind::Int) == expression.type();
+}
+
+/**
+ * Copies a literal or variable read to a new location.
+ */
+unique_ptr<Expression> copyValue(Expression &literal, Location location) {
+    if (literal.kind == ExpressionKind::variable) {
+        return make_unique<Variable>(move(location), ((Variable &) literal).id, literal.type().clone());
+    }
+
+    if (literal.kind == ExpressionKind::booleanLiteral) {
+        return make_unique<BooleanLiteral>(move(location), ((BooleanLiteral &) literal).value);
+    }
+
+    auto &number = (NumberLiteral &) literal;
+    auto result = make_unique<NumberLiteral>(move(location), number.value, number.integral);
+    result->fitsInt = number.fitsInt;
+    result->intValue = number.intValue;
+    result->_type = number.type().clone();
+    return result;
+}
+
+/**
+ * Does the expression do anything besides produce its value? Calls might print, so they always count.
+ */
+bool hasSideEffects(Expression &expression) {
+    switch (expression.kind) {
+        case ExpressionKind::assignment:
+            return hasSideEffects(*((Assignment &) expression).body);
+        case ExpressionKind::ifEx: {
+            auto &ex = (If &) expression;
+            return hasSideEffects(*ex.condition) || hasSideEffects(*ex.thenEx) || hasSideEffects(*ex.elseEx);
+        }
+        case ExpressionKind::binaryOp: {
+            auto &ex = (BinaryOp &) expression;
+            return hasSideEffects(*ex.left) || hasSideEffects(*ex.right);
+        }
+        case ExpressionKind::block: {
+            for (auto &next : ((Block &) expression).body) {
+                if (hasSideEffects(*next)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        case ExpressionKind::fieldAccess:
+            return hasSideEffects(*((FieldAccess &) expression).object);
+        case ExpressionKind::listLiteral: {
+            for (auto &next : ((ListLiteral &) expression).values) {
+                if (hasSideEffects(*next)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        case ExpressionKind::variable:
+        case ExpressionKind::numberLiteral:
+        case ExpressionKind::booleanLiteral:
+        case ExpressionKind::nullLiteral:
+            return false;
+        default:
+            return true;
+    }
+}
+
+/**
+ * Counts references to a name, including ones that are shadowed. Overcounting only keeps a binding alive.
+ */
+int countUses(Expression &expression, const string &id) {
+    switch (expression.kind) {
+        case ExpressionKind::assignment:
+            return countUses(*((Assignment &) expression).body, id);
+        case ExpressionKind::function:
+            return countUses(*((Function &) expression).body, id);
+        case ExpressionKind::call: {
+            auto &ex = (Call &) expression;
+            int total = countUses(*ex.source, id);
+
+            for (auto &arg : ex.args) {
+                total += countUses(*arg, id);
+            }
+
+            return total;
+        }
+        case ExpressionKind::ifEx: {
+            auto &ex = (If &) expression;
+            return countUses(*ex.condition, id) + countUses(*ex.thenEx, id) + countUses(*ex.elseEx, id);
+        }
+        case ExpressionKind::binaryOp: {
+            auto &ex = (BinaryOp &) expression;
+            return countUses(*ex.left, id) + countUses(*ex.right, id);
+        }
+        case ExpressionKind::block: {
+            int total = 0;
+
+            for (auto &next : ((Block &) expression).body) {
+                total += countUses(*next, id);
+            }
+
+            return total;
+        }
+        case ExpressionKind::variable:
+            return ((Variable &) expression).id == id ? 1 : 0;
+        case ExpressionKind::fieldAccess:
+            return countUses(*((FieldAccess &) expression).object, id);
+        case ExpressionKind::indexAccess:
+            return countUses(*((IndexAccess &) expression).list, id) + countUses(*((IndexAccess &) expression).index, id);
+        case ExpressionKind::listLiteral: {
+            int total = 0;
+
+            for (auto &next : ((ListLiteral &) expression).values) {
+                total += countUses(*next, id);
+            }
+
+            return total;
+        }
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Folds constant operators, collapses ifs with a constant condition, propagates literal and copied lets into their
+ * uses and drops lets that nothing reads anymore.
+ */
+class ConstantFolder {
+
+public:
+    void foldFunction(Function &func) {
+        fold(func.body);
+    }
+
+private:
+    void fold(unique_ptr<Expression> &expression) {
+        switch (expression->kind) {
+            case ExpressionKind::assignment: {
+                auto &ex = (Assignment &) *expression;
+                fold(ex.body);
+                break;
+            }
+            case ExpressionKind::function: {
+                foldFunction((Function &) *expression);
+                break;
+            }
+            case ExpressionKind::call: {
+                auto &ex = (Call &) *expression;
+                fold(ex.source);
+
+                for (auto &arg : ex.args) {
+                    fold(arg);
+                }
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) *expression;
+                fold(ex.condition);
+                fold(ex.thenEx);
+                fold(ex.elseEx);
+
+                if (ex.condition->kind == ExpressionKind::booleanLiteral) {
+                    auto &chosen = ((BooleanLiteral &) *ex.condition).value ? ex.thenEx : ex.elseEx;
+
+                    // An if without else takes the type of its then arm, only collapse when the types still agree.
+                    if (chosen->type() == ex.type()) {
+                        auto replacement = move(chosen);
+                        expression = move(replacement);
+                    }
+                }
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) *expression;
+                fold(ex.left);
+                fold(ex.right);
+                foldBinaryOp(expression);
+                break;
+            }
+            case ExpressionKind::block: {
+                auto &ex = (Block &) *expression;
+                foldBlock(ex);
+
+                // A block with a single plain expression doesn't need its own scope.
+                if (ex.body.size() == 1 && ex.body[0]->kind != ExpressionKind::assignment && ex.body[0]->kind != ExpressionKind::function) {
+                    auto replacement = move(ex.body[0]);
+                    expression = move(replacement);
+                }
+                break;
+            }
+            case ExpressionKind::fieldAccess:
+                fold(((FieldAccess &) *expression).object);
+                break;
+            case ExpressionKind::indexAccess:
+                fold(((IndexAccess &) *expression).list);
+                fold(((IndexAccess &) *expression).index);
+                break;
+            case ExpressionKind::listLiteral: {
+                auto &ex = (ListLiteral &) *expression;
+
+                for (auto &next : ex.values) {
+                    fold(next);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    void foldBlock(Block &ex) {
+        auto &body = ex.body;
+
+        if (body.empty()) {
+            return;
+        }
+
+        for (size_t i = 0; i < body.size(); i++) {
+            fold(body[i]);
+
+            if (body[i]->kind == ExpressionKind::assignment && i + 1 < body.size()) {
+                auto &assignment = (Assignment &) *body[i];
+
+                if (isLiteral(*assignment.body) || assignment.body->kind == ExpressionKind::variable) {
+                    for (size_t j = i + 1; j < body.size(); j++) {
+                        substitute(body[j], assignment.id, *assignment.body);
+                    }
+                }
+            }
+        }
+
+        // The last expression is the value of the block, everything before it only matters if it is read or has effects.
+        for (size_t i = body.size() - 1; i-- > 0;) {
+            if (body[i]->kind != ExpressionKind::assignment || hasSideEffects(*body[i])) {
+                continue;
+            }
+
+            auto &id = ((Assignment &) *body[i]).id;
+            int uses = 0;
+
+            for (size_t j = i + 1; j < body.size(); j++) {
+                uses += countUses(*body[j], id);
+            }
+
+            if (uses == 0) {
+                body.erase(body.begin() + i);
+            }
+        }
+    }
+
+    /**
+     * Replaces reads of a literal or copied binding with its value. A copied name could be shadowed by a parameter
+     * of a nested function, so those are left alone.
+     * @return false once the name is shadowed, so that the rest of the enclosing block is left alone
+     */
+    bool substitute(unique_ptr<Expression> &expression, const string &id, Expression &literal) {
+        switch (expression->kind) {
+            case ExpressionKind::assignment: {
+                auto &ex = (Assignment &) *expression;
+                substitute(ex.body, id, literal);
+                return ex.id != id;
+            }
+            case ExpressionKind::function: {
+                auto &ex = (Function &) *expression;
+
+                if (ex.id == id) {
+                    return false;
+                }
+
+                if (literal.kind != ExpressionKind::variable && find(ex.params.begin(), ex.params.end(), id) == ex.params.end()) {
+                    substitute(ex.body, id, literal);
+                }
+
+                return true;
+            }
+            case ExpressionKind::call: {
+                auto &ex = (Call &) *expression;
+                substitute(ex.source, id, literal);
+
+                for (auto &arg : ex.args) {
+                    substitute(arg, id, literal);
+                }
+                return true;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) *expression;
+                substitute(ex.condition, id, literal);
+                substitute(ex.thenEx, id, literal);
+                substitute(ex.elseEx, id, literal);
+                return true;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) *expression;
+                substitute(ex.left, id, literal);
+                substitute(ex.right, id, literal);
+                return true;
+            }
+            case ExpressionKind::block: {
+                for (auto &next : ((Block &) *expression).body) {
+                    if (!substitute(next, id, literal)) {
+                        break;
+                    }
+                }
+                return true;
+            }
+            case ExpressionKind::variable: {
+                auto &ex = (Variable &) *expression;
+
+                if (ex.id == id) {
+                    expression = copyValue(literal, ex.loc());
+                }
+                return true;
+            }
+            case ExpressionKind::fieldAccess:
+                substitute(((FieldAccess &) *expression).object, id, literal);
+                return true;
+            case ExpressionKind::indexAccess:
+                substitute(((IndexAccess &) *expression).list, id, literal);
+                substitute(((IndexAccess &) *expression).index, id, literal);
+                return true;
+            case ExpressionKind::listLiteral: {
+                for (auto &next : ((ListLiteral &) *expression).values) {
+                    substitute(next, id, literal);
+                }
+                return true;
+            }
+            default:
+                return true;
+        }
+    }
+
+    void foldBinaryOp(unique_ptr<Expression> &expression) {
+        auto &ex = (BinaryOp &) *expression;
+        auto &op = ex.op;
+
+        if (op == "&&" || op == "||") {
+            // The right hand side only runs when the left doesn't decide the result, so it can always be dropped.
+            if (ex.left->kind == ExpressionKind::booleanLiteral) {
+                bool left = ((BooleanLiteral &) *ex.left).value;
+
+                if (left == (op == "||")) {
+                    expression = make_unique<BooleanLiteral>(ex.loc(), left);
+                } else {
+                    auto replacement = move(ex.right);
+                    expression = move(replacement);
+                }
+            }
+            return;
+        }
+
+        if (ex.left->kind != ExpressionKind::numberLiteral || ex.right->kind != ExpressionKind::numberLiteral) {
+            return;
+        }
+
+        // Folded exactly as the generated code and the evaluator compute it, anything that would overflow a literal,
+        // fault or be undefined is left for runtime.
+        auto folded = foldLiterals(op, (NumberLiteral &) *ex.left, (NumberLiteral &) *ex.right, ex.loc());
+
+        if (folded != nullptr) {
+            expression = move(folded);
+        }
+    }
+
+};
+
+void optimize(Module &module) {
+    inlineFunctions(module);
+
+    ConstantFolder folder;
+
+    for (auto &fun : module.functions) {
+        folder.foldFunction(*fun);
+    }
+
+    // Folding leaves literal arguments behind, and evaluated calls leave new literals to fold.
+    evaluateConstants(module);
+
+    for (auto &fun : module.functions) {
+        folder.foldFunction(*fun);
+    }
+
+    shareCommonSubexpressions(module);
+}
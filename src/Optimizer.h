@@ -0,0 +1,8 @@
+#ifndef TYPEDLETLANG_OPTIMIZER_H
+#define TYPEDLETLANG_OPTIMIZER_H
+
+#include "Ast.h"
+
+void optimize(Module &module);
+
+#endif //TYPEDLETLANG_OPTIMIZER_H
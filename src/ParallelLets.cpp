@@ -0,0 +1,461 @@
+#include "ParallelLets.h"
+#include "CallGraph.h"
+
+using namespace std;
+
+// Library functions that loop over a list or a range.
+const set<string> loopFunctions = {"range", "map", "filter", "fold", "sum", "min", "max", "dot", "scale", "offset", "add",
+                                   "mul", "prefixSum", "parMap", "parReduce", "parFor"};
+
+/**
+ * Finds lets that are worth computing on another thread. Lets can't be reassigned, so the statements of a block only
+ * depend on each other through the names they read. A let qualifies when its value is a plain Int, Float or Boolean,
+ * it can't have any effect, and it loops, through a recursive function or a list builtin. It runs as a task from
+ * where it is written until the first statement that reads it, and is only spawned when some other statement that
+ * loops runs in between. Every effect stays on the thread running the block, so output keeps its order.
+ */
+class ParallelLetMarker {
+
+    CallGraph &graph;
+    // Everything bound inside the module function being marked, and the nested functions among those.
+    set<string> locals;
+    map<string, Function *> nested;
+    // Names read somewhere as a function value.
+    set<string> functionValues;
+    map<string, bool> loopingNames;
+
+public:
+    explicit ParallelLetMarker(CallGraph &graph) : graph(graph) {
+
+    }
+
+    void markFunction(Function &func) {
+        locals.clear();
+        nested.clear();
+        functionValues.clear();
+
+        locals.insert(func.params.begin(), func.params.end());
+        collectBindings(*func.body, locals);
+        collectNested(*func.body);
+        collectFunctionValues(func);
+
+        mark(*func.body);
+    }
+
+private:
+    void mark(Expression &expression) {
+        switch (expression.kind) {
+            case ExpressionKind::assignment:
+                mark(*((Assignment &) expression).body);
+                break;
+            case ExpressionKind::function:
+                mark(*((Function &) expression).body);
+                break;
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                mark(*ex.source);
+
+                for (auto &arg : ex.args) {
+                    mark(*arg);
+                }
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                mark(*ex.condition);
+                mark(*ex.thenEx);
+                mark(*ex.elseEx);
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                mark(*ex.left);
+                mark(*ex.right);
+                break;
+            }
+            case ExpressionKind::block: {
+                auto &ex = (Block &) expression;
+                markBlock(ex);
+
+                for (auto &next : ex.body) {
+                    mark(*next);
+                }
+                break;
+            }
+            case ExpressionKind::fieldAccess:
+                mark(*((FieldAccess &) expression).object);
+                break;
+            case ExpressionKind::indexAccess:
+                mark(*((IndexAccess &) expression).list);
+                mark(*((IndexAccess &) expression).index);
+                break;
+            case ExpressionKind::listLiteral:
+                for (auto &next : ((ListLiteral &) expression).values) {
+                    mark(*next);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    void markBlock(Block &block) {
+        auto &body = block.body;
+
+        // The dependency graph of the block: what each statement reads, and whether it loops.
+        vector<set<string>> reads(body.size());
+        vector<bool> loops(body.size());
+
+        for (size_t i = 0; i < body.size(); i++) {
+            collectReads(*body[i], reads[i]);
+            set<string> path;
+            loops[i] = isLooping(reads[i], path);
+        }
+
+        // The last statement is the value of the block, and everything has to be joined by then.
+        auto last = body.size() - 1;
+
+        for (size_t i = 0; i + 1 < body.size(); i++) {
+            if (body[i]->kind != ExpressionKind::assignment || !loops[i]) {
+                continue;
+            }
+
+            auto &let = (Assignment &) *body[i];
+
+            if (!canSpawn(let, reads[i]) || isRebound(block, i)) {
+                continue;
+            }
+
+            auto joinBefore = last;
+
+            for (auto k = i + 1; k < last; k++) {
+                if (reads[k].count(let.id) == 1) {
+                    joinBefore = k;
+                    break;
+                }
+            }
+
+            bool overlaps = false;
+
+            for (auto k = i + 1; k < joinBefore; k++) {
+                overlaps = overlaps || loops[k];
+            }
+
+            if (!overlaps) {
+                continue;
+            }
+
+            let.spawn = true;
+            let.joinBefore = joinBefore;
+            let.captures.clear();
+
+            for (auto &name : reads[i]) {
+                if (locals.count(name) == 1) {
+                    let.captures.push_back(name);
+                }
+            }
+        }
+    }
+
+    bool canSpawn(Assignment &let, set<string> &reads) {
+        auto &type = let.body->type();
+
+        if (type.kind != TypeTokenKind::base || ((BaseTypeToken &) type).base == BasicTypeTokenKind::Unit) {
+            return false;
+        }
+
+        set<string> visiting;
+        return isSelfContained(*let.body) && isPure(reads, visiting);
+    }
+
+    /**
+     * The task writes its value under the let's name when it is joined, which mustn't replace a later let.
+     */
+    bool isRebound(Block &block, size_t index) {
+        auto &id = ((Assignment &) *block.body[index]).id;
+
+        for (auto k = index + 1; k < block.body.size(); k++) {
+            auto &next = *block.body[k];
+
+            if ((next.kind == ExpressionKind::assignment && ((Assignment &) next).id == id)
+                || (next.kind == ExpressionKind::function && ((Function &) next).id == id)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Nothing a task compiles may define a function, and reference counted vectors are not shared between threads.
+     */
+    bool isSelfContained(Expression &expression) {
+        auto &type = expression.type();
+
+        if (type.kind == TypeTokenKind::generic && ((GenericTypeToken &) type).parent->base == "Vector") {
+            return false;
+        }
+
+        switch (expression.kind) {
+            case ExpressionKind::assignment:
+                return isSelfContained(*((Assignment &) expression).body);
+            case ExpressionKind::function:
+                return false;
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                bool contained = isSelfContained(*ex.source);
+
+                for (auto &arg : ex.args) {
+                    contained = contained && isSelfContained(*arg);
+                }
+
+                return contained;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                return isSelfContained(*ex.condition) && isSelfContained(*ex.thenEx) && isSelfContained(*ex.elseEx);
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                return isSelfContained(*ex.left) && isSelfContained(*ex.right);
+            }
+            case ExpressionKind::block: {
+                bool contained = true;
+
+                for (auto &next : ((Block &) expression).body) {
+                    contained = contained && isSelfContained(*next);
+                }
+
+                return contained;
+            }
+            case ExpressionKind::fieldAccess:
+                return isSelfContained(*((FieldAccess &) expression).object);
+            case ExpressionKind::indexAccess:
+                return isSelfContained(*((IndexAccess &) expression).list) && isSelfContained(*((IndexAccess &) expression).index);
+            case ExpressionKind::listLiteral: {
+                bool contained = true;
+
+                for (auto &next : ((ListLiteral &) expression).values) {
+                    contained = contained && isSelfContained(*next);
+                }
+
+                return contained;
+            }
+            default:
+                return true;
+        }
+    }
+
+    /**
+     * Local functions are judged by their bodies. Any other local of function type could be anything.
+     */
+    bool isPure(set<string> &reads, set<string> &visiting) {
+        for (auto &name : reads) {
+            if (locals.count(name) == 0) {
+                if (!graph.reachableEffect(name).empty()) {
+                    return false;
+                }
+            } else if (nested.count(name) == 1) {
+                if (visiting.insert(name).second) {
+                    set<string> inner;
+                    collectReads(*nested[name]->body, inner);
+
+                    if (!isPure(inner, visiting)) {
+                        return false;
+                    }
+                }
+            } else if (functionValues.count(name) == 1) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Path holds the local functions on the way here, coming back to one of them means it is recursive. Two siblings
+     * reading the same helper is not a loop.
+     */
+    bool isLooping(set<string> &reads, set<string> &path) {
+        for (auto &name : reads) {
+            if (locals.count(name) == 0) {
+                if (isLoopingName(name)) {
+                    return true;
+                }
+            } else if (nested.count(name) == 1) {
+                if (!path.insert(name).second) {
+                    return true;
+                }
+
+                set<string> inner;
+                collectReads(*nested[name]->body, inner);
+                bool looping = isLooping(inner, path);
+                path.erase(name);
+
+                if (looping) {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    bool isLoopingName(const string &name) {
+        auto found = loopingNames.find(name);
+
+        if (found != loopingNames.end()) {
+            return found->second;
+        }
+
+        bool looping = false;
+
+        for (auto &callee : graph.reachableFrom(name)) {
+            looping = looping || loopFunctions.count(callee) == 1 || (graph.lookup(callee) != nullptr && graph.isRecursive(callee));
+        }
+
+        loopingNames[name] = looping;
+        return looping;
+    }
+
+    /**
+     * Fills functionValues from the whole function up front, isPure relies on it being complete before any block is
+     * marked. Reading statements again later only adds names already there.
+     */
+    void collectFunctionValues(Function &func) {
+        set<string> reads;
+        collectReads(*func.body, reads);
+    }
+
+    /**
+     * Nested functions at any depth, by name.
+     */
+    void collectNested(Expression &expression) {
+        switch (expression.kind) {
+            case ExpressionKind::assignment:
+                collectNested(*((Assignment &) expression).body);
+                break;
+            case ExpressionKind::function: {
+                auto &ex = (Function &) expression;
+                nested[ex.id] = &ex;
+                collectNested(*ex.body);
+                break;
+            }
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                collectNested(*ex.source);
+
+                for (auto &arg : ex.args) {
+                    collectNested(*arg);
+                }
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                collectNested(*ex.condition);
+                collectNested(*ex.thenEx);
+                collectNested(*ex.elseEx);
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                collectNested(*ex.left);
+                collectNested(*ex.right);
+                break;
+            }
+            case ExpressionKind::block:
+                for (auto &next : ((Block &) expression).body) {
+                    collectNested(*next);
+                }
+                break;
+            case ExpressionKind::fieldAccess:
+                collectNested(*((FieldAccess &) expression).object);
+                break;
+            case ExpressionKind::indexAccess:
+                collectNested(*((IndexAccess &) expression).list);
+                collectNested(*((IndexAccess &) expression).index);
+                break;
+            case ExpressionKind::listLiteral:
+                for (auto &next : ((ListLiteral &) expression).values) {
+                    collectNested(*next);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    /**
+     * Every name read anywhere in the expression, nested functions included.
+     */
+    void collectReads(Expression &expression, set<string> &reads) {
+        switch (expression.kind) {
+            case ExpressionKind::assignment:
+                collectReads(*((Assignment &) expression).body, reads);
+                break;
+            case ExpressionKind::function:
+                collectReads(*((Function &) expression).body, reads);
+                break;
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                collectReads(*ex.source, reads);
+
+                for (auto &arg : ex.args) {
+                    collectReads(*arg, reads);
+                }
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                collectReads(*ex.condition, reads);
+                collectReads(*ex.thenEx, reads);
+                collectReads(*ex.elseEx, reads);
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                collectReads(*ex.left, reads);
+                collectReads(*ex.right, reads);
+                break;
+            }
+            case ExpressionKind::block:
+                for (auto &next : ((Block &) expression).body) {
+                    collectReads(*next, reads);
+                }
+                break;
+            case ExpressionKind::variable: {
+                auto &ex = (Variable &) expression;
+                reads.insert(ex.id);
+
+                if (ex.type().kind == TypeTokenKind::basicFunction) {
+                    functionValues.insert(ex.id);
+                }
+                break;
+            }
+            case ExpressionKind::fieldAccess:
+                collectReads(*((FieldAccess &) expression).object, reads);
+                break;
+            case ExpressionKind::indexAccess:
+                collectReads(*((IndexAccess &) expression).list, reads);
+                collectReads(*((IndexAccess &) expression).index, reads);
+                break;
+            case ExpressionKind::listLiteral:
+                for (auto &next : ((ListLiteral &) expression).values) {
+                    collectReads(*next, reads);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+};
+
+void markParallelLets(Module &module) {
+    CallGraph graph(module);
+    ParallelLetMarker marker(graph);
+
+    for (auto &fun : module.functions) {
+        marker.markFunction(*fun);
+    }
+}
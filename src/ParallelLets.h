@@ -0,0 +1,8 @@
+#ifndef TYPEDLETLANG_PARALLELLETS_H
+#define TYPEDLETLANG_PARALLELLETS_H
+
+#include "Ast.h"
+
+void markParallelLets(Module &module);
+
+#endif //TYPEDLETLANG_PARALLELLETS_H
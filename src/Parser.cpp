@@ -19,8 +19,8 @@ typedef istreambuf_iterator<char> CharStream;
 
 
 const string whiteSpace = " \n\r\t";
-const string singleTokens = "(){}[],";
-const string mergeTokens = ":=+-*/<>&|";
+const string singleTokens = "(){}[],.";
+const string mergeTokens = ":=+-*/%<>&|";
 
 class Tokenizer {
 
@@ -126,10 +126,11 @@ private:
     string readWord(CharStream &in, CharStream end) {
         string word;
 
+        // Starts with a letter, which readFile checks, and may go on with digits as in Float4.
         while (in != end) {
             char next = *in;
 
-            if (isalpha(next)) {
+            if (isalnum(next)) {
                 x++;
                 word += next;
                 in++;
@@ -233,8 +234,9 @@ class Lexer {
 
     const set<string> boolOps = {"&&", "||"};
     const set<string> compareOps = {">=", ">", "<", "<=", "==", "!="};
+    const set<string> shiftOps = {"<<", ">>"};
     const set<string> sumOps = {"+", "-"};
-    const set<string> productOps = {"*", "/"};
+    const set<string> productOps = {"*", "/", "%"};
 
     vector<Token>& tokens;
     int index = 0;
@@ -248,20 +250,22 @@ public:
     }
 
     unique_ptr<Module> readModule() {
+        vector<unique_ptr<Record>> records;
         vector<unique_ptr<Function>> functions;
 
         do {
             auto firstWord = peek();
 
-            if ("fun" == firstWord.word) {
-                skip();
+            if ("fun" == firstWord.word || "memo" == firstWord.word) {
                 functions.push_back(readFunction(firstWord.loc));
+            } else if ("record" == firstWord.word) {
+                records.push_back(readRecord(firstWord.loc));
             } else {
                 throw runtime_error(firstWord.expected("function"));
             }
         } while (!isDone());
 
-        return make_unique<Module>(move(functions));
+        return make_unique<Module>(move(records), move(functions));
     }
 
 private:
@@ -288,8 +292,7 @@ private:
         if ("let" == firstWord.word) {
             skip();
             return readAssignment(firstWord.loc);
-        } else if ("fun" == firstWord.word) {
-            skip();
+        } else if ("fun" == firstWord.word || "memo" == firstWord.word) {
             return readFunction(firstWord.loc);
         } else {
             return readExpression();
@@ -306,7 +309,7 @@ private:
         if ("if" == firstWord.word) {
             skip();
 
-            auto condition = readCall();
+            auto condition = readBoolOp();
 
             auto maybeThen = next();
 
@@ -323,50 +326,45 @@ private:
 
             return make_unique<If>(firstWord.loc, make_unique<UnknownTypeToken>(), move(condition), move(thenEx), move(elseEx));
         } else {
-            return readCall();
+            return readBoolOp();
         }
 
     }
 
-    unique_ptr<Expression> readCall() {
-        auto left = readBoolOp();
+    /**
+     * Looks for && or || operators
+     * @return
+     */
+    unique_ptr<Expression> readBoolOp() {
+        auto left = readCompare();
 
-        auto maybeParen = peek();
+        auto maybeSymbol = peek();
 
-        if (maybeParen.word == "(") {
+        if (boolOps.count(maybeSymbol.word) == 1) {
             skip();
 
-            vector<unique_ptr<Expression>> args;
-
-            while (peek().word != ")") {
-                args.push_back(readExpression());
-
-                if (peek().word == ",") {
-                    skip();
-                }
-            }
-
-            skip();
+            auto right = readCompare();
 
-            return make_unique<Call>(left->loc(), move(make_unique<UnknownTypeToken>()), move(left), move(args));
+            return make_unique<BinaryOp>(maybeSymbol.loc, make_unique<UnknownTypeToken>(), maybeSymbol.word, move(left),
+                                         move(right));
         } else {
             return left;
         }
     }
 
     /**
-     * Looks for && or || operators
+     * Looks for >=, >, <, <=, ==, != operators
      * @return
      */
-    unique_ptr<Expression> readBoolOp() {
-        auto left = readCompare();
+    unique_ptr<Expression> readCompare() {
+        auto left = readShift();
 
         auto maybeSymbol = peek();
 
-        if (boolOps.count(maybeSymbol.word) == 1) {
+        if (compareOps.count(maybeSymbol.word) == 1) {
             skip();
 
-            auto right = readCompare();
+            auto right = readShift();
 
             return make_unique<BinaryOp>(maybeSymbol.loc, make_unique<UnknownTypeToken>(), maybeSymbol.word, move(left),
                                          move(right));
@@ -376,15 +374,15 @@ private:
     }
 
     /**
-     * Looks for >=, >, <, <=, ==, != operators
+     * Looks for << or >> operators
      * @return
      */
-    unique_ptr<Expression> readCompare() {
+    unique_ptr<Expression> readShift() {
         auto left = readSum();
 
         auto maybeSymbol = peek();
 
-        if (compareOps.count(maybeSymbol.word) == 1) {
+        if (shiftOps.count(maybeSymbol.word) == 1) {
             skip();
 
             auto right = readSum();
@@ -418,18 +416,18 @@ private:
     }
 
     /**
-     * Looks for * / or ** operators
+     * Looks for * / % or ** operators
      * @return
      */
     unique_ptr<Expression> readProduct() {
-        auto left = readBlock();
+        auto left = readCall();
 
         auto maybeSymbol = peek();
 
         if (productOps.count(maybeSymbol.word) == 1) {
             skip();
 
-            auto right = readBlock();
+            auto right = readCall();
 
             return make_unique<BinaryOp>(maybeSymbol.loc, make_unique<UnknownTypeToken>(), maybeSymbol.word, move(left),
                                          move(right));
@@ -438,6 +436,58 @@ private:
         }
     }
 
+    /**
+     * Looks for calls, field access and indexing, which bind tighter than any operator so that a + f(x) calls f.
+     * @return
+     */
+    unique_ptr<Expression> readCall() {
+        auto left = readBlock();
+
+        while (peek().word == "(" || peek().word == "." || peek().word == "[") {
+            if (peek().word == "[") {
+                auto loc = next().loc;
+                auto index = readExpression();
+                auto close = next();
+
+                if (close.word != "]") {
+                    throw runtime_error(close.expected("]"));
+                }
+
+                left = make_unique<IndexAccess>(loc, make_unique<UnknownTypeToken>(), move(left), move(index));
+                continue;
+            }
+
+            if (maybeSkip(".")) {
+                auto field = next();
+
+                if (field.type != TokenType::Identifier) {
+                    throw runtime_error(field.expected("field name"));
+                }
+
+                left = make_unique<FieldAccess>(field.loc, make_unique<UnknownTypeToken>(), move(left), field.word);
+                continue;
+            }
+
+            skip();
+
+            vector<unique_ptr<Expression>> args;
+
+            while (peek().word != ")") {
+                args.push_back(readExpression());
+
+                if (peek().word == ",") {
+                    skip();
+                }
+            }
+
+            skip();
+
+            left = make_unique<Call>(left->loc(), move(make_unique<UnknownTypeToken>()), move(left), move(args));
+        }
+
+        return left;
+    }
+
     /**
      * Looks for blocks { }
      */
@@ -472,7 +522,19 @@ private:
 
         if (first.type == TokenType::Number) {
             double value = stod(first.word);
-            return make_unique<NumberLiteral>(first.loc, value);
+            auto literal = make_unique<NumberLiteral>(first.loc, value, first.word.find('.') == string::npos);
+
+            // Read exactly in case it becomes an Int, the double is rounded past 2^53.
+            if (literal->integral) {
+                try {
+                    literal->intValue = stoll(first.word);
+                    literal->fitsInt = true;
+                } catch (out_of_range &e) {
+                    literal->fitsInt = false;
+                }
+            }
+
+            return literal;
         } else if (first.type == TokenType::Identifier) {
             if (first.word == "true") {
                 return make_unique<BooleanLiteral>(first.loc, true);
@@ -510,18 +572,64 @@ private:
         if (maybeColon.word == ":") {
             // We have an explicit type.
             skip();
-            auto typeName = next();
+            return readType();
+        } else {
+            // Type must be implicit
+            unique_ptr<TypeToken> type = make_unique<UnknownTypeToken>();
+            return type;
+        }
+    }
 
-            if (typeName.type != TokenType::Identifier) {
-                throw runtime_error(typeName.expected("type identifier"));
-            }
+    unique_ptr<TypeToken> readType() {
+        auto typeName = next();
 
+        if (typeName.type != TokenType::Identifier) {
+            throw runtime_error(typeName.expected("type identifier"));
+        }
+
+        if (peek().word != "<") {
             unique_ptr<TypeToken> type = make_unique<NamedTypeToken>(typeName.word);
             return type;
+        }
+
+        skip();
+
+        vector<unique_ptr<TypeToken>> typeParams;
+
+        do {
+            typeParams.push_back(readType());
+        } while (maybeSkip(","));
+
+        readTypeClose();
+
+        auto size = (int) typeParams.size();
+        unique_ptr<TypeToken> type = make_unique<GenericTypeToken>(make_unique<TypeConstructorTypeToken>(typeName.word, size), move(typeParams));
+        return type;
+    }
+
+    /**
+     * The tokenizer merges runs of symbols, so the close of List<List<Float>> arrives as a single >> token. Take one >
+     * off the front and leave the rest for the next read.
+     */
+    void readTypeClose() {
+        auto &close = tokens[index];
+
+        if (close.word == ">") {
+            skip();
+        } else if (close.type == TokenType::Symbol && close.word[0] == '>') {
+            close.word = close.word.substr(1);
+            close.loc.x++;
         } else {
-            // Type must be implicit
-            unique_ptr<TypeToken> type = make_unique<UnknownTypeToken>();
-            return type;
+            throw runtime_error(close.expected(">"));
+        }
+    }
+
+    bool maybeSkip(const string &word) {
+        if (peek().word == word) {
+            skip();
+            return true;
+        } else {
+            return false;
         }
     }
 
@@ -546,21 +654,93 @@ private:
     }
 
     unique_ptr<Function> readFunction(const Location &loc) {
+        bool memo = peek().word == "memo";
+
+        if (memo) {
+            skip();
+        }
+
+        auto fun = next();
+
+        if (fun.word != "fun") {
+            throw runtime_error(fun.expected("fun"));
+        }
+
         auto id = next();
 
         if (id.type != TokenType::Identifier) {
             throw runtime_error(id.expected("identifier"));
         }
 
-        // TODO: Handle generics later
-        auto openParen = next();
+        vector<string> typeParams;
 
-        if (openParen.word != "(") {
-            throw runtime_error(openParen.expected("("));
+        if (maybeSkip("<")) {
+            do {
+                auto typeParam = next();
+
+                if (typeParam.type != TokenType::Identifier) {
+                    throw runtime_error(typeParam.expected("type parameter"));
+                }
+
+                typeParams.push_back(typeParam.word);
+            } while (maybeSkip(","));
+
+            readTypeClose();
         }
 
         vector<string> paramNames;
         vector<unique_ptr<TypeToken>> paramTypes;
+        readParams(paramNames, paramTypes);
+
+        auto colon = next();
+
+        if (colon.word != ":") {
+            throw runtime_error(colon.expected(":"));
+        }
+
+        auto resultToken = readType();
+
+        unique_ptr<TypeToken> functionType = make_unique<BasicFunctionTypeToken>(move(paramTypes), move(resultToken));
+
+        auto equals = next();
+
+        if (equals.word != "=") {
+            throw runtime_error(equals.expected("="));
+        }
+
+        auto body = readExpression();
+
+        auto result = make_unique<Function>(loc, move(id.word), move(paramNames), move(functionType), move(body));
+        result->memo = memo;
+        result->typeParams = move(typeParams);
+        return result;
+    }
+
+    unique_ptr<Record> readRecord(const Location &loc) {
+        skip();
+
+        auto id = next();
+
+        if (id.type != TokenType::Identifier) {
+            throw runtime_error(id.expected("identifier"));
+        }
+
+        vector<string> fields;
+        vector<unique_ptr<TypeToken>> fieldTypes;
+        readParams(fields, fieldTypes);
+
+        return make_unique<Record>(loc, id.word, move(fields), move(fieldTypes));
+    }
+
+    /**
+     * A parenthesised list of name: Type pairs, as taken by functions and records.
+     */
+    void readParams(vector<string> &names, vector<unique_ptr<TypeToken>> &types) {
+        auto openParen = next();
+
+        if (openParen.word != "(") {
+            throw runtime_error(openParen.expected("("));
+        }
 
         while (peek().word != ")") {
             auto paramId = next();
@@ -575,15 +755,8 @@ private:
                 throw runtime_error(colon.expected(":"));
             }
 
-            auto paramType = next();
-
-            if (paramType.type != TokenType::Identifier) {
-                throw runtime_error(paramType.expected("type"));
-            }
-
-            paramNames.push_back(paramId.word);
-            unique_ptr<TypeToken> type = make_unique<NamedTypeToken>(paramType.word);
-            paramTypes.push_back(move(type));
+            names.push_back(paramId.word);
+            types.push_back(readType());
 
             auto maybeComma = peek();
 
@@ -593,32 +766,6 @@ private:
         }
 
         skip();
-
-        auto colon = next();
-
-        if (colon.word != ":") {
-            throw runtime_error(colon.expected(":"));
-        }
-
-        auto resultType = next();
-
-        if (resultType.type != TokenType::Identifier) {
-            throw runtime_error(resultType.expected("type"));
-        }
-
-        auto resultToken = make_unique<NamedTypeToken>(resultType.word);
-
-        unique_ptr<TypeToken> functionType = make_unique<BasicFunctionTypeToken>(move(paramTypes), move(resultToken));
-
-        auto equals = next();
-
-        if (equals.word != "=") {
-            throw runtime_error(equals.expected("="));
-        }
-
-        auto body = readExpression();
-
-        return make_unique<Function>(loc, move(id.word), move(paramNames), move(functionType), move(body));
     }
 
 };
@@ -650,7 +797,18 @@ public:
             }
             case ExpressionKind::function: {
                 auto &ex = (Function &) expression;
-                out << "{kind: 'function', id: '" << ex.id << "', type: " << typeName(ex.type()) << ", params: [";
+                out << "{kind: 'function', id: '" << ex.id << "', memo: " << (ex.memo ? "true" : "false") << ", typeParams: [";
+
+                auto &typeParams = ex.typeParams;
+
+                if (!typeParams.empty()) {
+                    out << typeParams[0];
+                    for (int i = 1; i < typeParams.size(); i++) {
+                        out << ", " << typeParams[i];
+                    }
+                }
+
+                out << "], type: " << typeName(ex.type()) << ", params: [";
 
                 auto params = ex.params;
 
@@ -708,6 +866,22 @@ public:
                 out << "'" << ex.id<< "'";
                 break;
             }
+            case ExpressionKind::fieldAccess: {
+                auto &ex = (FieldAccess &) expression;
+                out << "{kind: 'fieldAccess', type: " << typeName(ex.type()) << ", field: '" << ex.field << "', object: ";
+                print(*ex.object);
+                out << "}";
+                break;
+            }
+            case ExpressionKind::indexAccess: {
+                auto &ex = (IndexAccess &) expression;
+                out << "{kind: 'indexAccess', type: " << typeName(ex.type()) << ", checked: " << (ex.checked ? "true" : "false") << ", list: ";
+                print(*ex.list);
+                out << ", index: ";
+                print(*ex.index);
+                out << "}";
+                break;
+            }
             case ExpressionKind::listLiteral: {
                 auto &ex = (ListLiteral &) expression;
                 out << "{kind: 'listLiteral', type: " << typeName(ex.type()) << ", values: [";
@@ -733,6 +907,16 @@ public:
         }
     }
 
+    void print(Record &record) {
+        out << "{kind: 'record', id: '" << record.id << "', fields: [";
+
+        for (int i = 0; i < record.fields.size(); i++) {
+            out << (i == 0 ? "" : ", ") << "{id: '" << record.fields[i] << "', type: " << typeName(*record.fieldTypes[i]) << "}";
+        }
+
+        out << "]}";
+    }
+
     void print(vector<unique_ptr<Expression>> &exes) {
         if (!exes.empty()) {
             print(*exes[0]);
@@ -816,6 +1000,11 @@ void printModule(Module& module, string dest) {
 
     printer.println("const ast = [");
 
+    for (auto &record : module.records) {
+        printer.print(*record);
+        printer.println(",");
+    }
+
     for (auto &ex : module.functions) {
         printer.print(*ex);
         printer.println(",");
@@ -0,0 +1,102 @@
+#include "TailCalls.h"
+
+using namespace std;
+
+/**
+ * Flags every call whose result is directly the result of its function: the last expression of a block, either arm
+ * of an if, or the right hand side of && and ||, as long as everything around it is in tail position too.
+ */
+class TailCallMarker {
+
+    vector<Function *> functionStack;
+
+public:
+    void markFunction(Function &func) {
+        func.tailRecursive = false;
+
+        functionStack.push_back(&func);
+        mark(*func.body, true);
+        functionStack.pop_back();
+    }
+
+private:
+    void mark(Expression &expression, bool tail) {
+        switch (expression.kind) {
+            case ExpressionKind::assignment: {
+                auto &ex = (Assignment &) expression;
+                mark(*ex.body, false);
+                break;
+            }
+            case ExpressionKind::function: {
+                // Nested functions have tail positions of their own.
+                markFunction((Function &) expression);
+                break;
+            }
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+                ex.tail = tail;
+
+                auto &current = *functionStack.back();
+
+                // A memoized function has to go through its table even when calling itself.
+                if (tail && !current.memo && ex.source->kind == ExpressionKind::variable && ((Variable &) *ex.source).id == current.id) {
+                    current.tailRecursive = true;
+                }
+
+                mark(*ex.source, false);
+
+                for (auto &arg : ex.args) {
+                    mark(*arg, false);
+                }
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+                mark(*ex.condition, false);
+                mark(*ex.thenEx, tail);
+                mark(*ex.elseEx, tail);
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+                mark(*ex.left, false);
+                mark(*ex.right, tail && (ex.op == "&&" || ex.op == "||"));
+                break;
+            }
+            case ExpressionKind::block: {
+                auto &ex = (Block &) expression;
+
+                for (auto &next : ex.body) {
+                    mark(*next, tail && next == ex.body.back());
+                }
+                break;
+            }
+            case ExpressionKind::fieldAccess:
+                mark(*((FieldAccess &) expression).object, false);
+                break;
+            case ExpressionKind::indexAccess:
+                mark(*((IndexAccess &) expression).list, false);
+                mark(*((IndexAccess &) expression).index, false);
+                break;
+            case ExpressionKind::listLiteral: {
+                auto &ex = (ListLiteral &) expression;
+
+                for (auto &next : ex.values) {
+                    mark(*next, false);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+};
+
+void markTailCalls(Module &module) {
+    TailCallMarker marker;
+
+    for (auto &fun : module.functions) {
+        marker.markFunction(*fun);
+    }
+}
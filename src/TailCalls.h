@@ -0,0 +1,8 @@
+#ifndef TYPEDLETLANG_TAILCALLS_H
+#define TYPEDLETLANG_TAILCALLS_H
+
+#include "Ast.h"
+
+void markTailCalls(Module &module);
+
+#endif //TYPEDLETLANG_TAILCALLS_H
@@ -3,6 +3,8 @@
 //
 
 #include "Typechecker.h"
+#include "CallGraph.h"
+#include <algorithm>
 #include <set>
 #include <map>
 
@@ -11,20 +13,75 @@ using namespace std;
 class Typechecker {
 
     map<string, BasicTypeTokenKind> knownBasicTypes{{"Float",   BasicTypeTokenKind::Float},
+                                                    {"Int",     BasicTypeTokenKind::Int},
                                                     {"Boolean", BasicTypeTokenKind::Boolean},
-                                                    {"Unit",    BasicTypeTokenKind::Unit}};
+                                                    {"Unit",    BasicTypeTokenKind::Unit},
+                                                    {"Float2",  BasicTypeTokenKind::Float2},
+                                                    {"Float4",  BasicTypeTokenKind::Float4},
+                                                    {"Float8",  BasicTypeTokenKind::Float8}};
+    // Each packed Float type and its number of lanes.
+    const vector<pair<BasicTypeTokenKind, int>> packedTypes{{BasicTypeTokenKind::Float2, 2},
+                                                            {BasicTypeTokenKind::Float4, 4},
+                                                            {BasicTypeTokenKind::Float8, 8}};
+    map<string, int> knownGenericTypes{{"List",   1},
+                                       {"Vector", 1}};
+    // The second type parameter of List<R, Columns>, a list of records stored a column per field.
+    const string columnsLayout = "Columns";
+    // Library functions that build their list inline, so can build it in either layout.
+    const set<string> layoutProducers = {"map", "filter", "parMap"};
+    // Library functions returning a view of their list, which keeps its layout.
+    const set<string> listViews = {"slice", "tail"};
+    const set<string> arithmeticOps = {"+", "-", "*", "/", "%", "<<", ">>"};
+
     vector<map<string, unique_ptr<TypeToken>>> contextStack{};
+    map<string, vector<unique_ptr<BasicFunctionTypeToken>>> operators{};
+    // Library functions with a signature per packed type, compiled inline. Like operators, the first that fits wins.
+    map<string, vector<unique_ptr<BasicFunctionTypeToken>>> overloads{};
+
+    // Library names live in the first context, module functions in the second.
+    const size_t moduleContext = 1;
+    const int maxInstantiationDepth = 64;
+
+    map<string, Record *> records{};
+    map<string, Function *> genericFunctions{};
+    // Library functions with type parameters, compiled inline by the compiler rather than instantiated.
+    map<string, pair<vector<string>, unique_ptr<BasicFunctionTypeToken>>> genericLibrary{};
+    // Each instantiation keyed by its mangled name, which spells out the type arguments.
+    map<string, Function *> instances{};
+    vector<unique_ptr<Function>> instanceFunctions{};
+    int instantiationDepth = 0;
 
 public:
     void check(Module &module) {
 
         // TODO: Real standard library descriptions.
         setupLibrary();
+        checkRecords(module);
 
         // Pre-declare all module functions so that their order doesn't matter.
         map<string, unique_ptr<TypeToken>> context;
 
+        // A record is constructed by calling it with its fields in order.
+        for (auto &record : module.records) {
+            vector<unique_ptr<TypeToken>> fieldTypes;
+
+            for (auto &fieldType : record->fieldTypes) {
+                fieldTypes.push_back(fieldType->clone());
+            }
+
+            context[record->id] = make_unique<BasicFunctionTypeToken>(move(fieldTypes), make_unique<NamedTypeToken>(record->id));
+        }
+
         for (auto &fun : module.functions) {
+            if (records.count(fun->id) == 1) {
+                throw runtime_error("Function " + fun->id + " has the same name as a record at " + fun->loc().pretty());
+            }
+
+            if (!fun->typeParams.empty()) {
+                genericFunctions[fun->id] = fun.get();
+                continue;
+            }
+
             auto funcType = fillTypes((BasicFunctionTypeToken &) fun->type());
 
             context.insert({fun->id, move(funcType)});
@@ -33,13 +90,138 @@ public:
         contextStack.push_back(move(context));
 
         for (auto &fun : module.functions) {
-            checkFunction(*fun);
+            if (fun->typeParams.empty()) {
+                checkFunction(*fun);
+            }
         }
+
+        // Only the instantiations are compiled, the generic originals can't be given machine types.
+        auto &functions = module.functions;
+        functions.erase(remove_if(functions.begin(), functions.end(), [](unique_ptr<Function> &fun) {
+            return !fun->typeParams.empty();
+        }), functions.end());
+
+        for (auto &instance : instanceFunctions) {
+            functions.push_back(move(instance));
+        }
+
+        checkMemoFunctions(module);
     }
 
 private:
+    /**
+     * Records may use each other as field types in any order, but not contain themselves since they are stored by
+     * value. Their field types are filled in place for the compiler.
+     */
+    void checkRecords(Module &module) {
+        for (auto &record : module.records) {
+            auto &id = record->id;
+
+            if (records.count(id) == 1 || knownBasicTypes.count(id) == 1 || knownGenericTypes.count(id) == 1 || id == columnsLayout) {
+                throw runtime_error("Type " + id + " is already defined at " + record->loc.pretty());
+            }
+
+            records[id] = record.get();
+        }
+
+        for (auto &record : module.records) {
+            set<string> seen;
+
+            for (int i = 0; i < record->fields.size(); i++) {
+                auto &field = record->fields[i];
+
+                if (!seen.insert(field).second) {
+                    throw runtime_error("Record " + record->id + " has more than one field " + field + " at " + record->loc.pretty());
+                }
+
+                auto fieldType = fillTypes(*record->fieldTypes[i]);
+
+                if (!isFieldType(*fieldType)) {
+                    throw runtime_error("Field " + field + " of record " + record->id + " can't be of type " +
+                                        fieldType->pretty() + " at " + record->loc.pretty());
+                }
+
+                record->fieldTypes[i] = move(fieldType);
+            }
+        }
+
+        for (auto &record : module.records) {
+            set<string> visiting;
+
+            if (containsRecord(*record, record->id, visiting)) {
+                throw runtime_error("Record " + record->id + " contains itself at " + record->loc.pretty());
+            }
+        }
+    }
+
+    bool isFieldType(TypeToken &type) {
+        return type.kind == TypeTokenKind::named || isMemoizable(type);
+    }
+
+    bool containsRecord(Record &record, const string &id, set<string> &visiting) {
+        if (!visiting.insert(record.id).second) {
+            return false;
+        }
+
+        for (auto &fieldType : record.fieldTypes) {
+            if (fieldType->kind != TypeTokenKind::named) {
+                continue;
+            }
+
+            auto &fieldId = ((NamedTypeToken &) *fieldType).id;
+
+            if (fieldId == id || containsRecord(*records[fieldId], id, visiting)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * A memoized call may not run at all, so the function can't have effects. Arguments and result are stored in 64
+     * bit slots of the runtime table, so they must be basic types.
+     */
+    void checkMemoFunctions(Module &module) {
+        CallGraph graph(module);
+
+        for (auto &fun : module.functions) {
+            if (!fun->memo) {
+                continue;
+            }
+
+            auto &funcType = (BasicFunctionTypeToken &) fun->type();
+
+            for (auto &param : funcType.params) {
+                if (!isMemoizable(*param)) {
+                    throw runtime_error("Memoized function " + fun->id + " takes unsupported argument type " +
+                                        param->pretty() + " at " + fun->loc().pretty());
+                }
+            }
+
+            if (!isMemoizable(*funcType.result)) {
+                throw runtime_error("Memoized function " + fun->id + " returns unsupported type " +
+                                    funcType.result->pretty() + " at " + fun->loc().pretty());
+            }
+
+            auto effect = graph.reachableEffect(fun->id);
+
+            if (!effect.empty()) {
+                throw runtime_error("Memoized function " + fun->id + " is not pure, it can call " + effect + " at " +
+                                    fun->loc().pretty());
+            }
+        }
+    }
+
+    bool isMemoizable(TypeToken &type) {
+        return BaseTypeToken(BasicTypeTokenKind::Float) == type
+               || BaseTypeToken(BasicTypeTokenKind::Int) == type
+               || BaseTypeToken(BasicTypeTokenKind::Boolean) == type;
+    }
+
     void checkFunction(Function &func) {
         auto funcType = fillTypes((BasicFunctionTypeToken &) func.type());
+        checkListElements(*funcType, func.loc());
 
         map<string, unique_ptr<TypeToken>> context;
 
@@ -55,6 +237,13 @@ private:
 
         checkExpression(*func.body);
 
+        auto &result = *((BasicFunctionTypeToken &) func.type()).result;
+
+        if (BaseTypeToken(BasicTypeTokenKind::Unit) != result && func.body->type() != result && !coerce(*func.body, result)) {
+            throw runtime_error("Function " + func.id + " declared to return " + result.pretty() + " but body is of type " +
+                                func.body->type().pretty() + " at " + func.loc().pretty());
+        }
+
         contextStack.pop_back();
 
         contextStack.back()[func.id] = func._type->clone();
@@ -72,7 +261,7 @@ private:
                 } else {
                     ex._type = fillTypes(ex.type());
 
-                    if (ex.type() != ex.body->type()) {
+                    if (ex.type() != ex.body->type() && !coerce(*ex.body, ex.type())) {
                         throw runtime_error(
                                 "Incompatible types in assignment. Declared " + ex.type().pretty() + " found " +
                                 ex.body->type().pretty() + " at " + ex.loc().pretty());
@@ -90,12 +279,32 @@ private:
                 break;
             }
             case ExpressionKind::function: {
-                checkFunction((Function &) expression);
+                auto &ex = (Function &) expression;
+
+                if (ex.memo) {
+                    throw runtime_error("Only module functions can be memoized, found " + ex.id + " at " + ex.loc().pretty());
+                }
+
+                if (!ex.typeParams.empty()) {
+                    throw runtime_error("Only module functions can be generic, found " + ex.id + " at " + ex.loc().pretty());
+                }
+
+                checkFunction(ex);
                 break;
             }
             case ExpressionKind::call: {
                 auto &ex = (Call &) expression;
 
+                if (ex.source->kind == ExpressionKind::variable && isGeneric(((Variable &) *ex.source).id)) {
+                    checkGenericCall(ex);
+                    break;
+                }
+
+                if (ex.source->kind == ExpressionKind::variable && isOverloaded(((Variable &) *ex.source).id)) {
+                    checkOverloadedCall(ex);
+                    break;
+                }
+
                 checkExpression(*ex.source);
 
                 if (ex.source->type().kind == TypeTokenKind::basicFunction) {
@@ -110,7 +319,7 @@ private:
                         checkExpression(*ex.args[i]);
 
                         // TODO: polymorphism.
-                        if (ex.args[i]->type() != *funcType.params[i]) {
+                        if (ex.args[i]->type() != *funcType.params[i] && !coerce(*ex.args[i], *funcType.params[i])) {
                             throw runtime_error(
                                     "Invalid parameters passed to function. Expected " + funcType.pretty() + " found " +
                                     ex.args[i]->type().pretty() + " at position " + to_string(i) + " at " +
@@ -137,6 +346,10 @@ private:
                 checkExpression(*ex.thenEx);
                 checkExpression(*ex.elseEx);
 
+                if (ex.thenEx->type() != ex.elseEx->type() && !coerce(*ex.elseEx, ex.thenEx->type())) {
+                    coerce(*ex.thenEx, ex.elseEx->type());
+                }
+
                 if (ex.thenEx->type() == ex.elseEx->type() || BaseTypeToken(BasicTypeTokenKind::Unit) == ex.elseEx->type()) {
                     ex._type = ex.thenEx->type().clone();
                 } else {
@@ -152,21 +365,30 @@ private:
                 checkExpression(*ex.left);
                 checkExpression(*ex.right);
 
-                /* TODO: More complex type checking here. Maybe reuse function code.
-                         This will become very acute when the math operators get overloads. */
-                auto &opFunc = (BasicFunctionTypeToken &) lookupType(ex.op);
+                // Overloads are tried in declaration order, the first one both operands fit wins.
+                if (operators.find(ex.op) == operators.end()) {
+                    throw runtime_error("Unknown operator " + ex.op + " at " + ex.loc().pretty());
+                }
 
-                if (ex.left->type() != *opFunc.params[0]) {
-                    throw runtime_error("Invalid use of " + ex.op + " operator. Left hand expression is of type " +
-                                        ex.left->type().pretty() + ", expected type " + opFunc.params[0]->pretty());
+                BasicFunctionTypeToken *opFunc = nullptr;
+
+                for (auto &candidate : operators[ex.op]) {
+                    if (accepts(*ex.left, *candidate->params[0]) && accepts(*ex.right, *candidate->params[1])) {
+                        opFunc = candidate.get();
+                        break;
+                    }
                 }
 
-                if (ex.right->type() != *opFunc.params[1]) {
-                    throw runtime_error("Invalid use of " + ex.op + " operator. Right hand expression is of type " +
-                                        ex.right->type().pretty() + ", expected type " + opFunc.params[1]->pretty());
+                if (opFunc == nullptr) {
+                    throw runtime_error("Invalid use of " + ex.op + " operator. Left hand expression is of type " +
+                                        ex.left->type().pretty() + ", right hand expression is of type " +
+                                        ex.right->type().pretty() + " at " + ex.loc().pretty());
                 }
 
-                ex._type = opFunc.result->clone();
+                coerce(*ex.left, *opFunc->params[0]);
+                coerce(*ex.right, *opFunc->params[1]);
+
+                ex._type = opFunc->result->clone();
                 break;
             }
             case ExpressionKind::block: {
@@ -186,9 +408,71 @@ private:
             }
             case ExpressionKind::variable: {
                 auto &ex = (Variable &) expression;
+
+                if (isGeneric(ex.id)) {
+                    throw runtime_error("Generic function " + ex.id + " can only be called directly at " + ex.loc().pretty());
+                }
+
+                if (isOverloaded(ex.id)) {
+                    throw runtime_error("Function " + ex.id + " can only be called directly at " + ex.loc().pretty());
+                }
+
                 ex._type = lookupType(ex.id).clone();
                 break;
             }
+            case ExpressionKind::fieldAccess: {
+                auto &ex = (FieldAccess &) expression;
+
+                checkExpression(*ex.object);
+
+                // On a list of records this is the list of the field, one per record.
+                auto &objectType = ex.object->type();
+                bool isList = objectType.kind == TypeTokenKind::generic && ((GenericTypeToken &) objectType).parent->base == "List";
+                auto &recordType = isList ? *((GenericTypeToken &) objectType).typeParams[0] : objectType;
+
+                if (recordType.kind != TypeTokenKind::named || records.count(((NamedTypeToken &) recordType).id) == 0) {
+                    throw runtime_error("Type " + objectType.pretty() + " has no fields at " + ex.loc().pretty());
+                }
+
+                auto &record = *records[((NamedTypeToken &) recordType).id];
+                auto field = find(record.fields.begin(), record.fields.end(), ex.field);
+
+                if (field == record.fields.end()) {
+                    throw runtime_error("Record " + record.id + " has no field " + ex.field + " at " + ex.loc().pretty());
+                }
+
+                auto &fieldType = *record.fieldTypes[field - record.fields.begin()];
+
+                ex._type = isList ? makeGenericType("List", fieldType.clone()) : fieldType.clone();
+                break;
+            }
+            case ExpressionKind::indexAccess: {
+                auto &ex = (IndexAccess &) expression;
+
+                checkExpression(*ex.list);
+                checkExpression(*ex.index);
+
+                auto &listType = ex.list->type();
+
+                if (listType.kind != TypeTokenKind::generic || ((GenericTypeToken &) listType).parent->base != "List") {
+                    throw runtime_error("Only a list can be indexed, found " + listType.pretty() + " at " + ex.loc().pretty());
+                }
+
+                auto &elementType = *((GenericTypeToken &) listType).typeParams[0];
+
+                if (BaseTypeToken(BasicTypeTokenKind::Unit) == elementType) {
+                    throw runtime_error("Cannot index an empty list at " + ex.loc().pretty());
+                }
+
+                BaseTypeToken intType(BasicTypeTokenKind::Int);
+
+                if (ex.index->type() != intType && !coerce(*ex.index, intType)) {
+                    throw runtime_error("List index must be an Int, found " + ex.index->type().pretty() + " at " + ex.loc().pretty());
+                }
+
+                ex._type = elementType.clone();
+                break;
+            }
             case ExpressionKind::listLiteral: {
                 auto &ex = (ListLiteral &) expression;
 
@@ -199,17 +483,20 @@ private:
                     ex._type = make_unique<GenericTypeToken>(move(make_unique<TypeConstructorTypeToken>("List", 1)), move(genericListType));
                 } else {
                     unique_ptr<TypeToken> listType = nullptr;
+                    BaseTypeToken intType(BasicTypeTokenKind::Int);
 
                     for (auto &next : ex.values) {
                         checkExpression(*next);
-                        auto nextType = next->type().clone();
-
-                        if (listType == nullptr) {
-                            listType = move(nextType);
-                        } else {
-                            if (*listType != *nextType) {
-                                throw runtime_error("List contains more than one type: " + next->loc().pretty());
-                            }
+
+                        // An Int anywhere makes the integral literals around it Ints too.
+                        if (listType == nullptr || intType == next->type()) {
+                            listType = next->type().clone();
+                        }
+                    }
+
+                    for (auto &next : ex.values) {
+                        if (*listType != next->type() && !coerce(*next, *listType)) {
+                            throw runtime_error("List contains more than one type: " + next->loc().pretty());
                         }
                     }
 
@@ -227,6 +514,217 @@ private:
             default:
                 throw runtime_error("Unknown expression kind");
         }
+
+        checkListElements(expression.type(), expression.loc());
+    }
+
+    /**
+     * List elements are stored unboxed, so a list can hold basic types and records but not lists, vectors or functions.
+     */
+    void checkListElements(TypeToken &type, Location &loc) {
+        if (type.kind == TypeTokenKind::generic) {
+            auto &generic = (GenericTypeToken &) type;
+            auto &element = *generic.typeParams[0];
+
+            if (generic.parent->base == "List" && element.kind != TypeTokenKind::named && element.kind != TypeTokenKind::base) {
+                throw runtime_error("A list can't hold " + element.pretty() + ", found " + type.pretty() + " at " + loc.pretty());
+            }
+
+            for (auto &param : generic.typeParams) {
+                checkListElements(*param, loc);
+            }
+        } else if (type.kind == TypeTokenKind::basicFunction) {
+            auto &function = (BasicFunctionTypeToken &) type;
+
+            for (auto &param : function.params) {
+                checkListElements(*param, loc);
+            }
+
+            checkListElements(*function.result, loc);
+        }
+    }
+
+    bool accepts(Expression &expression, TypeToken &expected) {
+        return expression.type() == expected || narrowToInt(expression, expected, false) || toColumns(expression, expected, false);
+    }
+
+    /**
+     * Makes an expression fit the expected type if it is only off by literals that can be narrowed, or by the layout
+     * of a list it builds.
+     * @return true if the expression now has the expected type
+     */
+    bool coerce(Expression &expression, TypeToken &expected) {
+        if (narrowToInt(expression, expected, false)) {
+            narrowToInt(expression, expected, true);
+            return true;
+        }
+
+        if (toColumns(expression, expected, false)) {
+            toColumns(expression, expected, true);
+            return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * Integral number literals default to Float but may be used as an Int. This extends through arithmetic, blocks
+     * and ifs built only from such literals, so { 4 + 2 } * 7 can initialise an Int.
+     */
+    bool narrowToInt(Expression &expression, TypeToken &expected, bool apply) {
+        BaseTypeToken intType(BasicTypeTokenKind::Int);
+        BaseTypeToken floatType(BasicTypeTokenKind::Float);
+
+        if (expression.kind == ExpressionKind::listLiteral) {
+            return narrowList((ListLiteral &) expression, expected, apply);
+        }
+
+        if (intType != expected || floatType != expression.type()) {
+            return false;
+        }
+
+        switch (expression.kind) {
+            case ExpressionKind::numberLiteral: {
+                auto &ex = (NumberLiteral &) expression;
+
+                // One too large for an Int stays a Float.
+                if (!ex.integral || !ex.fitsInt) {
+                    return false;
+                }
+
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+
+                if (arithmeticOps.count(ex.op) == 0 || !narrowToInt(*ex.left, expected, apply) || !narrowToInt(*ex.right, expected, apply)) {
+                    return false;
+                }
+
+                break;
+            }
+            case ExpressionKind::block: {
+                auto &ex = (Block &) expression;
+
+                if (ex.body.empty() || !narrowToInt(*ex.body.back(), expected, apply)) {
+                    return false;
+                }
+
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+
+                if (!narrowToInt(*ex.thenEx, expected, apply) || !narrowToInt(*ex.elseEx, expected, apply)) {
+                    return false;
+                }
+
+                break;
+            }
+            default:
+                return false;
+        }
+
+        if (apply) {
+            expression._type = intType.clone();
+        }
+
+        return true;
+    }
+
+    /**
+     * A list literal narrows element by element, so &[0, 3, 5] can be a List<Int>. An empty literal fits any list.
+     */
+    bool narrowList(ListLiteral &expression, TypeToken &expected, bool apply) {
+        if (expected.kind != TypeTokenKind::generic || ((GenericTypeToken &) expected).parent->base != "List") {
+            return false;
+        }
+
+        auto &elementType = *((GenericTypeToken &) expected).typeParams[0];
+
+        for (auto &value : expression.values) {
+            if (!narrowToInt(*value, elementType, apply)) {
+                return false;
+            }
+        }
+
+        if (apply) {
+            expression._type = expected.clone();
+        }
+
+        return true;
+    }
+
+    /**
+     * A list of records is laid out where it is built, so a list literal, or a map, filter or parMap producing one,
+     * can build a List<R, Columns> instead. This extends through blocks and ifs like narrowToInt.
+     */
+    bool toColumns(Expression &expression, TypeToken &expected, bool apply) {
+        if (!isColumnsList(expected) || *withoutLayout(expected) != expression.type()) {
+            return false;
+        }
+
+        switch (expression.kind) {
+            case ExpressionKind::listLiteral:
+                break;
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+
+                if (ex.source->kind != ExpressionKind::variable) {
+                    return false;
+                }
+
+                auto &id = ((Variable &) *ex.source).id;
+
+                if (layoutProducers.count(id) == 0 || !isGeneric(id) || genericFunctions.count(id) == 1) {
+                    return false;
+                }
+
+                if (apply) {
+                    ((BasicFunctionTypeToken &) ex.source->type()).result = expected.clone();
+                }
+
+                break;
+            }
+            case ExpressionKind::block: {
+                auto &ex = (Block &) expression;
+
+                if (ex.body.empty() || !toColumns(*ex.body.back(), expected, apply)) {
+                    return false;
+                }
+
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+
+                if (!toColumns(*ex.thenEx, expected, apply) || !toColumns(*ex.elseEx, expected, apply)) {
+                    return false;
+                }
+
+                break;
+            }
+            default:
+                return false;
+        }
+
+        if (apply) {
+            expression._type = expected.clone();
+        }
+
+        return true;
+    }
+
+    bool isColumnsList(TypeToken &type) {
+        return type.kind == TypeTokenKind::generic && ((GenericTypeToken &) type).parent->base == "List"
+               && ((GenericTypeToken &) type).typeParams.size() == 2;
+    }
+
+    /**
+     * The same list of records in the default layout, a record after another.
+     */
+    unique_ptr<TypeToken> withoutLayout(TypeToken &columnsList) {
+        return makeGenericType("List", ((GenericTypeToken &) columnsList).typeParams[0]->clone());
     }
 
     unique_ptr<TypeToken> fillTypes(TypeToken &source) {
@@ -236,10 +734,47 @@ private:
 
                 if (knownBasicTypes.find(name) != knownBasicTypes.end()) {
                     return make_unique<BaseTypeToken>(knownBasicTypes[name]);
+                } else if (records.find(name) != records.end()) {
+                    return make_unique<NamedTypeToken>(name);
                 } else {
                     throw runtime_error("Unknown type: " + name);
                 }
             }
+            case TypeTokenKind::generic: {
+                auto &generic = (GenericTypeToken &) source;
+                auto &base = generic.parent->base;
+
+                if (isColumnsList(generic)) {
+                    auto &layout = *generic.typeParams[1];
+                    auto element = fillTypes(*generic.typeParams[0]);
+
+                    if (layout.kind != TypeTokenKind::named || ((NamedTypeToken &) layout).id != columnsLayout) {
+                        throw runtime_error("Unknown list layout " + layout.pretty() + " in " + generic.pretty());
+                    }
+
+                    if (element->kind != TypeTokenKind::named) {
+                        throw runtime_error("Only a list of records can be stored as " + columnsLayout + ", found " + generic.pretty());
+                    }
+
+                    vector<unique_ptr<TypeToken>> typeParams;
+                    typeParams.push_back(move(element));
+                    typeParams.push_back(layout.clone());
+
+                    return make_unique<GenericTypeToken>(make_unique<TypeConstructorTypeToken>(base, 2), move(typeParams));
+                }
+
+                if (knownGenericTypes.find(base) == knownGenericTypes.end() || knownGenericTypes[base] != generic.typeParams.size()) {
+                    throw runtime_error("Unknown type: " + generic.pretty());
+                }
+
+                vector<unique_ptr<TypeToken>> typeParams;
+
+                for (auto &param : generic.typeParams) {
+                    typeParams.push_back(fillTypes(*param));
+                }
+
+                return make_unique<GenericTypeToken>(make_unique<TypeConstructorTypeToken>(base, generic.parent->size), move(typeParams));
+            }
             case TypeTokenKind::basicFunction: {
                 auto &type = (BasicFunctionTypeToken &) source;
                 return fillTypes(type);
@@ -270,6 +805,398 @@ private:
         return make_unique<BasicFunctionTypeToken>(move(newParams), move(newResult));
     }
 
+    /**
+     * Generic functions are never checked themselves. Each call infers the type arguments from its argument types and
+     * is pointed at a copy of the function specialised to them, so every instance compiles with machine types of its
+     * own. Calls with the same type arguments share one instance.
+     */
+    void checkGenericCall(Call &ex) {
+        auto &source = (Variable &) *ex.source;
+        auto library = genericFunctions.find(source.id) == genericFunctions.end();
+        auto &typeParams = library ? genericLibrary[source.id].first : genericFunctions[source.id]->typeParams;
+        auto &declared = library ? *genericLibrary[source.id].second : (BasicFunctionTypeToken &) genericFunctions[source.id]->type();
+
+        if (declared.params.size() != ex.args.size()) {
+            throw runtime_error("Wrong number of parameters passed to function at " + source.loc().pretty());
+        }
+
+        map<string, unique_ptr<TypeToken>> bindings;
+
+        for (int i = 0; i < ex.args.size(); i++) {
+            checkExpression(*ex.args[i]);
+
+            if (!unify(*declared.params[i], ex.args[i]->type(), typeParams, bindings)) {
+                throw runtime_error("Invalid parameters passed to function. Expected " + declared.pretty() + " found " +
+                                    ex.args[i]->type().pretty() + " at position " + to_string(i) + " at " +
+                                    source.loc().pretty());
+            }
+        }
+
+        vector<unique_ptr<TypeToken>> typeArgs;
+
+        for (auto &param : typeParams) {
+            if (bindings.find(param) == bindings.end()) {
+                throw runtime_error("Cannot infer type parameter " + param + " of " + source.id + " at " + source.loc().pretty());
+            }
+
+            typeArgs.push_back(bindings[param]->clone());
+
+            // An empty list literal is a List<Unit>. It can be passed on, but has no elements a Unit could be read as.
+            bool asElement = false;
+            bool asValue = false;
+            findTypeParam(declared, param, false, asElement, asValue);
+
+            if (BaseTypeToken(BasicTypeTokenKind::Unit) == *bindings[param] && asElement && asValue) {
+                throw runtime_error("Cannot infer type parameter " + param + " of " + source.id + " from an empty list at " + source.loc().pretty());
+            }
+        }
+
+        if (library) {
+            source._type = fillTypes(*substituteType(declared, bindings));
+        } else {
+            source.id = instantiate(*genericFunctions[source.id], bindings, typeArgs);
+            source._type = lookupType(source.id).clone();
+        }
+
+        auto &funcType = (BasicFunctionTypeToken &) source.type();
+
+        // The library compiles each call inline, so it takes a list of records in either layout.
+        for (int i = 0; library && i < ex.args.size(); i++) {
+            auto &argType = ex.args[i]->type();
+
+            if (isColumnsList(argType) && *withoutLayout(argType) == *funcType.params[i]) {
+                funcType.params[i] = argType.clone();
+
+                if (i == 0 && listViews.count(source.id) == 1) {
+                    funcType.result = argType.clone();
+                }
+            }
+        }
+
+        for (int i = 0; i < ex.args.size(); i++) {
+            if (ex.args[i]->type() != *funcType.params[i] && !coerce(*ex.args[i], *funcType.params[i])) {
+                throw runtime_error(
+                        "Invalid parameters passed to function. Expected " + funcType.pretty() + " found " +
+                        ex.args[i]->type().pretty() + " at position " + to_string(i) + " at " + source.loc().pretty());
+            }
+        }
+
+        ex._type = funcType.result->clone();
+    }
+
+    string instantiate(Function &generic, map<string, unique_ptr<TypeToken>> &bindings, vector<unique_ptr<TypeToken>> &typeArgs) {
+        auto name = generic.id + "<" + typeName(typeArgs) + ">";
+
+        if (instances.find(name) != instances.end()) {
+            return name;
+        }
+
+        if (instantiationDepth >= maxInstantiationDepth) {
+            throw runtime_error("Instantiation of " + name + " is nested too deeply at " + generic.loc().pretty());
+        }
+
+        auto body = cloneExpression(*generic.body);
+        substituteTypes(*body, bindings);
+
+        auto instance = make_unique<Function>(generic.loc(), name, generic.params, substituteType(generic.type(), bindings), move(body));
+        instance->memo = generic.memo;
+
+        // Declared before its body is checked so the instance can call itself.
+        contextStack[moduleContext][name] = fillTypes(instance->type());
+        instances[name] = instance.get();
+
+        // The instance sees only module level names, not the locals of the function that happened to call it.
+        vector<map<string, unique_ptr<TypeToken>>> suspended(make_move_iterator(contextStack.begin() + moduleContext + 1),
+                                                             make_move_iterator(contextStack.end()));
+        contextStack.erase(contextStack.begin() + moduleContext + 1, contextStack.end());
+
+        instantiationDepth++;
+        checkFunction(*instance);
+        instantiationDepth--;
+
+        contextStack.insert(contextStack.end(), make_move_iterator(suspended.begin()), make_move_iterator(suspended.end()));
+
+        instanceFunctions.push_back(move(instance));
+        return name;
+    }
+
+    bool isGeneric(const string &id) {
+        if (genericFunctions.find(id) == genericFunctions.end() && genericLibrary.find(id) == genericLibrary.end()) {
+            return false;
+        }
+
+        return !isShadowed(id);
+    }
+
+    bool isOverloaded(const string &id) {
+        return overloads.find(id) != overloads.end() && !isShadowed(id);
+    }
+
+    /**
+     * A local or module name hides a library function of the same name.
+     */
+    bool isShadowed(const string &id) {
+        for (auto i = moduleContext; i < contextStack.size(); i++) {
+            if (contextStack[i].find(id) != contextStack[i].end()) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void checkOverloadedCall(Call &ex) {
+        auto &source = (Variable &) *ex.source;
+
+        for (auto &arg : ex.args) {
+            checkExpression(*arg);
+        }
+
+        BasicFunctionTypeToken *chosen = nullptr;
+
+        for (auto &candidate : overloads[source.id]) {
+            bool fits = candidate->params.size() == ex.args.size();
+
+            for (int i = 0; fits && i < ex.args.size(); i++) {
+                fits = accepts(*ex.args[i], *candidate->params[i]);
+            }
+
+            if (fits) {
+                chosen = candidate.get();
+                break;
+            }
+        }
+
+        if (chosen == nullptr) {
+            vector<unique_ptr<TypeToken>> argTypes;
+
+            for (auto &arg : ex.args) {
+                argTypes.push_back(arg->type().clone());
+            }
+
+            throw runtime_error("No version of " + source.id + " takes (" + typeName(argTypes) + ") at " + source.loc().pretty());
+        }
+
+        for (int i = 0; i < ex.args.size(); i++) {
+            coerce(*ex.args[i], *chosen->params[i]);
+        }
+
+        source._type = chosen->clone();
+        ex._type = chosen->result->clone();
+    }
+
+    /**
+     * Finds where a type parameter occurs in type: as the element type of a list, or as a value of its own.
+     */
+    void findTypeParam(TypeToken &type, const string &param, bool inList, bool &asElement, bool &asValue) {
+        switch (type.kind) {
+            case TypeTokenKind::named:
+                if (((NamedTypeToken &) type).id == param) {
+                    (inList ? asElement : asValue) = true;
+                }
+                break;
+            case TypeTokenKind::generic: {
+                auto &generic = (GenericTypeToken &) type;
+
+                for (auto &next : generic.typeParams) {
+                    findTypeParam(*next, param, inList || generic.parent->base == "List", asElement, asValue);
+                }
+                break;
+            }
+            case TypeTokenKind::basicFunction: {
+                auto &function = (BasicFunctionTypeToken &) type;
+
+                for (auto &next : function.params) {
+                    findTypeParam(*next, param, inList, asElement, asValue);
+                }
+
+                findTypeParam(*function.result, param, inList, asElement, asValue);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    /**
+     * Bind the typeParams in pattern to the matching parts of actual. Parts that don't mention a type parameter are
+     * left for the normal argument check once the types are substituted.
+     */
+    bool unify(TypeToken &pattern, TypeToken &actual, vector<string> &typeParams, map<string, unique_ptr<TypeToken>> &bindings) {
+        switch (pattern.kind) {
+            case TypeTokenKind::named: {
+                auto &id = ((NamedTypeToken &) pattern).id;
+
+                if (find(typeParams.begin(), typeParams.end(), id) == typeParams.end()) {
+                    return true;
+                }
+
+                auto bound = bindings.find(id);
+
+                if (bound == bindings.end()) {
+                    bindings[id] = actual.clone();
+                    return true;
+                }
+
+                BaseTypeToken intType(BasicTypeTokenKind::Int);
+                BaseTypeToken floatType(BasicTypeTokenKind::Float);
+
+                // An integral literal may have bound it to Float already, if so it can still be narrowed to the Int.
+                if (floatType == *bound->second && intType == actual) {
+                    bound->second = actual.clone();
+                    return true;
+                }
+
+                return *bound->second == actual || (intType == *bound->second && floatType == actual);
+            }
+            case TypeTokenKind::generic: {
+                auto &genericType = (GenericTypeToken &) pattern;
+
+                if (actual.kind != TypeTokenKind::generic) {
+                    return false;
+                }
+
+                auto &realActual = (GenericTypeToken &) actual;
+
+                // A layout given after the element type doesn't change what the list holds.
+                if (genericType.parent->base != realActual.parent->base || genericType.typeParams.size() > realActual.typeParams.size()) {
+                    return false;
+                }
+
+                for (int i = 0; i < genericType.typeParams.size(); i++) {
+                    if (!unify(*genericType.typeParams[i], *realActual.typeParams[i], typeParams, bindings)) {
+                        return false;
+                    }
+                }
+
+                return true;
+            }
+            case TypeTokenKind::basicFunction: {
+                auto &func = (BasicFunctionTypeToken &) pattern;
+
+                if (actual.kind != TypeTokenKind::basicFunction) {
+                    return false;
+                }
+
+                auto &realActual = (BasicFunctionTypeToken &) actual;
+
+                if (func.params.size() != realActual.params.size()) {
+                    return false;
+                }
+
+                for (int i = 0; i < func.params.size(); i++) {
+                    if (!unify(*func.params[i], *realActual.params[i], typeParams, bindings)) {
+                        return false;
+                    }
+                }
+
+                return unify(*func.result, *realActual.result, typeParams, bindings);
+            }
+            default:
+                return true;
+        }
+    }
+
+    unique_ptr<TypeToken> substituteType(TypeToken &type, map<string, unique_ptr<TypeToken>> &bindings) {
+        switch (type.kind) {
+            case TypeTokenKind::named: {
+                auto bound = bindings.find(((NamedTypeToken &) type).id);
+
+                return bound == bindings.end() ? type.clone() : bound->second->clone();
+            }
+            case TypeTokenKind::generic: {
+                auto &generic = (GenericTypeToken &) type;
+                vector<unique_ptr<TypeToken>> typeParams;
+
+                for (auto &param : generic.typeParams) {
+                    typeParams.push_back(substituteType(*param, bindings));
+                }
+
+                return make_unique<GenericTypeToken>(make_unique<TypeConstructorTypeToken>(generic.parent->base, generic.parent->size), move(typeParams));
+            }
+            case TypeTokenKind::basicFunction: {
+                auto &func = (BasicFunctionTypeToken &) type;
+                vector<unique_ptr<TypeToken>> params;
+
+                for (auto &param : func.params) {
+                    params.push_back(substituteType(*param, bindings));
+                }
+
+                return make_unique<BasicFunctionTypeToken>(move(params), substituteType(*func.result, bindings));
+            }
+            default:
+                return type.clone();
+        }
+    }
+
+    /**
+     * Replace the type parameters in the annotations of a copied generic body, the only types it has before checking.
+     */
+    void substituteTypes(Expression &expression, map<string, unique_ptr<TypeToken>> &bindings) {
+        expression._type = substituteType(expression.type(), bindings);
+
+        switch (expression.kind) {
+            case ExpressionKind::assignment: {
+                substituteTypes(*((Assignment &) expression).body, bindings);
+                break;
+            }
+            case ExpressionKind::function: {
+                substituteTypes(*((Function &) expression).body, bindings);
+                break;
+            }
+            case ExpressionKind::call: {
+                auto &ex = (Call &) expression;
+
+                substituteTypes(*ex.source, bindings);
+
+                for (auto &arg : ex.args) {
+                    substituteTypes(*arg, bindings);
+                }
+                break;
+            }
+            case ExpressionKind::ifEx: {
+                auto &ex = (If &) expression;
+
+                substituteTypes(*ex.condition, bindings);
+                substituteTypes(*ex.thenEx, bindings);
+                substituteTypes(*ex.elseEx, bindings);
+                break;
+            }
+            case ExpressionKind::binaryOp: {
+                auto &ex = (BinaryOp &) expression;
+
+                substituteTypes(*ex.left, bindings);
+                substituteTypes(*ex.right, bindings);
+                break;
+            }
+            case ExpressionKind::block: {
+                for (auto &statement : ((Block &) expression).body) {
+                    substituteTypes(*statement, bindings);
+                }
+                break;
+            }
+            case ExpressionKind::fieldAccess: {
+                substituteTypes(*((FieldAccess &) expression).object, bindings);
+                break;
+            }
+            case ExpressionKind::indexAccess: {
+                auto &ex = (IndexAccess &) expression;
+
+                substituteTypes(*ex.list, bindings);
+                substituteTypes(*ex.index, bindings);
+                break;
+            }
+            case ExpressionKind::listLiteral: {
+                for (auto &value : ((ListLiteral &) expression).values) {
+                    substituteTypes(*value, bindings);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
     TypeToken &lookupType(const string &id) {
 
         for (auto i = contextStack.size(); i > 0; --i) {
@@ -301,39 +1228,271 @@ private:
 
         context["printds"] = make_unique<BasicFunctionTypeToken>(move(printdsParams), move(unitType.clone()));
 
-        context["+"] = move(makeNumberOp());
-        context["-"] = move(makeNumberOp());
-        context["*"] = move(makeNumberOp());
-        context["/"] = move(makeNumberOp());
+        vector<unique_ptr<TypeToken>> printisParams;
+        printisParams.push_back(makeGenericType("List", make_unique<BaseTypeToken>(BasicTypeTokenKind::Int)));
+        context["printis"] = make_unique<BasicFunctionTypeToken>(move(printisParams), unitType.clone());
+
+        vector<unique_ptr<TypeToken>> printbsParams;
+        printbsParams.push_back(makeGenericType("List", make_unique<BaseTypeToken>(BasicTypeTokenKind::Boolean)));
+        context["printbs"] = make_unique<BasicFunctionTypeToken>(move(printbsParams), unitType.clone());
+
+        // Persistent vectors share structure between versions, so updates never copy the whole list.
+        vector<unique_ptr<TypeToken>> vectorParams;
+        vectorParams.push_back(makeGenericType("List", make_unique<BaseTypeToken>(BasicTypeTokenKind::Float)));
+        context["vector"] = make_unique<BasicFunctionTypeToken>(move(vectorParams), makeFloatVectorType());
+
+        vector<unique_ptr<TypeToken>> toListParams;
+        toListParams.push_back(makeFloatVectorType());
+        context["toList"] = make_unique<BasicFunctionTypeToken>(move(toListParams), makeGenericType("List", make_unique<BaseTypeToken>(BasicTypeTokenKind::Float)));
+
+        vector<unique_ptr<TypeToken>> appendParams;
+        appendParams.push_back(makeFloatVectorType());
+        appendParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Float));
+        context["append"] = make_unique<BasicFunctionTypeToken>(move(appendParams), makeFloatVectorType());
+
+        vector<unique_ptr<TypeToken>> setParams;
+        setParams.push_back(makeFloatVectorType());
+        setParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Int));
+        setParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Float));
+        context["set"] = make_unique<BasicFunctionTypeToken>(move(setParams), makeFloatVectorType());
+
+        vector<unique_ptr<TypeToken>> getParams;
+        getParams.push_back(makeFloatVectorType());
+        getParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Int));
+        context["get"] = make_unique<BasicFunctionTypeToken>(move(getParams), make_unique<BaseTypeToken>(BasicTypeTokenKind::Float));
+
+        vector<unique_ptr<TypeToken>> countParams;
+        countParams.push_back(makeFloatVectorType());
+        context["count"] = make_unique<BasicFunctionTypeToken>(move(countParams), make_unique<BaseTypeToken>(BasicTypeTokenKind::Int));
+
+        // Kernels over Float lists, vectorised in the runtime.
+        for (auto &kernel : {"sum", "min", "max"}) {
+            vector<unique_ptr<TypeToken>> kernelParams;
+            kernelParams.push_back(makeFloatListType());
+            context[kernel] = make_unique<BasicFunctionTypeToken>(move(kernelParams), make_unique<BaseTypeToken>(BasicTypeTokenKind::Float));
+        }
+
+        vector<unique_ptr<TypeToken>> dotParams;
+        dotParams.push_back(makeFloatListType());
+        dotParams.push_back(makeFloatListType());
+        context["dot"] = make_unique<BasicFunctionTypeToken>(move(dotParams), make_unique<BaseTypeToken>(BasicTypeTokenKind::Float));
+
+        for (auto &kernel : {"scale", "offset"}) {
+            vector<unique_ptr<TypeToken>> kernelParams;
+            kernelParams.push_back(makeFloatListType());
+            kernelParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Float));
+            context[kernel] = make_unique<BasicFunctionTypeToken>(move(kernelParams), makeFloatListType());
+        }
+
+        for (auto &kernel : {"add", "mul"}) {
+            vector<unique_ptr<TypeToken>> kernelParams;
+            kernelParams.push_back(makeFloatListType());
+            kernelParams.push_back(makeFloatListType());
+            context[kernel] = make_unique<BasicFunctionTypeToken>(move(kernelParams), makeFloatListType());
+        }
+
+        vector<unique_ptr<TypeToken>> prefixSumParams;
+        prefixSumParams.push_back(makeFloatListType());
+        context["prefixSum"] = make_unique<BasicFunctionTypeToken>(move(prefixSumParams), makeFloatListType());
+
+        // Input, from files named by their position in the program's arguments. mapFloats reads raw doubles in place.
+        vector<unique_ptr<TypeToken>> mapFloatsParams;
+        mapFloatsParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Int));
+        context["mapFloats"] = make_unique<BasicFunctionTypeToken>(move(mapFloatsParams), makeFloatListType());
+
+        vector<unique_ptr<TypeToken>> readCsvColumnParams;
+        readCsvColumnParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Int));
+        readCsvColumnParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Int));
+        context["readCsvColumn"] = make_unique<BasicFunctionTypeToken>(move(readCsvColumnParams), makeFloatListType());
+
+        // Pipelines over lists, fused into a single loop by the compiler.
+        vector<unique_ptr<TypeToken>> rangeParams;
+        rangeParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Int));
+        rangeParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Int));
+        genericLibrary["range"] = make_pair(vector<string>{}, make_unique<BasicFunctionTypeToken>(move(rangeParams), makeGenericType("List", make_unique<BaseTypeToken>(BasicTypeTokenKind::Int))));
+
+        vector<unique_ptr<TypeToken>> mapParams;
+        mapParams.push_back(makeGenericType("List", make_unique<NamedTypeToken>("A")));
+        mapParams.push_back(makeFunctionType({"A"}, make_unique<NamedTypeToken>("B")));
+        genericLibrary["map"] = make_pair(vector<string>{"A", "B"}, make_unique<BasicFunctionTypeToken>(move(mapParams), makeGenericType("List", make_unique<NamedTypeToken>("B"))));
+
+        vector<unique_ptr<TypeToken>> filterParams;
+        filterParams.push_back(makeGenericType("List", make_unique<NamedTypeToken>("A")));
+        filterParams.push_back(makeFunctionType({"A"}, make_unique<BaseTypeToken>(BasicTypeTokenKind::Boolean)));
+        genericLibrary["filter"] = make_pair(vector<string>{"A"}, make_unique<BasicFunctionTypeToken>(move(filterParams), makeGenericType("List", make_unique<NamedTypeToken>("A"))));
+
+        vector<unique_ptr<TypeToken>> foldParams;
+        foldParams.push_back(makeGenericType("List", make_unique<NamedTypeToken>("A")));
+        foldParams.push_back(make_unique<NamedTypeToken>("B"));
+        foldParams.push_back(makeFunctionType({"B", "A"}, make_unique<NamedTypeToken>("B")));
+        genericLibrary["fold"] = make_pair(vector<string>{"A", "B"}, make_unique<BasicFunctionTypeToken>(move(foldParams), make_unique<NamedTypeToken>("B")));
+
+        // The number of elements in a list, read inline.
+        vector<unique_ptr<TypeToken>> sizeParams;
+        sizeParams.push_back(makeGenericType("List", make_unique<NamedTypeToken>("A")));
+        genericLibrary["size"] = make_pair(vector<string>{"A"}, make_unique<BasicFunctionTypeToken>(move(sizeParams), make_unique<BaseTypeToken>(BasicTypeTokenKind::Int)));
+
+        // Views sharing the storage of their list, made without copying: the elements from start up to end, the
+        // first element, and all but the first.
+        vector<unique_ptr<TypeToken>> sliceParams;
+        sliceParams.push_back(makeGenericType("List", make_unique<NamedTypeToken>("A")));
+        sliceParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Int));
+        sliceParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Int));
+        genericLibrary["slice"] = make_pair(vector<string>{"A"}, make_unique<BasicFunctionTypeToken>(move(sliceParams), makeGenericType("List", make_unique<NamedTypeToken>("A"))));
+
+        vector<unique_ptr<TypeToken>> headParams;
+        headParams.push_back(makeGenericType("List", make_unique<NamedTypeToken>("A")));
+        genericLibrary["head"] = make_pair(vector<string>{"A"}, make_unique<BasicFunctionTypeToken>(move(headParams), make_unique<NamedTypeToken>("A")));
+
+        vector<unique_ptr<TypeToken>> tailParams;
+        tailParams.push_back(makeGenericType("List", make_unique<NamedTypeToken>("A")));
+        genericLibrary["tail"] = make_pair(vector<string>{"A"}, make_unique<BasicFunctionTypeToken>(move(tailParams), makeGenericType("List", make_unique<NamedTypeToken>("A"))));
+
+        // Run on the work-stealing pool in the runtime. Functions passed to them may run on any thread, in any order.
+        vector<unique_ptr<TypeToken>> parMapParams;
+        parMapParams.push_back(makeGenericType("List", make_unique<NamedTypeToken>("A")));
+        parMapParams.push_back(makeFunctionType({"A"}, make_unique<NamedTypeToken>("B")));
+        genericLibrary["parMap"] = make_pair(vector<string>{"A", "B"}, make_unique<BasicFunctionTypeToken>(move(parMapParams), makeGenericType("List", make_unique<NamedTypeToken>("B"))));
+
+        vector<unique_ptr<TypeToken>> parReduceParams;
+        parReduceParams.push_back(makeGenericType("List", make_unique<NamedTypeToken>("A")));
+        parReduceParams.push_back(make_unique<NamedTypeToken>("A"));
+        parReduceParams.push_back(makeFunctionType({"A", "A"}, make_unique<NamedTypeToken>("A")));
+        genericLibrary["parReduce"] = make_pair(vector<string>{"A"}, make_unique<BasicFunctionTypeToken>(move(parReduceParams), make_unique<NamedTypeToken>("A")));
+
+        vector<unique_ptr<TypeToken>> parForParams;
+        parForParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Int));
+        parForParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Int));
+        vector<unique_ptr<TypeToken>> parForBodyParams;
+        parForBodyParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Int));
+        parForParams.push_back(make_unique<BasicFunctionTypeToken>(move(parForBodyParams), unitType.clone()));
+        genericLibrary["parFor"] = make_pair(vector<string>{}, make_unique<BasicFunctionTypeToken>(move(parForParams), unitType.clone()));
+
+        vector<unique_ptr<TypeToken>> printiParams;
+        printiParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Int));
+        context["printi"] = make_unique<BasicFunctionTypeToken>(move(printiParams), unitType.clone());
+
+        vector<unique_ptr<TypeToken>> toIntParams;
+        toIntParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Float));
+        context["toInt"] = make_unique<BasicFunctionTypeToken>(move(toIntParams), make_unique<BaseTypeToken>(BasicTypeTokenKind::Int));
+
+        vector<unique_ptr<TypeToken>> toFloatParams;
+        toFloatParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Int));
+        context["toFloat"] = make_unique<BasicFunctionTypeToken>(move(toFloatParams), make_unique<BaseTypeToken>(BasicTypeTokenKind::Float));
+
+        for (auto &hint : {"likely", "unlikely"}) {
+            vector<unique_ptr<TypeToken>> hintParams;
+            hintParams.push_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Boolean));
+            context[hint] = make_unique<BasicFunctionTypeToken>(move(hintParams), make_unique<BaseTypeToken>(BasicTypeTokenKind::Boolean));
+        }
+
+        overloads.clear();
 
-        context["=="] = move(makeCompareOp());
-        context["!="] = move(makeCompareOp());
-        context[">="] = move(makeCompareOp());
-        context[">"] = move(makeCompareOp());
-        context["<"] = move(makeCompareOp());
-        context["<="] = move(makeCompareOp());
+        for (auto &packed : packedTypes) {
+            auto constructor = "float" + to_string(packed.second);
+            overloads[constructor].push_back(makeOp(vector<BasicTypeTokenKind>(packed.second, BasicTypeTokenKind::Float), packed.first));
+            // With a single Float, it goes in every lane.
+            overloads[constructor].push_back(makeOp({BasicTypeTokenKind::Float}, packed.first));
 
-        context["&&"] = move(makeBooleanOp());
-        context["||"] = move(makeBooleanOp());
+            overloads["lane"].push_back(makeOp({packed.first, BasicTypeTokenKind::Int}, BasicTypeTokenKind::Float));
+            overloads["withLane"].push_back(makeOp({packed.first, BasicTypeTokenKind::Int, BasicTypeTokenKind::Float}, packed.first));
+
+            // Picks each lane of the result from the lanes of both arguments, numbered on from the first.
+            vector<BasicTypeTokenKind> shuffleParams(packed.second + 2, BasicTypeTokenKind::Int);
+            shuffleParams[0] = packed.first;
+            shuffleParams[1] = packed.first;
+            overloads["shuffle"].push_back(makeOp(shuffleParams, packed.first));
+
+            for (auto &reduction : {"hsum", "hmin", "hmax"}) {
+                overloads[reduction].push_back(makeOp({packed.first}, BasicTypeTokenKind::Float));
+            }
+        }
+
+        operators.clear();
+
+        for (auto &op : arithmeticOps) {
+            // Shifts only make sense on integers.
+            if (op != "<<" && op != ">>") {
+                operators[op].push_back(makeNumberOp(BasicTypeTokenKind::Float));
+            }
+
+            operators[op].push_back(makeNumberOp(BasicTypeTokenKind::Int));
+        }
+
+        for (auto &op : {"==", "!=", ">=", ">", "<", "<="}) {
+            operators[op].push_back(makeCompareOp(BasicTypeTokenKind::Float));
+            operators[op].push_back(makeCompareOp(BasicTypeTokenKind::Int));
+        }
+
+        // Packed types work lane by lane, and a Float on either side is used in every lane.
+        for (auto &packed : packedTypes) {
+            for (auto &op : {"+", "-", "*", "/", "%"}) {
+                operators[op].push_back(makeOp(packed.first, packed.first, packed.first));
+                operators[op].push_back(makeOp(packed.first, BasicTypeTokenKind::Float, packed.first));
+                operators[op].push_back(makeOp(BasicTypeTokenKind::Float, packed.first, packed.first));
+            }
+        }
+
+        operators["&&"].push_back(makeBooleanOp());
+        operators["||"].push_back(makeBooleanOp());
 
         contextStack.clear();
         contextStack.push_back(move(context));
     }
 
-    unique_ptr<BasicFunctionTypeToken> makeNumberOp() {
+    unique_ptr<GenericTypeToken> makeGenericType(const string &base, unique_ptr<TypeToken> param) {
+        vector<unique_ptr<TypeToken>> typeParams;
+        typeParams.push_back(move(param));
+
+        return make_unique<GenericTypeToken>(make_unique<TypeConstructorTypeToken>(base, 1), move(typeParams));
+    }
+
+    unique_ptr<BasicFunctionTypeToken> makeFunctionType(const vector<string> &paramNames, unique_ptr<TypeToken> result) {
         vector<unique_ptr<TypeToken>> params;
-        params.emplace_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Float));
-        params.emplace_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Float));
+
+        for (auto &name : paramNames) {
+            params.push_back(make_unique<NamedTypeToken>(name));
+        }
+
+        return make_unique<BasicFunctionTypeToken>(move(params), move(result));
+    }
+
+    unique_ptr<GenericTypeToken> makeFloatListType() {
+        return makeGenericType("List", make_unique<BaseTypeToken>(BasicTypeTokenKind::Float));
+    }
+
+    unique_ptr<GenericTypeToken> makeFloatVectorType() {
+        return makeGenericType("Vector", make_unique<BaseTypeToken>(BasicTypeTokenKind::Float));
+    }
+
+    unique_ptr<BasicFunctionTypeToken> makeNumberOp(BasicTypeTokenKind kind) {
+        vector<unique_ptr<TypeToken>> params;
+        params.emplace_back(make_unique<BaseTypeToken>(kind));
+        params.emplace_back(make_unique<BaseTypeToken>(kind));
 
         return make_unique<BasicFunctionTypeToken>(
                 move(params),
-                move(make_unique<BaseTypeToken>(BasicTypeTokenKind::Float)));
+                move(make_unique<BaseTypeToken>(kind)));
+    }
+
+    unique_ptr<BasicFunctionTypeToken> makeOp(BasicTypeTokenKind left, BasicTypeTokenKind right, BasicTypeTokenKind result) {
+        return makeOp({left, right}, result);
+    }
+
+    unique_ptr<BasicFunctionTypeToken> makeOp(const vector<BasicTypeTokenKind> &paramKinds, BasicTypeTokenKind result) {
+        vector<unique_ptr<TypeToken>> params;
+
+        for (auto kind : paramKinds) {
+            params.emplace_back(make_unique<BaseTypeToken>(kind));
+        }
+
+        return make_unique<BasicFunctionTypeToken>(move(params), make_unique<BaseTypeToken>(result));
     }
 
-    unique_ptr<BasicFunctionTypeToken> makeCompareOp() {
+    unique_ptr<BasicFunctionTypeToken> makeCompareOp(BasicTypeTokenKind kind) {
         vector<unique_ptr<TypeToken>> params;
-        params.emplace_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Float));
-        params.emplace_back(make_unique<BaseTypeToken>(BasicTypeTokenKind::Float));
+        params.emplace_back(make_unique<BaseTypeToken>(kind));
+        params.emplace_back(make_unique<BaseTypeToken>(kind));
 
         return make_unique<BasicFunctionTypeToken>(
                 move(params),
@@ -70,7 +70,7 @@ bool GenericTypeToken::operator==(TypeToken& other) {
     if (other.kind == TypeTokenKind::generic) {
         auto &realOther = (GenericTypeToken&) other;
 
-        return *parent == *realOther.parent && equal(typeParams.begin(), typeParams.end(), realOther.typeParams.begin(), [](const unique_ptr<TypeToken>& left, const unique_ptr<TypeToken>& right){ return *left == *right;});
+        return *parent == *realOther.parent && typeParams.size() == realOther.typeParams.size() && equal(typeParams.begin(), typeParams.end(), realOther.typeParams.begin(), [](const unique_ptr<TypeToken>& left, const unique_ptr<TypeToken>& right){ return *left == *right;});
     } else {
         return false;
     }
@@ -104,7 +104,8 @@ bool BasicFunctionTypeToken::operator==(TypeToken& other) {
     if (other.kind == TypeTokenKind::basicFunction) {
         auto &realOther = (BasicFunctionTypeToken&) other;
 
-        return params == realOther.params && result == realOther.result;
+        return params.size() == realOther.params.size() && *result == *realOther.result &&
+               equal(params.begin(), params.end(), realOther.params.begin(), [](const unique_ptr<TypeToken>& left, const unique_ptr<TypeToken>& right){ return *left == *right;});
     } else {
         return false;
     }
@@ -128,7 +129,7 @@ string BasicFunctionTypeToken::pretty() {
         ans += params[0]->pretty();
         for (int i = 1; i < params.size(); i++) {
             ans += ", ";
-            ans += params[0]->pretty();
+            ans += params[i]->pretty();
         }
     }
 
@@ -154,10 +155,18 @@ string BaseTypeToken::pretty() {
     switch(base) {
         case BasicTypeTokenKind::Float:
             return "Float";
+        case BasicTypeTokenKind::Int:
+            return "Int";
         case BasicTypeTokenKind::Boolean:
             return "Boolean";
         case BasicTypeTokenKind::Unit:
             return "Unit";
+        case BasicTypeTokenKind::Float2:
+            return "Float2";
+        case BasicTypeTokenKind::Float4:
+            return "Float4";
+        case BasicTypeTokenKind::Float8:
+            return "Float8";
         default:
             throw runtime_error("Unknown base type token");
     }
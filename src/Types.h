@@ -19,8 +19,13 @@ enum TypeTokenKind {
 
 enum BasicTypeTokenKind {
     Float,
+    Int,
     Boolean,
-    Unit
+    Unit,
+    // Fixed width groups of Floats, kept in SIMD registers.
+    Float2,
+    Float4,
+    Float8
 };
 
 class TypeToken {